@@ -91,40 +91,84 @@ class FtpClient {
     return rawListing;
   }
 
+  // With resume set, an existing local file is treated as a partial download and only the
+  // remaining bytes are fetched, starting at its length via REST. A local file longer than the
+  // remote one is not a prefix of it, so it is downloaded again from the start.
   Future<void> downloadFile(String remoteFile, String localFile,
-      {Function(double)? onProgress}) async {
-    await _enterPassiveMode();
-    await _sendCommandWithReconnect(FtpCommands.retr(remoteFile));
+      {Function(double)? onProgress, bool resume = false}) async {
     File file = File(localFile);
+    int offset = resume && await file.exists() ? await file.length() : 0;
 
     int totalBytes = 0;
-    int receivedBytes = 0;
+    try {
+      String sizeResponse = await _sendCommand(FtpCommands.size(remoteFile));
+      totalBytes = int.tryParse(sizeResponse.trim().split(' ').last) ?? 0;
+    } catch (e) {
+      // Progress is simply not reported if the server cannot tell the size
+    }
+    if (offset > 0 && offset == totalBytes) {
+      onProgress?.call(1.0);
+      return;
+    }
+    if (offset > totalBytes && totalBytes > 0) {
+      offset = 0;
+    }
 
-    await for (List<int> chunk in _dataSocket!) {
-      file.writeAsBytesSync(chunk, mode: FileMode.append);
-      receivedBytes += chunk.length;
-      if (totalBytes == 0) {
-        // Try to get the file size from the server
-        String sizeResponse = await _sendCommand(FtpCommands.size(remoteFile));
-        totalBytes = int.tryParse(sizeResponse.split(' ').last) ?? 0;
-      }
-      if (onProgress != null && totalBytes > 0) {
-        onProgress(receivedBytes / totalBytes);
+    await _enterPassiveMode();
+    if (offset > 0) {
+      await _sendCommandWithReconnect(FtpCommands.rest(offset));
+    }
+    await _sendCommandWithReconnect(FtpCommands.retr(remoteFile));
+
+    // One sink for the whole transfer instead of reopening the file per chunk
+    IOSink sink =
+        file.openWrite(mode: offset > 0 ? FileMode.append : FileMode.write);
+    int receivedBytes = offset;
+    try {
+      await for (List<int> chunk in _dataSocket!) {
+        sink.add(chunk);
+        receivedBytes += chunk.length;
+        if (onProgress != null && totalBytes > 0) {
+          onProgress(receivedBytes / totalBytes);
+        }
       }
+    } finally {
+      await sink.close();
     }
 
     await _closeDataConnection();
   }
 
+  // With resume set, an existing remote file shorter than the local one is treated as a
+  // partial upload and only the rest is sent with APPE; otherwise the whole file is stored
   Future<void> uploadFile(String localFile, String remoteFile,
-      {Function(double)? onProgress}) async {
-    await _enterPassiveMode();
-    await _sendCommandWithReconnect(FtpCommands.stor(remoteFile));
+      {Function(double)? onProgress, bool resume = false}) async {
     File file = File(localFile);
     int totalBytes = await file.length();
-    int sentBytes = 0;
+    int offset = 0;
+    if (resume) {
+      try {
+        String sizeResponse = await _sendCommand(FtpCommands.size(remoteFile));
+        offset = int.tryParse(sizeResponse.trim().split(' ').last) ?? 0;
+      } catch (e) {
+        // No remote file yet: upload all of it
+      }
+      if (offset > 0 && offset == totalBytes) {
+        onProgress?.call(1.0);
+        return;
+      }
+      if (offset > totalBytes) {
+        offset = 0;
+      }
+    }
+
+    await _enterPassiveMode();
+    await _sendCommandWithReconnect(offset > 0
+        ? FtpCommands.appe(remoteFile)
+        : FtpCommands.stor(remoteFile));
+    int sentBytes = offset;
 
-    await file.openRead().listen((List<int> chunk) async {
+    await file.openRead(offset).listen((List<int> chunk) async {
       _dataSocket!.add(chunk);
       sentBytes += chunk.length;
       if (onProgress != null) {
@@ -12,4 +12,6 @@ class FtpCommands {
   static String rmd(String directory) => 'RMD $directory';
   static String dele(String filename) => 'DELE $filename';
   static String size(String filename) => 'SIZE $filename';
+  static String rest(int offset) => 'REST $offset';
+  static String appe(String filename) => 'APPE $filename';
 }
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Runs every scenario in this directory against a freshly started local server and writes one
+# JSON result per scenario to bench-results/. Run from server/src via `make bench`.
+# BENCH_PORT, BENCH_WORKERS and BENCH_ARGS (extra server options) can be set in the environment.
+set -e
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+port=${BENCH_PORT:-2121}
+results=${BENCH_RESULTS:-bench-results}
+# The workers bind with SO_REUSEPORT, so a server already on the port would not make ours fail to
+# start; it would quietly take part of the connections instead
+if awk -v port="$(printf '%04X' "$port")" '$4 == "0A" && substr($2, length($2) - 3) == port { found = 1 }
+        END { exit !found }' /proc/net/tcp /proc/net/tcp6 2>/dev/null; then
+    echo "run.sh: port $port is already in use; stop that server or set BENCH_PORT" >&2
+    exit 1
+fi
+root=$(mktemp -d)
+mkdir -p "$results"
+
+./server -port "$port" -root "$root" ${BENCH_WORKERS:+-workers "$BENCH_WORKERS"} $BENCH_ARGS >"$results/server.log" &
+server_pid=$!
+trap 'kill $server_pid 2>/dev/null; rm -rf "$root"' EXIT INT TERM
+sleep 0.5
+if ! kill -0 $server_pid 2>/dev/null; then
+    echo "run.sh: the server did not start; see $results/server.log" >&2
+    exit 1
+fi
+
+for scenario in "$bench_dir"/*.scn; do
+    name=$(basename "$scenario" .scn)
+    ./loadgen -scenario "$scenario" -port "$port" -json "$results/$name.json"
+    echo
+done
+echo "Results written to $results/"
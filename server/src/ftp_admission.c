@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "ftp_admission.h"
+
+// Sessions open from one address; unlinked when the last one closes
+typedef struct AdmissionEntry
+{
+    in_addr_t addr;
+    int sessions;
+    struct AdmissionEntry *next;
+} AdmissionEntry;
+
+// Aligned so stripes taken by different workers never share a cache line
+typedef struct
+{
+    pthread_mutex_t lock;
+    AdmissionEntry *buckets[ADMISSION_BUCKETS];
+    AdmissionEntry *spare; // unlinked entries kept for the next new address
+} __attribute__((aligned(64))) AdmissionStripe;
+
+static int limit_sessions = 0;
+static int limit_per_ip = 0;
+static int shed_threshold = 0;
+static int active_sessions = 0; // only counted when limit_sessions is set
+static AdmissionStripe stripes[ADMISSION_STRIPES];
+
+void admission_init(int max_sessions, int max_per_ip)
+{
+    limit_sessions = max_sessions > 0 ? max_sessions : 0;
+    limit_per_ip = max_per_ip > 0 ? max_per_ip : 0;
+    shed_threshold = (int)((long)limit_sessions * ADMISSION_SHED_PERCENT / 100);
+    for (int i = 0; i < ADMISSION_STRIPES; i++)
+    {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    }
+}
+
+// Fibonacci hashing; the top bits pick the stripe and the next ones the chain
+static uint32_t addr_hash(in_addr_t addr)
+{
+    return (uint32_t)addr * 2654435769u;
+}
+
+static AdmissionStripe *stripe_of(uint32_t hash)
+{
+    return &stripes[hash >> 26];
+}
+
+static AdmissionEntry **bucket_of(AdmissionStripe *stripe, uint32_t hash)
+{
+    return &stripe->buckets[(hash >> 20) & (ADMISSION_BUCKETS - 1)];
+}
+
+static int enter_ip(in_addr_t addr)
+{
+    uint32_t hash = addr_hash(addr);
+    AdmissionStripe *stripe = stripe_of(hash);
+    AdmissionEntry **bucket = bucket_of(stripe, hash);
+    int admitted = 0;
+
+    pthread_mutex_lock(&stripe->lock);
+    AdmissionEntry *entry = *bucket;
+    while (entry != NULL && entry->addr != addr)
+    {
+        entry = entry->next;
+    }
+    if (entry == NULL)
+    {
+        entry = stripe->spare;
+        if (entry != NULL)
+        {
+            stripe->spare = entry->next;
+        }
+        else
+        {
+            entry = malloc(sizeof(AdmissionEntry));
+        }
+        if (entry != NULL)
+        {
+            entry->addr = addr;
+            entry->sessions = 0;
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+    if (entry != NULL && entry->sessions < limit_per_ip)
+    {
+        entry->sessions++;
+        admitted = 1;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return admitted;
+}
+
+static void leave_ip(in_addr_t addr)
+{
+    uint32_t hash = addr_hash(addr);
+    AdmissionStripe *stripe = stripe_of(hash);
+
+    pthread_mutex_lock(&stripe->lock);
+    for (AdmissionEntry **link = bucket_of(stripe, hash); *link != NULL; link = &(*link)->next)
+    {
+        AdmissionEntry *entry = *link;
+        if (entry->addr != addr)
+        {
+            continue;
+        }
+        if (--entry->sessions == 0)
+        {
+            *link = entry->next;
+            entry->next = stripe->spare;
+            stripe->spare = entry;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+Admission admission_enter(struct in_addr addr)
+{
+    if (limit_sessions > 0 && __atomic_add_fetch(&active_sessions, 1, __ATOMIC_RELAXED) > limit_sessions)
+    {
+        __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+        return ADMIT_SERVER_FULL;
+    }
+    if (limit_per_ip > 0 && !enter_ip(addr.s_addr))
+    {
+        if (limit_sessions > 0)
+        {
+            __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+        }
+        return ADMIT_IP_FULL;
+    }
+    return ADMIT_OK;
+}
+
+void admission_leave(struct in_addr addr)
+{
+    if (limit_per_ip > 0)
+    {
+        leave_ip(addr.s_addr);
+    }
+    if (limit_sessions > 0)
+    {
+        __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int admission_overloaded(void)
+{
+    return limit_sessions > 0 && __atomic_load_n(&active_sessions, __ATOMIC_RELAXED) >= shed_threshold;
+}
@@ -0,0 +1,28 @@
+#ifndef FTP_ADMISSION_H
+#define FTP_ADMISSION_H
+
+#include <netinet/in.h>
+
+#define ADMISSION_STRIPES 64      // per-IP table locks; a connect only contends with addresses hashed to its stripe
+#define ADMISSION_BUCKETS 64      // chains per stripe
+#define ADMISSION_SHED_PERCENT 90 // share of -max-sessions at which idle sessions are shed early
+#define ADMISSION_SHED_IDLE 10    // seconds a control connection may stay idle while shedding
+
+typedef enum
+{
+    ADMIT_OK,
+    ADMIT_SERVER_FULL, // -max-sessions reached
+    ADMIT_IP_FULL      // -max-per-ip reached for the client's address
+} Admission;
+
+// Shared by every worker, since SO_REUSEPORT spreads one client's connections over all of
+// them. A limit of 0 is unlimited. Called once, before the workers start.
+void admission_init(int max_sessions, int max_per_ip);
+// Counts a new control connection from addr against both limits. Only ADMIT_OK takes a
+// slot, which admission_leave() gives back when the session closes.
+Admission admission_enter(struct in_addr addr);
+void admission_leave(struct in_addr addr);
+// Whether sessions have reached ADMISSION_SHED_PERCENT of -max-sessions
+int admission_overloaded(void);
+
+#endif // FTP_ADMISSION_H
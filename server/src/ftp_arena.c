@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "ftp_arena.h"
+
+struct ArenaSpill
+{
+    struct ArenaSpill *next;
+    max_align_t data[];
+};
+
+void arena_init(Arena *arena, void *storage, size_t cap)
+{
+    arena->base = storage;
+    arena->used = 0;
+    arena->cap = cap;
+    arena->spill = NULL;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (start <= arena->cap && size <= arena->cap - start)
+    {
+        arena->used = start + size;
+        return arena->base + start;
+    }
+
+    struct ArenaSpill *spill = malloc(sizeof(struct ArenaSpill) + size);
+    if (spill == NULL)
+    {
+        return NULL;
+    }
+    spill->next = arena->spill;
+    arena->spill = spill;
+    return spill->data;
+}
+
+char *arena_vprintf(Arena *arena, const char *fmt, va_list ap)
+{
+    va_list measure;
+    va_copy(measure, ap);
+    int len = vsnprintf(NULL, 0, fmt, measure);
+    va_end(measure);
+    if (len < 0)
+    {
+        return NULL;
+    }
+
+    char *out = arena_alloc(arena, (size_t)len + 1);
+    if (out != NULL)
+    {
+        vsnprintf(out, (size_t)len + 1, fmt, ap);
+    }
+    return out;
+}
+
+char *arena_printf(Arena *arena, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    char *out = arena_vprintf(arena, fmt, ap);
+    va_end(ap);
+    return out;
+}
+
+void arena_reset(Arena *arena)
+{
+    while (arena->spill != NULL)
+    {
+        struct ArenaSpill *next = arena->spill->next;
+        free(arena->spill);
+        arena->spill = next;
+    }
+    arena->used = 0;
+}
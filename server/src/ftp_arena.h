@@ -0,0 +1,26 @@
+#ifndef FTP_ARENA_H
+#define FTP_ARENA_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#define ARENA_ALIGN 16
+
+// Bump allocator for memory that only lives until the end of the current command. The first
+// cap bytes come from storage owned by the caller; anything beyond spills to malloc() and is
+// released by the next arena_reset().
+typedef struct
+{
+    char *base;
+    size_t used;
+    size_t cap;
+    struct ArenaSpill *spill;
+} Arena;
+
+void arena_init(Arena *arena, void *storage, size_t cap);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_vprintf(Arena *arena, const char *fmt, va_list ap);
+char *arena_printf(Arena *arena, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void arena_reset(Arena *arena);
+
+#endif // FTP_ARENA_H
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "ftp_block.h"
+#include "ftp_transfer.h"
+#include "ftp_list.h"
+
+// Extended block mode (MODE E): every block on every connection starts with a 17-byte header,
+// a descriptor byte followed by a 64-bit count and a 64-bit file offset, both big-endian.
+// Blocks can therefore arrive on any connection in any order and are written where they belong.
+
+static void put_u64(unsigned char *out, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        out[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_u64(const unsigned char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static void set_header(DataStream *stream, unsigned char desc, uint64_t count, uint64_t offset)
+{
+    stream->header[0] = desc;
+    put_u64(stream->header + 1, count);
+    put_u64(stream->header + 9, offset);
+    stream->header_len = BLOCK_HEADER_SIZE;
+    stream->header_off = 0;
+}
+
+static void stream_close(ClientSession *session, DataStream *stream)
+{
+    if (stream->ev.fd >= 0)
+    {
+        ev_close(session->worker, &stream->ev);
+        session->stream_count--;
+    }
+}
+
+static uint32_t stream_events(const ClientSession *session)
+{
+    return session->xfer.kind == XFER_STOR ? EPOLLIN : EPOLLOUT;
+}
+
+// Senders wait until every connection the client announced has arrived, so the EOF block
+// can state the final connection count
+static int block_ready(const ClientSession *session)
+{
+    if (session->xfer.kind == XFER_STOR)
+    {
+        return 1;
+    }
+    return session->stream_count >= session->parallelism || session->pasv.fd < 0;
+}
+
+static void block_start(ClientSession *session)
+{
+    if (!block_ready(session))
+    {
+        return;
+    }
+
+    session->xfer.lead_stream = -1;
+    for (int i = 0; i < MAX_STREAMS; i++)
+    {
+        DataStream *stream = &session->streams[i];
+        if (stream->ev.fd < 0)
+        {
+            continue;
+        }
+        if (session->xfer.lead_stream < 0)
+        {
+            session->xfer.lead_stream = i;
+        }
+        ev_set(session->worker, &stream->ev, stream_events(session));
+    }
+}
+
+void block_add_stream(ClientSession *session, int fd)
+{
+    for (int i = 0; i < MAX_STREAMS; i++)
+    {
+        DataStream *stream = &session->streams[i];
+        if (stream->ev.fd >= 0)
+        {
+            continue;
+        }
+
+        memset(stream, 0, sizeof(*stream));
+        stream->ev = (EventSource){EV_STREAM, fd, 0, 0, session};
+        session->stream_count++;
+        ev_set(session->worker, &stream->ev, session->xfer.kind == XFER_STOR ? EPOLLIN : 0);
+        if (session->xfer.kind == XFER_RETR || session->xfer.kind == XFER_LIST)
+        {
+            block_start(session);
+        }
+        return;
+    }
+    close(fd);
+}
+
+void block_reset(ClientSession *session)
+{
+    for (int i = 0; i < MAX_STREAMS; i++)
+    {
+        stream_close(session, &session->streams[i]);
+    }
+}
+
+// Called by transfer_begin() in MODE E. An active-mode connection becomes the only stream.
+void block_begin(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (session->data.fd >= 0)
+    {
+        block_add_stream(session, ev_detach(session->worker, &session->data));
+    }
+
+    xfer->eod_count = 0;
+    xfer->eod_expected = 0;
+    if (xfer->kind == XFER_RETR)
+    {
+        struct stat st;
+        xfer->end = fstat(xfer->file_fd, &st) == 0 ? st.st_size : 0;
+    }
+    block_start(session);
+}
+
+static int check_done(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->eod_expected > 0 && xfer->eod_count >= xfer->eod_expected)
+    {
+        transfer_complete(session);
+        return 1;
+    }
+    return 0;
+}
+
+// Picks the next block for a sending stream, or ends the stream with EOD once nothing is left
+static int claim_block(ClientSession *session, DataStream *stream)
+{
+    Transfer *xfer = &session->xfer;
+    off_t count = 0;
+
+    if (xfer->kind == XFER_LIST)
+    {
+        // A listing is produced in order, so it all goes over the first connection
+        if (stream == &session->streams[xfer->lead_stream])
+        {
+            count = lister_fill(xfer->lister, xfer->buffer, xfer->buf_cap);
+            xfer->buf_off = 0;
+            xfer->buf_len = count;
+        }
+    }
+    else if (xfer->offset < xfer->end)
+    {
+        count = xfer->end - xfer->offset < BLOCK_SIZE ? xfer->end - xfer->offset : BLOCK_SIZE;
+    }
+
+    if (count > 0)
+    {
+        set_header(stream, 0, count, xfer->offset);
+        stream->offset = xfer->offset;
+        stream->remaining = count;
+        xfer->offset += count;
+        return 0;
+    }
+
+    unsigned char desc = BLOCK_DESC_EOD;
+    uint64_t eodc = 0;
+    if (xfer->eod_expected == 0)
+    {
+        desc |= BLOCK_DESC_EOF;
+        eodc = session->stream_count;
+        xfer->eod_expected = session->stream_count;
+    }
+    set_header(stream, desc, 0, eodc);
+    stream->eod = 1;
+    return 0;
+}
+
+// Sends part of the block payload; returns bytes sent or -1 with errno set
+static ssize_t send_payload(ClientSession *session, DataStream *stream)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->kind == XFER_LIST)
+    {
+        ssize_t sent = send(stream->ev.fd, xfer->buffer + xfer->buf_off, xfer->buf_len - xfer->buf_off, MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            xfer->buf_off += sent;
+        }
+        return sent;
+    }
+
+    size_t chunk = stream->remaining < SENDFILE_CHUNK ? stream->remaining : SENDFILE_CHUNK;
+    if (xfer->io == XFER_IO_SENDFILE)
+    {
+        ssize_t sent = sendfile(stream->ev.fd, xfer->file_fd, &stream->offset, chunk);
+        if (sent >= 0 || (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP))
+        {
+            return sent;
+        }
+        xfer->io = XFER_IO_BUFFERED;
+    }
+
+    // The buffer holds nothing between calls, so every stream can use it: whatever the socket
+    // did not take is simply read again
+    if (xfer->buffer == NULL)
+    {
+        xfer->buffer = malloc(RETR_BUFFER_SIZE);
+        xfer->buf_cap = RETR_BUFFER_SIZE;
+        if (xfer->buffer == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    char *buffer = xfer->buffer;
+    ssize_t bytes_read = pread(xfer->file_fd, buffer, chunk < xfer->buf_cap ? chunk : xfer->buf_cap, stream->offset);
+    if (bytes_read <= 0)
+    {
+        if (bytes_read == 0)
+        {
+            errno = EIO; // the file shrank under us
+        }
+        return -1;
+    }
+    ssize_t sent = send(stream->ev.fd, buffer, bytes_read, MSG_NOSIGNAL);
+    if (sent > 0)
+    {
+        stream->offset += sent;
+    }
+    return sent;
+}
+
+static void block_pump_send(ClientSession *session, DataStream *stream)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->kind == XFER_LIST && xfer->buffer == NULL)
+    {
+        xfer->buffer = malloc(LIST_BUFFER_SIZE);
+        xfer->buf_cap = LIST_BUFFER_SIZE;
+        if (xfer->buffer == NULL)
+        {
+            transfer_fail(session, ENOMEM);
+            return;
+        }
+    }
+
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        ssize_t sent;
+        if (stream->header_off < stream->header_len)
+        {
+            int more = stream->remaining > 0 ? MSG_MORE : 0;
+            sent = send(stream->ev.fd, stream->header + stream->header_off, stream->header_len - stream->header_off, MSG_NOSIGNAL | more);
+            if (sent > 0)
+            {
+                stream->header_off += sent;
+            }
+        }
+        else if (stream->remaining > 0)
+        {
+            sent = send_payload(session, stream);
+            if (sent > 0)
+            {
+                stream->remaining -= sent;
+            }
+        }
+        else if (stream->eod)
+        {
+            // Everything for this connection is queued; close() still delivers it
+            stream_close(session, stream);
+            xfer->eod_count++;
+            check_done(session);
+            return;
+        }
+        else
+        {
+            claim_block(session, stream);
+            continue;
+        }
+
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            transfer_fail(session, errno);
+            return;
+        }
+        xfer->bytes += sent;
+    }
+}
+
+static void block_pump_recv(ClientSession *session, DataStream *stream)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->buffer == NULL)
+    {
+        void *buffer = NULL;
+        if (posix_memalign(&buffer, STOR_BUFFER_ALIGN, stor_buffer_size) != 0)
+        {
+            transfer_fail(session, ENOMEM);
+            return;
+        }
+        xfer->buffer = buffer;
+        xfer->buf_cap = stor_buffer_size;
+    }
+
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        ssize_t bytes_read;
+        if (stream->remaining == 0)
+        {
+            bytes_read = recv(stream->ev.fd, stream->header + stream->header_len, BLOCK_HEADER_SIZE - stream->header_len, 0);
+        }
+        else
+        {
+            size_t want = stream->remaining < (off_t)xfer->buf_cap ? (size_t)stream->remaining : xfer->buf_cap;
+            bytes_read = recv(stream->ev.fd, xfer->buffer, want, 0);
+        }
+
+        if (bytes_read == 0)
+        {
+            // The sender must end every connection with an EOD block first
+            transfer_fail(session, ECONNRESET);
+            return;
+        }
+        if (bytes_read < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            transfer_fail(session, errno);
+            return;
+        }
+        xfer->bytes += bytes_read;
+
+        if (stream->remaining > 0)
+        {
+            ssize_t written = pwrite(xfer->file_fd, xfer->buffer, bytes_read, stream->offset);
+            if (written != bytes_read)
+            {
+                transfer_fail(session, written < 0 ? errno : EIO);
+                return;
+            }
+            stream->offset += written;
+            stream->remaining -= written;
+            if (stream->offset > xfer->offset)
+            {
+                xfer->offset = stream->offset; // highest byte written, for the ALLO trim
+            }
+        }
+        else
+        {
+            stream->header_len += bytes_read;
+            if (stream->header_len < BLOCK_HEADER_SIZE)
+            {
+                continue;
+            }
+            stream->header_len = 0;
+
+            unsigned char desc = stream->header[0];
+            uint64_t count = get_u64(stream->header + 1);
+            uint64_t offset = get_u64(stream->header + 9);
+            if (desc & BLOCK_DESC_EOF)
+            {
+                // The EOF block carries no data; its offset field is the connection count
+                xfer->eod_expected = offset > 0 ? (int)offset : 1;
+            }
+            else if (count > 0)
+            {
+                if (offset > (uint64_t)INT64_MAX - count)
+                {
+                    transfer_fail(session, EINVAL);
+                    return;
+                }
+                stream->offset = offset;
+                stream->remaining = count;
+            }
+            if (desc & BLOCK_DESC_EOD)
+            {
+                stream->eod = 1;
+            }
+        }
+
+        if (stream->eod && stream->remaining == 0)
+        {
+            stream_close(session, stream);
+            xfer->eod_count++;
+            check_done(session);
+            return;
+        }
+        if (check_done(session))
+        {
+            return;
+        }
+    }
+}
+
+void block_pump(ClientSession *session, DataStream *stream, uint32_t events)
+{
+    if (session->xfer.kind == XFER_NONE)
+    {
+        if (events & (EPOLLHUP | EPOLLERR))
+        {
+            // The client dropped an idle connection
+            stream_close(session, stream);
+        }
+        return;
+    }
+
+    if (session->xfer.kind == XFER_STOR)
+    {
+        block_pump_recv(session, stream);
+    }
+    else
+    {
+        block_pump_send(session, stream);
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef FTP_BLOCK_H
+#define FTP_BLOCK_H
+
+#include "ftp_server.h"
+
+#define BLOCK_SIZE (1 << 20) // bytes per data block a RETR stream claims at a time
+
+// Descriptor bits of an extended block header
+#define BLOCK_DESC_EOD 0x08 // no more data on this connection
+#define BLOCK_DESC_EOF 0x40 // the offset field carries the number of connections (EODC)
+
+void block_add_stream(ClientSession *session, int fd);
+void block_reset(ClientSession *session);
+void block_begin(ClientSession *session);
+void block_pump(ClientSession *session, DataStream *stream, uint32_t events);
+
+#endif // FTP_BLOCK_H
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "ftp_codec.h"
+
+typedef struct
+{
+    int (*init)(Codec *codec);
+    int (*reset)(Codec *codec, int level);
+    int (*process)(Codec *codec, const char *in, size_t in_len, size_t *consumed,
+                   char *out, size_t out_cap, size_t *produced, int finish);
+    void (*destroy)(Codec *codec);
+} CodecOps;
+
+struct Codec
+{
+    CodecKind kind;
+    const CodecOps *ops;
+    int compress;
+    int level;
+    union
+    {
+        z_stream zs;
+#ifdef HAVE_ZSTD
+        ZSTD_CCtx *cctx;
+        ZSTD_DCtx *dctx;
+#endif
+    } u;
+};
+
+static int deflate_init(Codec *codec)
+{
+    memset(&codec->u.zs, 0, sizeof(codec->u.zs));
+    if (codec->compress)
+    {
+        return deflateInit(&codec->u.zs, DEFLATE_DEFAULT_LEVEL) == Z_OK ? 0 : -1;
+    }
+    return inflateInit(&codec->u.zs) == Z_OK ? 0 : -1;
+}
+
+static int deflate_reset(Codec *codec, int level)
+{
+    if (!codec->compress)
+    {
+        return inflateReset(&codec->u.zs) == Z_OK ? 0 : -1;
+    }
+    if (deflateReset(&codec->u.zs) != Z_OK)
+    {
+        return -1;
+    }
+    // deflateParams() on a freshly reset stream only swaps tables, it does not flush anything
+    if (level != codec->level && deflateParams(&codec->u.zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int deflate_process(Codec *codec, const char *in, size_t in_len, size_t *consumed,
+                           char *out, size_t out_cap, size_t *produced, int finish)
+{
+    z_stream *zs = &codec->u.zs;
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = (uInt)in_len;
+    zs->next_out = (Bytef *)out;
+    zs->avail_out = (uInt)out_cap;
+
+    int rc = codec->compress ? deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH) : inflate(zs, Z_NO_FLUSH);
+    *consumed = in_len - zs->avail_in;
+    *produced = out_cap - zs->avail_out;
+    if (rc == Z_STREAM_END)
+    {
+        return 1;
+    }
+    // Z_BUF_ERROR only means no progress was possible with the buffers given
+    return (rc == Z_OK || rc == Z_BUF_ERROR) ? 0 : -1;
+}
+
+static void deflate_destroy(Codec *codec)
+{
+    if (codec->compress)
+    {
+        deflateEnd(&codec->u.zs);
+    }
+    else
+    {
+        inflateEnd(&codec->u.zs);
+    }
+}
+
+static const CodecOps deflate_ops = {deflate_init, deflate_reset, deflate_process, deflate_destroy};
+
+#ifdef HAVE_ZSTD
+static int zstd_init(Codec *codec)
+{
+    if (codec->compress)
+    {
+        codec->u.cctx = ZSTD_createCCtx();
+        return codec->u.cctx != NULL ? 0 : -1;
+    }
+    codec->u.dctx = ZSTD_createDCtx();
+    return codec->u.dctx != NULL ? 0 : -1;
+}
+
+static int zstd_reset(Codec *codec, int level)
+{
+    if (!codec->compress)
+    {
+        return ZSTD_isError(ZSTD_DCtx_reset(codec->u.dctx, ZSTD_reset_session_only)) ? -1 : 0;
+    }
+    if (ZSTD_isError(ZSTD_CCtx_reset(codec->u.cctx, ZSTD_reset_session_only)))
+    {
+        return -1;
+    }
+    return ZSTD_isError(ZSTD_CCtx_setParameter(codec->u.cctx, ZSTD_c_compressionLevel, level)) ? -1 : 0;
+}
+
+static int zstd_process(Codec *codec, const char *in, size_t in_len, size_t *consumed,
+                        char *out, size_t out_cap, size_t *produced, int finish)
+{
+    ZSTD_inBuffer input = {in, in_len, 0};
+    ZSTD_outBuffer output = {out, out_cap, 0};
+    size_t rc;
+    if (codec->compress)
+    {
+        rc = ZSTD_compressStream2(codec->u.cctx, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+    }
+    else
+    {
+        rc = ZSTD_decompressStream(codec->u.dctx, &output, &input);
+    }
+    *consumed = input.pos;
+    *produced = output.pos;
+    if (ZSTD_isError(rc))
+    {
+        return -1;
+    }
+    // For both directions 0 means a frame has been completely flushed or decoded
+    return (rc == 0 && (finish || !codec->compress)) ? 1 : 0;
+}
+
+static void zstd_destroy(Codec *codec)
+{
+    if (codec->compress)
+    {
+        ZSTD_freeCCtx(codec->u.cctx);
+    }
+    else
+    {
+        ZSTD_freeDCtx(codec->u.dctx);
+    }
+}
+
+static const CodecOps zstd_ops = {zstd_init, zstd_reset, zstd_process, zstd_destroy};
+#endif
+
+static const CodecOps *codec_ops(CodecKind kind)
+{
+    switch (kind)
+    {
+    case CODEC_DEFLATE:
+        return &deflate_ops;
+    case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+        return &zstd_ops;
+#else
+        return NULL;
+#endif
+    }
+    return NULL;
+}
+
+int codec_available(CodecKind kind)
+{
+    return codec_ops(kind) != NULL;
+}
+
+int codec_max_level(CodecKind kind)
+{
+#ifdef HAVE_ZSTD
+    if (kind == CODEC_ZSTD)
+    {
+        return ZSTD_maxCLevel();
+    }
+#endif
+    (void)kind;
+    return Z_BEST_COMPRESSION;
+}
+
+Codec *codec_create(CodecKind kind, int compress)
+{
+    const CodecOps *ops = codec_ops(kind);
+    if (ops == NULL)
+    {
+        return NULL;
+    }
+
+    Codec *codec = calloc(1, sizeof(Codec));
+    if (codec == NULL)
+    {
+        return NULL;
+    }
+    codec->kind = kind;
+    codec->ops = ops;
+    codec->compress = compress;
+    codec->level = kind == CODEC_ZSTD ? ZSTD_DEFAULT_LEVEL : DEFLATE_DEFAULT_LEVEL;
+    if (ops->init(codec) < 0)
+    {
+        free(codec);
+        return NULL;
+    }
+    return codec;
+}
+
+int codec_reset(Codec *codec, int level)
+{
+    if (codec->ops->reset(codec, level) < 0)
+    {
+        return -1;
+    }
+    codec->level = level;
+    return 0;
+}
+
+int codec_process(Codec *codec, const char *in, size_t in_len, size_t *consumed,
+                  char *out, size_t out_cap, size_t *produced, int finish)
+{
+    return codec->ops->process(codec, in, in_len, consumed, out, out_cap, produced, finish);
+}
+
+void codec_destroy(Codec *codec)
+{
+    if (codec != NULL)
+    {
+        codec->ops->destroy(codec);
+        free(codec);
+    }
+}
+
+CodecKind codec_kind(const Codec *codec)
+{
+    return codec->kind;
+}
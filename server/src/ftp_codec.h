@@ -0,0 +1,32 @@
+#ifndef FTP_CODEC_H
+#define FTP_CODEC_H
+
+#include <stddef.h>
+
+#define CODEC_BUFFER_SIZE (64 * 1024)
+#define DEFLATE_DEFAULT_LEVEL 6
+#define ZSTD_DEFAULT_LEVEL 3
+
+typedef enum
+{
+    CODEC_DEFLATE, // MODE Z: a zlib (RFC 1950) stream
+    CODEC_ZSTD     // OPTS MODE Z ENGINE zstd, only when built with HAVE_ZSTD
+} CodecKind;
+
+typedef struct Codec Codec;
+
+// A streaming transform between the file and the data socket. A session keeps one compressor and
+// one decompressor for its lifetime and resets them between transfers instead of reallocating.
+Codec *codec_create(CodecKind kind, int compress);
+int codec_reset(Codec *codec, int level);
+// Moves bytes from in to out. Returns 1 once the stream is complete (all input flushed when
+// compressing with finish set, end-of-stream marker seen when decompressing), 0 to continue,
+// -1 on corrupt input or an internal error.
+int codec_process(Codec *codec, const char *in, size_t in_len, size_t *consumed,
+                  char *out, size_t out_cap, size_t *produced, int finish);
+void codec_destroy(Codec *codec);
+CodecKind codec_kind(const Codec *codec);
+int codec_available(CodecKind kind);
+int codec_max_level(CodecKind kind);
+
+#endif // FTP_CODEC_H
@@ -0,0 +1,55 @@
+#include "ftp_command.h"
+#include "ftp_server.h"
+#include "ftp_command_table.h"
+
+static const FtpCommand commands[CMD_COUNT] = {
+#define FTP_COMMAND(name, handler, auth, arity) [CMD_##name] = {#name, CMD_##name, handler, auth, arity},
+#include "ftp_commands.def"
+#undef FTP_COMMAND
+};
+
+uint64_t command_opcode(const char *name)
+{
+    uint64_t opcode = 0;
+    int i;
+    for (i = 0; i < 8 && name[i] != '\0'; i++)
+    {
+        unsigned char c = name[i];
+        if (c >= 'a' && c <= 'z')
+        {
+            c -= 'a' - 'A';
+        }
+        else if ((c < 'A' || c > 'Z') && (i == 0 || c < '0' || c > '9'))
+        {
+            return 0;
+        }
+        opcode = (opcode << 8) | c;
+    }
+    if (i < 3 || name[i] != '\0')
+    {
+        return 0;
+    }
+    return opcode << (8 * (8 - i));
+}
+
+// One multiply, one shift and one compare; the slot table is generated so no two commands collide
+const FtpCommand *command_lookup(const char *name)
+{
+    uint64_t opcode = command_opcode(name);
+    if (opcode == 0)
+    {
+        return NULL;
+    }
+
+    uint32_t slot = (uint32_t)((opcode * COMMAND_HASH_MULT) >> COMMAND_HASH_SHIFT);
+    if (command_slots[slot].opcode != opcode)
+    {
+        return NULL;
+    }
+    return &commands[command_slots[slot].id];
+}
+
+const char *command_name(CommandId id)
+{
+    return commands[id].name;
+}
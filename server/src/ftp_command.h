@@ -0,0 +1,46 @@
+#ifndef FTP_COMMAND_H
+#define FTP_COMMAND_H
+
+#include <stdint.h>
+
+struct ClientSession;
+
+typedef enum
+{
+    AUTH_NONE,
+    AUTH_REQUIRED
+} CommandAuth;
+
+typedef enum
+{
+    ARG_NONE,
+    ARG_OPTIONAL,
+    ARG_REQUIRED
+} CommandArity;
+
+typedef enum
+{
+#define FTP_COMMAND(name, handler, auth, arity) CMD_##name,
+#include "ftp_commands.def"
+#undef FTP_COMMAND
+    CMD_COUNT
+} CommandId;
+
+typedef void (*CommandHandler)(struct ClientSession *session, char *args);
+
+typedef struct
+{
+    const char *name;
+    CommandId id;
+    CommandHandler handler;
+    CommandAuth auth;
+    CommandArity arity;
+} FtpCommand;
+
+// Packs up to eight letters and digits into an uppercase big-endian opcode; returns 0 for
+// anything that cannot be a command name
+uint64_t command_opcode(const char *name);
+const FtpCommand *command_lookup(const char *name);
+const char *command_name(CommandId id);
+
+#endif // FTP_COMMAND_H
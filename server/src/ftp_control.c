@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "ftp_control.h"
+
+#define RING_MASK (CMD_BUFFER_SIZE - 1)
+#define TELNET_IAC 0xff
+
+size_t ring_space(const CommandRing *ring)
+{
+    return CMD_BUFFER_SIZE - (ring->tail - ring->head);
+}
+
+// Reads as much as fits, using both halves of the ring when the free space wraps.
+// Returns 0 on EOF, -1 with errno set on error (EAGAIN when the ring is full).
+ssize_t ring_fill(CommandRing *ring, int fd)
+{
+    size_t space = ring_space(ring);
+    if (space == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t start = ring->tail & RING_MASK;
+    size_t first = CMD_BUFFER_SIZE - start;
+    struct iovec iov[2];
+    iov[0].iov_base = ring->data + start;
+    iov[0].iov_len = first < space ? first : space;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = space - iov[0].iov_len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+    ssize_t bytes_read = recvmsg(fd, &msg, 0);
+    if (bytes_read > 0)
+    {
+        ring->tail += bytes_read;
+    }
+    return bytes_read;
+}
+
+// Finds the first '\n' at or after ring->scanned; returns its absolute offset or (size_t)-1
+static size_t ring_find_newline(CommandRing *ring)
+{
+    size_t pos = ring->scanned > ring->head ? ring->scanned : ring->head;
+    while (pos < ring->tail)
+    {
+        size_t start = pos & RING_MASK;
+        size_t run = CMD_BUFFER_SIZE - start;
+        if (run > ring->tail - pos)
+        {
+            run = ring->tail - pos;
+        }
+        const char *hit = memchr(ring->data + start, '\n', run);
+        if (hit != NULL)
+        {
+            return pos + (size_t)(hit - (ring->data + start));
+        }
+        pos += run;
+    }
+    ring->scanned = ring->tail;
+    return (size_t)-1;
+}
+
+// Copies the next complete command line into line without consuming it. CR/LF framing and
+// Telnet IAC sequences (sent ahead of ABOR) are stripped. Returns 1 when a line is ready,
+// 0 when more input is needed, and -1 once for every over-long line that had to be dropped.
+int ring_peek_line(CommandRing *ring, char *line, size_t cap, size_t *consumed)
+{
+    for (;;)
+    {
+        size_t newline = ring_find_newline(ring);
+        if (newline == (size_t)-1)
+        {
+            if (ring->discarding)
+            {
+                ring->head = ring->tail;
+                return 0;
+            }
+            if (ring_space(ring) > 0)
+            {
+                return 0;
+            }
+            // A full ring without a line terminator: drop it and skip to the next '\n'
+            ring->head = ring->tail;
+            ring->discarding = 1;
+            return -1;
+        }
+
+        if (ring->discarding)
+        {
+            ring->head = newline + 1;
+            ring->scanned = ring->head;
+            ring->discarding = 0;
+            continue;
+        }
+
+        size_t len = 0;
+        for (size_t pos = ring->head; pos < newline && len + 1 < cap; pos++)
+        {
+            unsigned char c = (unsigned char)ring->data[pos & RING_MASK];
+            if (c == TELNET_IAC && pos + 1 < newline)
+            {
+                pos++;
+                if ((unsigned char)ring->data[pos & RING_MASK] != TELNET_IAC)
+                {
+                    continue; // a Telnet command such as IP or DM
+                }
+            }
+            else if (c == 0xf2 && len == 0)
+            {
+                continue; // a Data Mark delivered inline by the urgent pointer
+            }
+            line[len++] = (char)c;
+        }
+        if (len > 0 && line[len - 1] == '\r')
+        {
+            len--;
+        }
+        line[len] = '\0';
+        *consumed = newline + 1 - ring->head;
+        return 1;
+    }
+}
+
+void ring_consume(CommandRing *ring, size_t consumed)
+{
+    ring->head += consumed;
+    if (ring->scanned < ring->head)
+    {
+        ring->scanned = ring->head;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef FTP_CONTROL_H
+#define FTP_CONTROL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CMD_BUFFER_SIZE 4096 // must be a power of two
+#define REPLY_HIGH_WATER (16 * 1024)
+#define REPLY_MAX (1024 * 1024)
+
+// Control-channel input: bytes are appended at tail and command lines consumed from head.
+// head, tail and scanned only ever grow; positions are taken modulo CMD_BUFFER_SIZE.
+typedef struct
+{
+    char data[CMD_BUFFER_SIZE];
+    size_t head;
+    size_t tail;
+    size_t scanned;  // bytes before this offset are known not to contain '\n'
+    int discarding;  // dropping the rest of an over-long line
+} CommandRing;
+
+size_t ring_space(const CommandRing *ring);
+ssize_t ring_fill(CommandRing *ring, int fd);
+int ring_peek_line(CommandRing *ring, char *line, size_t cap, size_t *consumed);
+void ring_consume(CommandRing *ring, size_t consumed);
+
+#endif // FTP_CONTROL_H
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include "ftp_digest.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u // reflected
+
+static const char *const digest_names[DIGEST_COUNT] = {"SHA-256", "MD5", "CRC32", "CRC32C"};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_shift[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+typedef void (*BlockFunc)(uint32_t *state, const unsigned char *data, size_t blocks);
+typedef uint32_t (*CrcFunc)(uint32_t crc, const unsigned char *data, size_t len);
+
+static BlockFunc sha256_blocks;
+static CrcFunc crc32c_update;
+static const char *sha256_kernel = "portable";
+static const char *crc32c_kernel = "portable";
+
+// Slicing-by-8 tables for the portable CRC32C
+static uint32_t crc32c_table[8][256];
+
+static uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static uint32_t rotl(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t load_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t load_le32(const unsigned char *p)
+{
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static void sha256_blocks_portable(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = load_be32(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+static void md5_blocks(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        uint32_t m[16];
+        for (int i = 0; i < 16; i++)
+        {
+            m[i] = load_le32(data + 4 * i);
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t f;
+            int g;
+            switch (i / 16)
+            {
+            case 0:
+                f = (b & c) | (~b & d);
+                g = i;
+                break;
+            case 1:
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+                break;
+            case 2:
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+                break;
+            default:
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+                break;
+            }
+            uint32_t next = b + rotl(a + f + md5_k[i] + m[g], md5_shift[(i / 16) * 4 + i % 4]);
+            a = d;
+            d = c;
+            c = b;
+            b = next;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+}
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *data, size_t len)
+{
+    while (len >= 8)
+    {
+        uint32_t lo = crc ^ load_le32(data);
+        uint32_t hi = load_le32(data + 4);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^ crc32c_table[5][(lo >> 16) & 0xff] ^
+              crc32c_table[4][lo >> 24] ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+    {
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+// The crc32 instruction has a latency of three cycles but issues one per cycle, so three
+// independent streams keep it busy. Their CRCs are merged by advancing the earlier ones over
+// the bytes that follow them, which is a linear map applied here through lookup tables.
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, mat++)
+    {
+        if (vec & 1)
+        {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+    {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// Tables that advance a CRC over len zero bytes, one per byte of the CRC
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len)
+{
+    uint32_t even[32]; // operator for an even power of two zero bits
+    uint32_t odd[32];
+    odd[0] = CRC32C_POLY; // one zero bit
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd); // two zero bits
+    gf2_matrix_square(odd, even); // four
+
+    // Squaring doubles the operator's length, starting from one byte, until len runs out
+    uint32_t *op = even;
+    for (;;)
+    {
+        gf2_matrix_square(even, odd);
+        op = even;
+        len >>= 1;
+        if (len == 0)
+        {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        op = odd;
+        len >>= 1;
+        if (len == 0)
+        {
+            break;
+        }
+    }
+
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint64_t load_u64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t crc0 = crc;
+    while (len > 0 && ((uintptr_t)data & 7) != 0)
+    {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *data++);
+        len--;
+    }
+
+    while (len >= CRC32C_LONG * 3)
+    {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char *end = data + CRC32C_LONG;
+        do
+        {
+            crc0 = _mm_crc32_u64(crc0, load_u64(data));
+            crc1 = _mm_crc32_u64(crc1, load_u64(data + CRC32C_LONG));
+            crc2 = _mm_crc32_u64(crc2, load_u64(data + 2 * CRC32C_LONG));
+            data += 8;
+        } while (data < end);
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc2;
+        data += 2 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+
+    while (len >= CRC32C_SHORT * 3)
+    {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char *end = data + CRC32C_SHORT;
+        do
+        {
+            crc0 = _mm_crc32_u64(crc0, load_u64(data));
+            crc1 = _mm_crc32_u64(crc1, load_u64(data + CRC32C_SHORT));
+            crc2 = _mm_crc32_u64(crc2, load_u64(data + 2 * CRC32C_SHORT));
+            data += 8;
+        } while (data < end);
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+        data += 2 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+
+    for (; len >= 8; len -= 8, data += 8)
+    {
+        crc0 = _mm_crc32_u64(crc0, load_u64(data));
+    }
+    while (len-- > 0)
+    {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *data++);
+    }
+    return (uint32_t)crc0;
+}
+
+// Four rounds with the SHA-NI instructions; w holds the next four message words
+#define SHA256_ROUNDS(state0, state1, w, i)                                                   \
+    do                                                                                        \
+    {                                                                                         \
+        __m128i msg = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *)&sha256_k[4 * (i)])); \
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                                  \
+        msg = _mm_shuffle_epi32(msg, 0x0e);                                                   \
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);                                  \
+    } while (0)
+
+// Next four schedule words from the sixteen before them, kept in w0..w3 oldest first
+#define SHA256_SCHEDULE(w0, w1, w2, w3) \
+    (w0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)), w3))
+
+__attribute__((target("sha,ssse3,sse4.1"))) static void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions want the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), byteswap);
+        __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), byteswap);
+        __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), byteswap);
+        __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), byteswap);
+
+        SHA256_ROUNDS(state0, state1, w0, 0);
+        SHA256_ROUNDS(state0, state1, w1, 1);
+        SHA256_ROUNDS(state0, state1, w2, 2);
+        SHA256_ROUNDS(state0, state1, w3, 3);
+        for (int i = 4; i < 16; i += 4)
+        {
+            SHA256_SCHEDULE(w0, w1, w2, w3);
+            SHA256_ROUNDS(state0, state1, w0, i);
+            SHA256_SCHEDULE(w1, w2, w3, w0);
+            SHA256_ROUNDS(state0, state1, w1, i + 1);
+            SHA256_SCHEDULE(w2, w3, w0, w1);
+            SHA256_ROUNDS(state0, state1, w2, i + 2);
+            SHA256_SCHEDULE(w3, w0, w1, w2);
+            SHA256_ROUNDS(state0, state1, w3, i + 3);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#endif // __x86_64__
+
+void digest_setup(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            crc32c_table[k][n] = crc32c_table[0][crc32c_table[k - 1][n] & 0xff] ^ (crc32c_table[k - 1][n] >> 8);
+        }
+    }
+    sha256_blocks = sha256_blocks_portable;
+    crc32c_update = crc32c_portable;
+
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+    {
+        crc32c_zeros(crc32c_long, CRC32C_LONG);
+        crc32c_zeros(crc32c_short, CRC32C_SHORT);
+        crc32c_update = crc32c_sse42;
+        crc32c_kernel = "sse4.2";
+
+        int sse41 = (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+        if (sse41 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+        {
+            sha256_blocks = sha256_blocks_shani;
+            sha256_kernel = "sha-ni";
+        }
+    }
+#endif
+}
+
+int digest_lookup(const char *name)
+{
+    for (int i = 0; i < DIGEST_COUNT; i++)
+    {
+        if (strcasecmp(name, digest_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *digest_name(DigestAlgo algo)
+{
+    return digest_names[algo];
+}
+
+const char *digest_kernel(DigestAlgo algo)
+{
+    switch (algo)
+    {
+    case DIGEST_SHA256:
+        return sha256_kernel;
+    case DIGEST_CRC32C:
+        return crc32c_kernel;
+    case DIGEST_CRC32:
+        return "zlib";
+    default:
+        return "portable";
+    }
+}
+
+void digest_begin(Digest *digest, DigestAlgo algo)
+{
+    static const uint32_t sha256_init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    static const uint32_t md5_init[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+    memset(digest, 0, sizeof(*digest));
+    digest->algo = algo;
+    switch (algo)
+    {
+    case DIGEST_SHA256:
+        memcpy(digest->state, sha256_init, sizeof(sha256_init));
+        break;
+    case DIGEST_MD5:
+        memcpy(digest->state, md5_init, sizeof(md5_init));
+        break;
+    case DIGEST_CRC32:
+        digest->state[0] = crc32(0, Z_NULL, 0);
+        break;
+    default:
+        digest->state[0] = 0xffffffffu;
+        break;
+    }
+}
+
+// SHA-256 and MD5 take whole 64-byte blocks; a partial one waits in digest->block
+static void digest_blocks(Digest *digest, const unsigned char *data, size_t len)
+{
+    BlockFunc blocks = digest->algo == DIGEST_SHA256 ? sha256_blocks : md5_blocks;
+    if (digest->block_len > 0)
+    {
+        size_t take = 64 - digest->block_len < len ? 64 - digest->block_len : len;
+        memcpy(digest->block + digest->block_len, data, take);
+        digest->block_len += take;
+        data += take;
+        len -= take;
+        if (digest->block_len < 64)
+        {
+            return;
+        }
+        blocks(digest->state, digest->block, 1);
+        digest->block_len = 0;
+    }
+    if (len >= 64)
+    {
+        blocks(digest->state, data, len / 64);
+        data += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(digest->block, data, len);
+    digest->block_len = len;
+}
+
+void digest_update(Digest *digest, const void *data, size_t len)
+{
+    digest->length += len;
+    switch (digest->algo)
+    {
+    case DIGEST_SHA256:
+    case DIGEST_MD5:
+        digest_blocks(digest, data, len);
+        break;
+    case DIGEST_CRC32:
+        digest->state[0] = crc32_z(digest->state[0], data, len);
+        break;
+    default:
+        digest->state[0] = crc32c_update(digest->state[0], data, len);
+        break;
+    }
+}
+
+void digest_end(Digest *digest, char hex[DIGEST_HEX_MAX])
+{
+    unsigned char out[32];
+    size_t out_len;
+    if (digest->algo == DIGEST_SHA256 || digest->algo == DIGEST_MD5)
+    {
+        // Padding: a one bit, zeros, then the length in bits
+        unsigned char pad[72] = {0x80};
+        uint64_t bits = digest->length * 8;
+        size_t pad_len = (digest->block_len < 56 ? 56 : 120) - digest->block_len;
+        for (int i = 0; i < 8; i++)
+        {
+            pad[pad_len + i] = digest->algo == DIGEST_SHA256 ? (unsigned char)(bits >> (56 - 8 * i)) : (unsigned char)(bits >> (8 * i));
+        }
+        digest_blocks(digest, pad, pad_len + 8);
+
+        int words = digest->algo == DIGEST_SHA256 ? 8 : 4;
+        for (int i = 0; i < words; i++)
+        {
+            uint32_t word = digest->state[i];
+            for (int j = 0; j < 4; j++)
+            {
+                out[4 * i + j] = digest->algo == DIGEST_SHA256 ? (unsigned char)(word >> (24 - 8 * j)) : (unsigned char)(word >> (8 * j));
+            }
+        }
+        out_len = 4 * words;
+    }
+    else
+    {
+        uint32_t crc = digest->algo == DIGEST_CRC32 ? digest->state[0] : ~digest->state[0];
+        for (int i = 0; i < 4; i++)
+        {
+            out[i] = (unsigned char)(crc >> (24 - 8 * i));
+        }
+        out_len = 4;
+    }
+
+    for (size_t i = 0; i < out_len; i++)
+    {
+        snprintf(hex + 2 * i, 3, "%02x", out[i]);
+    }
+}
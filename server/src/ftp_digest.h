@@ -0,0 +1,41 @@
+#ifndef FTP_DIGEST_H
+#define FTP_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    DIGEST_SHA256,
+    DIGEST_MD5,
+    DIGEST_CRC32,  // IEEE 802.3, the CRC XCRC and most tools report
+    DIGEST_CRC32C, // Castagnoli, what iSCSI, ext4 and most storage stacks use
+    DIGEST_COUNT
+} DigestAlgo;
+
+#define DIGEST_HEX_MAX 65 // SHA-256 in hex plus the terminator
+
+// Running state of one checksum; fed with digest_update() in any sized pieces
+typedef struct
+{
+    DigestAlgo algo;
+    uint64_t length;
+    uint32_t state[8];
+    unsigned char block[64]; // SHA-256 and MD5: input not yet a full block
+    size_t block_len;
+} Digest;
+
+// Picks the SSE4.2 and SHA-NI kernels when the CPU has them; called once at startup
+void digest_setup(void);
+// "SHA-256", "MD5", "CRC32" or "CRC32C", in any case; -1 for anything else
+int digest_lookup(const char *name);
+const char *digest_name(DigestAlgo algo);
+// Which implementation digest_update() uses for algo, for the startup log
+const char *digest_kernel(DigestAlgo algo);
+
+void digest_begin(Digest *digest, DigestAlgo algo);
+void digest_update(Digest *digest, const void *data, size_t len);
+// Writes the result as lowercase hex
+void digest_end(Digest *digest, char hex[DIGEST_HEX_MAX]);
+
+#endif // FTP_DIGEST_H
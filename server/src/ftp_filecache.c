@@ -0,0 +1,707 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "ftp_filecache.h"
+#include "ftp_path.h"
+#include "ftp_log.h"
+
+int file_cache_enabled = 1;
+
+// Everything that can change what a cached fd, size or listing stands for
+#define FILE_CACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                           IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+// Events that also change the directory's own line in its parent's listing (mtime, link count)
+#define DIRENT_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef enum
+{
+    ENTRY_FILE,   // an open file, keyed by its path
+    ENTRY_LISTING // a formatted LIST or MLSD body, keyed by its directory
+} EntryKind;
+
+typedef struct FileCacheEntry
+{
+    struct FileCache *cache;
+    EntryKind kind;
+    int variant;   // ENTRY_LISTING: format and dot-file setting, see listing_variant()
+    char *vpath;   // NULL while the entry is free
+    int fd;        // ENTRY_FILE: read-only, shared by every transfer of the file
+    off_t size;
+    char *body;    // ENTRY_LISTING: shared by every session sending it
+    size_t len;
+    int watch;     // index into the cache's watches
+    int subdirs[FILE_CACHE_SUBDIRS]; // ENTRY_LISTING: watches on the subdirectories it describes
+    int subdir_count;
+    int refs;      // transfers currently reading fd or body
+    int stale;     // invalidated while still being read; closed by the last reader
+    struct FileCacheEntry *hash_next; // bucket chain, or the free list
+    struct FileCacheEntry *lru_prev;  // towards the most recently used
+    struct FileCacheEntry *lru_next;
+} FileCacheEntry;
+
+// One inotify watch per directory holding cached files or listings, and per ancestor of one,
+// since renaming any directory on the way to a file changes what its path names
+typedef struct
+{
+    int wd;      // -1 when the slot is unused
+    char *vdir;
+    int users;   // entries, pending listings and watched subdirectories relying on it
+    int parent;  // watch on the parent directory, -1 for the root
+    int moved;   // the directory was renamed or removed; vdir no longer names it
+} FileCacheWatch;
+
+// Per worker like the directory handles, so lookups take no lock
+typedef struct FileCache
+{
+    EventSource ev; // the inotify fd
+    Worker *worker;
+    FileCacheEntry entries[FILE_CACHE_ENTRIES];
+    FileCacheEntry *buckets[FILE_CACHE_BUCKETS];
+    FileCacheEntry *free_list;
+    FileCacheEntry *lru_head; // most recently used
+    FileCacheEntry *lru_tail;
+    FileCacheWatch watches[FILE_CACHE_WATCHES];
+    size_t listing_bytes; // held by listing bodies, stale ones included
+} FileCache;
+
+FileCache *file_cache_create(Worker *worker)
+{
+    FileCache *cache = calloc(1, sizeof(FileCache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->ev = (EventSource){EV_FILE_CACHE, inotify_init1(IN_NONBLOCK | IN_CLOEXEC), 0, 0, NULL};
+    if (cache->ev.fd < 0)
+    {
+        LOG_WARN("worker %d: inotify unavailable (%s), RETR opens every file", worker->id, strerror(errno));
+        free(cache);
+        return NULL;
+    }
+    cache->worker = worker;
+    for (int i = FILE_CACHE_ENTRIES - 1; i >= 0; i--)
+    {
+        cache->entries[i].cache = cache;
+        cache->entries[i].fd = -1;
+        cache->entries[i].hash_next = cache->free_list;
+        cache->free_list = &cache->entries[i];
+    }
+    for (int i = 0; i < FILE_CACHE_WATCHES; i++)
+    {
+        cache->watches[i].wd = -1;
+    }
+    ev_set(worker, &cache->ev, EPOLLIN);
+    return cache;
+}
+
+static int listing_variant(ListFormat format, int show_hidden)
+{
+    return (int)format * 2 + (show_hidden != 0);
+}
+
+static size_t bucket_of(EntryKind kind, int variant, const char *vpath)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)vpath; *p != '\0'; p++)
+    {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    hash = (hash ^ (uint64_t)(kind * 4 + variant)) * 1099511628211ULL;
+    return hash % FILE_CACHE_BUCKETS;
+}
+
+static FileCacheEntry *lookup(FileCache *cache, EntryKind kind, int variant, const char *vpath)
+{
+    for (FileCacheEntry *e = cache->buckets[bucket_of(kind, variant, vpath)]; e != NULL; e = e->hash_next)
+    {
+        if (e->kind == kind && e->variant == variant && strcmp(e->vpath, vpath) == 0)
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(FileCache *cache, FileCacheEntry *e)
+{
+    if (e->lru_prev != NULL)
+    {
+        e->lru_prev->lru_next = e->lru_next;
+    }
+    else
+    {
+        cache->lru_head = e->lru_next;
+    }
+    if (e->lru_next != NULL)
+    {
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    else
+    {
+        cache->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void lru_push(FileCache *cache, FileCacheEntry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+    {
+        cache->lru_head->lru_prev = e;
+    }
+    cache->lru_head = e;
+    if (cache->lru_tail == NULL)
+    {
+        cache->lru_tail = e;
+    }
+}
+
+// Cuts vpath down to its parent directory; 0 for the root, which has none
+static int parent_of(char *vpath)
+{
+    char *slash = strrchr(vpath, '/');
+    if (vpath[1] == '\0')
+    {
+        return 0;
+    }
+    slash[slash == vpath ? 1 : 0] = '\0';
+    return 1;
+}
+
+// Drops a reference on a watch, and on its ancestors when it goes
+static void watch_put(FileCache *cache, int index)
+{
+    while (index >= 0)
+    {
+        FileCacheWatch *watch = &cache->watches[index];
+        if (--watch->users > 0)
+        {
+            return;
+        }
+        inotify_rm_watch(cache->ev.fd, watch->wd);
+        free(watch->vdir);
+        watch->vdir = NULL;
+        watch->wd = -1;
+        index = watch->parent;
+    }
+}
+
+// Watches vdir for the cache, and every directory above it, sharing watches already taken
+static int watch_get(FileCache *cache, const char *vdir)
+{
+    for (int i = 0; i < FILE_CACHE_WATCHES; i++)
+    {
+        FileCacheWatch *watch = &cache->watches[i];
+        if (watch->wd >= 0 && !watch->moved && strcmp(watch->vdir, vdir) == 0)
+        {
+            watch->users++;
+            return i;
+        }
+    }
+
+    int parent = -1;
+    char up[PATH_MAX];
+    snprintf(up, sizeof(up), "%s", vdir);
+    if (parent_of(up) && (parent = watch_get(cache, up)) < 0)
+    {
+        return -1;
+    }
+    int unused = -1;
+    for (int i = 0; i < FILE_CACHE_WATCHES && unused < 0; i++)
+    {
+        unused = cache->watches[i].wd < 0 ? i : -1;
+    }
+
+    // Workers run with the root as their working directory. With the parent watched first, a
+    // symlink anywhere on the path is the last component of some watch, which IN_DONT_FOLLOW
+    // and IN_ONLYDIR refuse, so nothing is cached through one.
+    char *copy = unused >= 0 ? strdup(vdir) : NULL;
+    int wd = copy != NULL ? inotify_add_watch(cache->ev.fd, vdir[1] == '\0' ? "." : vdir + 1, FILE_CACHE_EVENTS | IN_DONT_FOLLOW)
+                          : -1;
+    for (int i = 0; i < FILE_CACHE_WATCHES && wd >= 0; i++)
+    {
+        if (cache->watches[i].wd == wd)
+        {
+            // Another name for a directory already watched (a bind mount, or the old watch of a
+            // directory moved back); its events would only reach the entries under that one
+            wd = -1;
+        }
+    }
+    if (wd < 0)
+    {
+        free(copy);
+        watch_put(cache, parent);
+        return -1;
+    }
+    cache->watches[unused] = (FileCacheWatch){wd, copy, 1, parent, 0};
+    return unused;
+}
+
+static void entry_close(FileCache *cache, FileCacheEntry *e)
+{
+    if (e->kind == ENTRY_LISTING)
+    {
+        cache->listing_bytes -= e->len;
+        free(e->body);
+        e->body = NULL;
+    }
+    else
+    {
+        close(e->fd);
+    }
+    free(e->vpath);
+    e->fd = -1;
+    e->vpath = NULL;
+    e->stale = 0;
+    e->hash_next = cache->free_list;
+    cache->free_list = e;
+}
+
+// Takes e out of the table; a file still being sent stays open until its last reader is done
+static void entry_drop(FileCache *cache, FileCacheEntry *e)
+{
+    FileCacheEntry **link = &cache->buckets[bucket_of(e->kind, e->variant, e->vpath)];
+    while (*link != e)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = e->hash_next;
+    e->hash_next = NULL;
+    lru_unlink(cache, e);
+    watch_put(cache, e->watch);
+    for (int i = 0; i < e->subdir_count; i++)
+    {
+        watch_put(cache, e->subdirs[i]);
+    }
+    e->subdir_count = 0;
+    counter_sub(&cache->worker->metrics.file_cache_entries, 1);
+
+    if (e->refs > 0)
+    {
+        e->stale = 1;
+    }
+    else
+    {
+        entry_close(cache, e);
+    }
+}
+
+static void invalidate_watch(FileCache *cache, int index)
+{
+    for (int i = 0; i < FILE_CACHE_ENTRIES; i++)
+    {
+        FileCacheEntry *e = &cache->entries[i];
+        if (e->vpath != NULL && !e->stale && e->watch == index)
+        {
+            entry_drop(cache, e);
+            counter_add(&cache->worker->metrics.file_cache_invalidations, 1);
+        }
+    }
+}
+
+// The directory of watch index was renamed or removed: everything cached under its old name
+// goes, through whichever subdirectory it was cached, and those watches are never reused
+static void invalidate_tree(FileCache *cache, int index)
+{
+    // Handles opened through the old name would keep resolving paths inside it
+    path_forget_tree(cache->worker, cache->watches[index].vdir);
+    for (int i = 0; i < FILE_CACHE_WATCHES; i++)
+    {
+        for (int up = cache->watches[i].wd >= 0 ? i : -1; up >= 0; up = cache->watches[up].parent)
+        {
+            if (up == index)
+            {
+                cache->watches[i].moved = 1;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < FILE_CACHE_WATCHES; i++)
+    {
+        if (cache->watches[i].wd >= 0 && cache->watches[i].moved)
+        {
+            invalidate_watch(cache, i);
+        }
+    }
+}
+
+static void drop_if_cached(FileCache *cache, EntryKind kind, int variant, const char *vpath)
+{
+    FileCacheEntry *e = lookup(cache, kind, variant, vpath);
+    if (e != NULL)
+    {
+        entry_drop(cache, e);
+        counter_add(&cache->worker->metrics.file_cache_invalidations, 1);
+    }
+}
+
+static void drop_listings(FileCache *cache, const char *vdir)
+{
+    for (int variant = 0; variant < 4; variant++)
+    {
+        drop_if_cached(cache, ENTRY_LISTING, variant, vdir);
+    }
+}
+
+// vpath changed: its own entries go, and so does the listing of the directory holding it. When
+// a name was added or removed, that directory's line in its parent's listing is stale as well.
+static void forget(FileCache *cache, const char *vpath, int dirent)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", vpath);
+    drop_if_cached(cache, ENTRY_FILE, 0, dir);
+    drop_listings(cache, dir);
+    if (parent_of(dir))
+    {
+        drop_listings(cache, dir);
+        if (dirent && parent_of(dir))
+        {
+            drop_listings(cache, dir);
+        }
+    }
+}
+
+void file_cache_forget(Worker *worker, const char *vpath, int dirent)
+{
+    if (worker->file_cache != NULL)
+    {
+        forget(worker->file_cache, vpath, dirent);
+    }
+}
+
+static void invalidate_name(FileCache *cache, int wd, const char *name, uint32_t mask)
+{
+    for (int i = 0; i < FILE_CACHE_WATCHES; i++)
+    {
+        FileCacheWatch *watch = &cache->watches[i];
+        if (watch->wd != wd || watch->moved)
+        {
+            continue;
+        }
+        char vpath[PATH_MAX];
+        snprintf(vpath, sizeof(vpath), "%s/%s", watch->vdir[1] == '\0' ? "" : watch->vdir, name);
+        if ((mask & IN_ISDIR) && (mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+        {
+            // A subdirectory went or was replaced; its handles, and any below it, are stale
+            path_forget_tree(cache->worker, vpath);
+        }
+        forget(cache, vpath, (mask & DIRENT_EVENTS) != 0);
+        return;
+    }
+}
+
+void file_cache_sync(FileCache *cache)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;)
+    {
+        ssize_t n = read(cache->ev.fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return;
+        }
+
+        const struct inotify_event *event;
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were lost, renames among them perhaps, so nothing cached can be trusted
+                for (int i = 0; i < FILE_CACHE_WATCHES; i++)
+                {
+                    if (cache->watches[i].wd >= 0 && cache->watches[i].parent < 0)
+                    {
+                        invalidate_tree(cache, i);
+                    }
+                }
+            }
+            else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                // The directory is gone or now lives elsewhere, and so does everything below it
+                for (int i = 0; i < FILE_CACHE_WATCHES; i++)
+                {
+                    if (cache->watches[i].wd == event->wd && !cache->watches[i].moved)
+                    {
+                        invalidate_tree(cache, i);
+                        break;
+                    }
+                }
+            }
+            else if (event->len > 0)
+            {
+                invalidate_name(cache, event->wd, event->name, event->mask);
+            }
+        }
+    }
+}
+
+// A free entry, evicting the least recently used ones nobody is reading until there is a slot
+// and room for bytes more of listing bodies; NULL if that cannot be done
+static FileCacheEntry *entry_alloc(FileCache *cache, size_t bytes)
+{
+    if (bytes > FILE_CACHE_LISTING_BYTES)
+    {
+        return NULL;
+    }
+    for (;;)
+    {
+        int need_slot = cache->free_list == NULL;
+        int need_bytes = cache->listing_bytes + bytes > FILE_CACHE_LISTING_BYTES;
+        if (!need_slot && !need_bytes)
+        {
+            break;
+        }
+        FileCacheEntry *victim = cache->lru_tail;
+        while (victim != NULL && (victim->refs > 0 || (!need_slot && victim->kind != ENTRY_LISTING)))
+        {
+            victim = victim->lru_prev;
+        }
+        if (victim == NULL)
+        {
+            return NULL;
+        }
+        entry_drop(cache, victim);
+        counter_add(&cache->worker->metrics.file_cache_evictions, 1);
+    }
+    FileCacheEntry *e = cache->free_list;
+    cache->free_list = e->hash_next;
+    e->hash_next = NULL;
+    return e;
+}
+
+// Takes over the caller's reference on watch, and gives the caller one on the entry
+static FileCacheEntry *entry_insert(FileCache *cache, EntryKind kind, int variant, const char *vpath, int watch, size_t bytes)
+{
+    // A directory seen to move since the watch was taken may have been read under its new name
+    FileCacheEntry *e = cache->watches[watch].moved ? NULL : entry_alloc(cache, bytes);
+    char *copy = e != NULL ? strdup(vpath) : NULL;
+    if (e == NULL || copy == NULL)
+    {
+        if (e != NULL)
+        {
+            e->hash_next = cache->free_list;
+            cache->free_list = e;
+        }
+        free(copy);
+        watch_put(cache, watch);
+        return NULL;
+    }
+    e->kind = kind;
+    e->variant = variant;
+    e->vpath = copy;
+    e->watch = watch;
+    e->subdir_count = 0;
+    e->refs = 1;
+    size_t bucket = bucket_of(kind, variant, vpath);
+    e->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = e;
+    lru_push(cache, e);
+    counter_add(&cache->worker->metrics.file_cache_entries, 1);
+    return e;
+}
+
+static void entry_touch(FileCache *cache, FileCacheEntry *e)
+{
+    lru_unlink(cache, e);
+    lru_push(cache, e);
+    e->refs++;
+}
+
+int file_cache_open(ClientSession *session, const char *arg, off_t *size, FileCacheEntry **entry)
+{
+    FileCache *cache = session->worker->file_cache;
+    *entry = NULL;
+    ResolvedPath resolved;
+    int watch = -1;
+    if (cache != NULL)
+    {
+        if (path_normalize(session->cwd, arg, resolved.vpath, sizeof(resolved.vpath)) < 0)
+        {
+            return -1;
+        }
+        // Changes made through any worker are already queued on the inotify fd
+        file_cache_sync(cache);
+        FileCacheEntry *e = lookup(cache, ENTRY_FILE, 0, resolved.vpath);
+        if (e != NULL)
+        {
+            counter_add(&session->worker->metrics.file_cache_hits, 1);
+            entry_touch(cache, e);
+            *size = e->size;
+            *entry = e;
+            return e->fd;
+        }
+        counter_add(&session->worker->metrics.file_cache_misses, 1);
+
+        // Watch the directory before opening, so no change after the open can go unseen
+        char vdir[PATH_MAX];
+        strcpy(vdir, resolved.vpath);
+        parent_of(vdir);
+        watch = watch_get(cache, vdir);
+    }
+
+    struct stat st;
+    int fd = path_open(session, arg, O_RDONLY, 0, &resolved);
+    if (fd >= 0 && fstat(fd, &st) != 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        fd = -1;
+    }
+    if (fd < 0 || !S_ISREG(st.st_mode) || st.st_size > FILE_CACHE_MAX_SIZE)
+    {
+        if (watch >= 0)
+        {
+            int err = errno;
+            watch_put(cache, watch);
+            errno = err;
+        }
+        if (fd >= 0)
+        {
+            *size = st.st_size;
+        }
+        return fd;
+    }
+    *size = st.st_size;
+    if (watch >= 0 && (*entry = entry_insert(cache, ENTRY_FILE, 0, resolved.vpath, watch, 0)) != NULL)
+    {
+        (*entry)->fd = fd;
+        (*entry)->size = st.st_size;
+    }
+    return fd;
+}
+
+// A listing shows each subdirectory's size, link count and mtime, which change with no event on
+// the directory listed, so the subdirectories are watched as well
+static int watch_subdirs(FileCache *cache, const char *vdir, int show_hidden, FileCachePending *pending)
+{
+    int fd = open(vdir[1] == '\0' ? "." : vdir + 1, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    int ok = 1;
+    struct dirent *d;
+    while (ok && (d = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if ((d->d_name[0] == '.' && (!show_hidden || strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)) ||
+            (d->d_type != DT_DIR &&
+             (d->d_type != DT_UNKNOWN || fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode))))
+        {
+            continue;
+        }
+        char sub[PATH_MAX];
+        int len = snprintf(sub, sizeof(sub), "%s/%s", vdir[1] == '\0' ? "" : vdir, d->d_name);
+        ok = pending->subdir_count < FILE_CACHE_SUBDIRS && len > 0 && (size_t)len < sizeof(sub) &&
+             (pending->subdirs[pending->subdir_count] = watch_get(cache, sub)) >= 0;
+        pending->subdir_count += ok;
+    }
+    closedir(dir);
+    return ok ? 0 : -1;
+}
+
+FileCacheEntry *file_cache_listing(ClientSession *session, const char *vdir, ListFormat format, int show_hidden,
+                                   FileCachePending *pending)
+{
+    FileCache *cache = session->worker->file_cache;
+    pending->watch = -1;
+    pending->subdir_count = 0;
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    file_cache_sync(cache);
+    FileCacheEntry *e = lookup(cache, ENTRY_LISTING, listing_variant(format, show_hidden), vdir);
+    if (e != NULL)
+    {
+        counter_add(&session->worker->metrics.listing_cache_hits, 1);
+        entry_touch(cache, e);
+        return e;
+    }
+    counter_add(&session->worker->metrics.listing_cache_misses, 1);
+    pending->watch = watch_get(cache, vdir);
+    if (pending->watch >= 0 && watch_subdirs(cache, vdir, show_hidden, pending) < 0)
+    {
+        file_cache_cancel(session->worker, pending);
+    }
+    return NULL;
+}
+
+FileCacheEntry *file_cache_put_listing(Worker *worker, FileCachePending *pending, const char *vdir, ListFormat format,
+                                       int show_hidden, char *body, size_t len)
+{
+    FileCache *cache = worker->file_cache;
+    if (cache == NULL || pending->watch < 0)
+    {
+        return NULL;
+    }
+    FileCacheEntry *e = entry_insert(cache, ENTRY_LISTING, listing_variant(format, show_hidden), vdir, pending->watch, len);
+    pending->watch = -1;
+    if (e == NULL)
+    {
+        file_cache_cancel(worker, pending);
+    }
+    else
+    {
+        memcpy(e->subdirs, pending->subdirs, pending->subdir_count * sizeof(int));
+        e->subdir_count = pending->subdir_count;
+        pending->subdir_count = 0;
+        // Bodies are formatted into a full batch buffer; keep only what is used
+        char *fitted = realloc(body, len > 0 ? len : 1);
+        e->body = fitted != NULL ? fitted : body;
+        e->len = len;
+        cache->listing_bytes += len;
+    }
+    return e;
+}
+
+void file_cache_cancel(Worker *worker, FileCachePending *pending)
+{
+    if (pending->watch >= 0)
+    {
+        watch_put(worker->file_cache, pending->watch);
+    }
+    for (int i = 0; i < pending->subdir_count; i++)
+    {
+        watch_put(worker->file_cache, pending->subdirs[i]);
+    }
+    pending->watch = -1;
+    pending->subdir_count = 0;
+}
+
+const char *file_cache_body(const FileCacheEntry *entry, size_t *len)
+{
+    *len = entry->len;
+    return entry->body;
+}
+
+void file_cache_release(FileCacheEntry *entry)
+{
+    if (--entry->refs == 0 && entry->stale)
+    {
+        entry_close(entry->cache, entry);
+    }
+}
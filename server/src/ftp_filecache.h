@@ -0,0 +1,57 @@
+#ifndef FTP_FILECACHE_H
+#define FTP_FILECACHE_H
+
+#include <sys/types.h>
+#include "ftp_server.h"
+#include "ftp_list.h"
+
+#define FILE_CACHE_ENTRIES 256                 // open files and listings kept per worker
+#define FILE_CACHE_BUCKETS 512
+#define FILE_CACHE_MAX_SIZE (64 * 1024 * 1024) // larger files are opened per RETR; the open is noise next to the transfer
+#define FILE_CACHE_LISTING_BYTES (4 * 1024 * 1024) // formatted listings kept per worker
+#define FILE_CACHE_WATCHES 512                 // inotify watches per worker, ancestors and subdirectories included
+#define FILE_CACHE_SUBDIRS 32                  // a directory with more subdirectories than this has its listing read each time
+
+struct FileCache;
+struct FileCacheEntry;
+
+// Watches taken for a listing before its directory is read
+typedef struct
+{
+    int watch; // on the directory, or -1 when the listing will not be cached
+    int subdirs[FILE_CACHE_SUBDIRS];
+    int subdir_count;
+} FileCachePending;
+
+// Cleared by -no-file-cache
+extern int file_cache_enabled;
+
+struct FileCache *file_cache_create(Worker *worker);
+// Opens arg for reading, from the worker's cache when it can, and sets *size. When *entry is
+// set the fd belongs to the cache and goes back through file_cache_release() instead of close().
+int file_cache_open(ClientSession *session, const char *arg, off_t *size, struct FileCacheEntry **entry);
+
+// LIST and MLSD bodies of directory vdir, for one format and dot-file setting. A hit returns
+// the entry with a reference held for the caller. A miss returns NULL and fills *pending with
+// watches on vdir and its subdirectories (pending->watch -1 if there are none), which
+// file_cache_put_listing() or file_cache_cancel() must consume; they are taken before the
+// directory is read, so any change from then on drops the listing.
+struct FileCacheEntry *file_cache_listing(ClientSession *session, const char *vdir, ListFormat format, int show_hidden,
+                                          FileCachePending *pending);
+// Consumes pending and caches body, which the cache takes over; returns the entry with a
+// reference held, or NULL when it does not fit, in which case body is still the caller's
+struct FileCacheEntry *file_cache_put_listing(Worker *worker, FileCachePending *pending, const char *vdir, ListFormat format,
+                                              int show_hidden, char *body, size_t len);
+// Releases whatever pending still holds; harmless once it was consumed
+void file_cache_cancel(Worker *worker, FileCachePending *pending);
+const char *file_cache_body(const struct FileCacheEntry *entry, size_t *len);
+
+// Drops what this worker has cached for vpath and its directory's listings (and, with dirent,
+// the parent's) right away. STOR, DELE, MKD and RMD call it so their own session's next
+// listing never waits on inotify; other workers still learn of the change from their watches.
+void file_cache_forget(Worker *worker, const char *vpath, int dirent);
+void file_cache_release(struct FileCacheEntry *entry);
+// Reads pending inotify events and drops the entries they invalidate
+void file_cache_sync(struct FileCache *cache);
+
+#endif // FTP_FILECACHE_H
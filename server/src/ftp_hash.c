@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "ftp_hash.h"
+#include "ftp_filecache.h"
+
+typedef struct HashJob
+{
+    ClientSession *session;
+    int file_fd;
+    struct FileCacheEntry *cached; // file_fd belongs to this cache entry when set
+    off_t start;
+    off_t offset;                  // next byte to read
+    off_t end;
+    Digest digest;
+    HashReply reply;
+    struct HashJob *next;          // worker's queue
+    char name[];                   // as the client gave it, echoed in the HASH reply
+} HashJob;
+
+static void job_free(HashJob *job)
+{
+    if (job->cached != NULL)
+    {
+        file_cache_release(job->cached);
+    }
+    else
+    {
+        close(job->file_fd);
+    }
+    job->session->hash = NULL;
+    free(job);
+}
+
+static void job_unlink(Worker *worker, HashJob *job)
+{
+    HashJob **link = &worker->hash_jobs;
+    while (*link != job)
+    {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+}
+
+int hash_start(ClientSession *session, int file_fd, struct FileCacheEntry *cached, DigestAlgo algo, off_t start, off_t end,
+               const char *name, HashReply reply)
+{
+    Worker *worker = session->worker;
+    if (worker->hash_buffer == NULL)
+    {
+        worker->hash_buffer = malloc(HASH_BUFFER_SIZE);
+    }
+    size_t name_len = strlen(name);
+    HashJob *job = worker->hash_buffer != NULL ? malloc(sizeof(HashJob) + name_len + 1) : NULL;
+    if (job == NULL)
+    {
+        return -1;
+    }
+
+    job->session = session;
+    job->file_fd = file_fd;
+    job->cached = cached;
+    job->start = start;
+    job->offset = start;
+    job->end = end;
+    digest_begin(&job->digest, algo);
+    job->reply = reply;
+    memcpy(job->name, name, name_len + 1);
+    session->hash = job;
+
+    // Appended, so jobs take turns in the order they were started
+    HashJob **link = &worker->hash_jobs;
+    while (*link != NULL)
+    {
+        link = &(*link)->next;
+    }
+    job->next = NULL;
+    *link = job;
+    return 0;
+}
+
+// Returns 1 once the job is done, with its reply queued
+static int job_step(Worker *worker, HashJob *job)
+{
+    ClientSession *session = job->session;
+    off_t slice_end = job->end - job->offset > HASH_SLICE ? job->offset + HASH_SLICE : job->end;
+    while (job->offset < slice_end)
+    {
+        size_t want = slice_end - job->offset > HASH_BUFFER_SIZE ? HASH_BUFFER_SIZE : (size_t)(slice_end - job->offset);
+        ssize_t got = pread(job->file_fd, worker->hash_buffer, want, job->offset);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got < 0)
+        {
+            send_responsef(session, "451 Checksum failed: %s\r\n", strerror(errno));
+            return 1;
+        }
+        if (got == 0)
+        {
+            // The file shrank underneath us; report the range actually covered
+            job->end = job->offset;
+            break;
+        }
+        digest_update(&job->digest, worker->hash_buffer, got);
+        job->offset += got;
+        counter_add(&worker->metrics.hash_bytes, got);
+    }
+    if (job->offset < job->end)
+    {
+        return 0;
+    }
+
+    char hex[DIGEST_HEX_MAX];
+    digest_end(&job->digest, hex);
+    if (job->reply == HASH_REPLY_HASH)
+    {
+        // HASH ranges are inclusive on the wire; an empty file is reported as 0-0
+        off_t last = job->end > job->start ? job->end - 1 : job->start;
+        send_responsef(session, "213 %s %lld-%lld %s %s\r\n", digest_name(job->digest.algo), (long long)job->start,
+                       (long long)last, hex, job->name);
+    }
+    else
+    {
+        send_responsef(session, "250 %s\r\n", hex);
+    }
+    return 1;
+}
+
+void hash_run(Worker *worker, void (*service)(ClientSession *session))
+{
+    HashJob *job = worker->hash_jobs;
+    while (job != NULL)
+    {
+        HashJob *next = job->next;
+        if (job_step(worker, job))
+        {
+            ClientSession *session = job->session;
+            job_unlink(worker, job);
+            job_free(job);
+            // Commands that queued up behind the checksum run now
+            service(session);
+        }
+        job = next;
+    }
+}
+
+void hash_cancel(ClientSession *session)
+{
+    if (session->hash != NULL)
+    {
+        job_unlink(session->worker, session->hash);
+        job_free(session->hash);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef FTP_HASH_H
+#define FTP_HASH_H
+
+#include <sys/types.h>
+#include "ftp_server.h"
+#include "ftp_digest.h"
+
+#define HASH_BUFFER_SIZE (256 * 1024)
+#define HASH_SLICE (1024 * 1024) // bytes each job hashes per pass of the event loop
+
+struct FileCacheEntry;
+
+typedef enum
+{
+    HASH_REPLY_HASH, // 213 <algorithm> <start>-<end> <hex> <name>
+    HASH_REPLY_X     // 250 <hex>, for XCRC, XMD5 and XSHA256
+} HashReply;
+
+// Checksums bytes [start, end) of file_fd a slice at a time between event batches, so a large
+// file never stalls the other sessions on the worker; the reply is queued when it completes.
+// The fd (or cached entry) belongs to the job from here on.
+int hash_start(ClientSession *session, int file_fd, struct FileCacheEntry *cached, DigestAlgo algo, off_t start, off_t end,
+               const char *name, HashReply reply);
+// Runs one slice of every queued job; service is called for each session whose job finished
+void hash_run(Worker *worker, void (*service)(ClientSession *session));
+// Drops the session's job without replying, for ABOR and session close
+void hash_cancel(ClientSession *session);
+
+#endif // FTP_HASH_H
@@ -0,0 +1,76 @@
+#include "ftp_histogram.h"
+
+static unsigned histogram_bucket(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS)
+    {
+        return (unsigned)value;
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return shift * HIST_SUB_BUCKETS + (unsigned)(value >> shift);
+}
+
+// Largest value that lands in bucket index
+static uint64_t histogram_bucket_limit(unsigned index)
+{
+    if (index < HIST_SUB_BUCKETS)
+    {
+        return index;
+    }
+    unsigned shift = index / HIST_SUB_BUCKETS - 1;
+    uint64_t mantissa = index - shift * HIST_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void histogram_record(Histogram *hist, uint64_t value)
+{
+    counter_add(&hist->buckets[histogram_bucket(value)], 1);
+    counter_add(&hist->count, 1);
+    counter_add(&hist->sum, value);
+    if (value > hist->max)
+    {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+// Upper edge of the bucket holding the given quantile, so the result overstates by at most
+// one bucket width; never more than the largest value recorded
+uint64_t histogram_percentile(const Histogram *hist, double quantile)
+{
+    if (hist->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * (double)hist->count + 0.999999);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < hist->max ? limit : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void histogram_merge(Histogram *dst, const Histogram *src)
+{
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+    {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max)
+    {
+        dst->max = max;
+    }
+}
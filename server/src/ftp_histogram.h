@@ -0,0 +1,38 @@
+#ifndef FTP_HISTOGRAM_H
+#define FTP_HISTOGRAM_H
+
+#include <stdint.h>
+
+// Log-linear latency buckets: values below 2^HIST_SUB_BITS get a bucket each, every power of
+// two above that is split into 2^HIST_SUB_BITS linear steps, so a bucket is never wider than
+// 1/8 of its lower bound
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+// Single-writer counters: the owning thread updates them with relaxed atomic stores, so other
+// threads can read whole values without a lock
+static inline void counter_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void counter_sub(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) - n, __ATOMIC_RELAXED);
+}
+
+void histogram_record(Histogram *hist, uint64_t value);
+uint64_t histogram_percentile(const Histogram *hist, double quantile);
+// Adds a snapshot of src, which may still be written by its owner, into dst
+void histogram_merge(Histogram *dst, const Histogram *src);
+
+#endif // FTP_HISTOGRAM_H
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "ftp_list.h"
+
+#define SIX_MONTHS (183L * 24 * 60 * 60)
+
+// Record layout returned by getdents64(2)
+struct linux_dirent64
+{
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Takes ownership of dir_fd. With single_name set, only that entry of the directory is listed.
+DirLister *lister_open(int dir_fd, const char *single_name, ListFormat format, int show_hidden)
+{
+    DirLister *lister = calloc(1, sizeof(DirLister));
+    if (lister == NULL)
+    {
+        close(dir_fd);
+        return NULL;
+    }
+    lister->dir_fd = dir_fd;
+    lister->format = format;
+    lister->show_hidden = show_hidden;
+    lister->now = time(NULL);
+    lister->euid = geteuid();
+    lister->egid = getegid();
+    lister->cached_uid = (uid_t)-1;
+    lister->cached_gid = (gid_t)-1;
+
+    if (single_name != NULL)
+    {
+        lister->single_name = strdup(single_name);
+        if (lister->single_name == NULL)
+        {
+            lister_close(lister);
+            return NULL;
+        }
+        return lister;
+    }
+
+    lister->dents = malloc(LIST_DENTS_SIZE);
+    if (lister->dents == NULL)
+    {
+        lister_close(lister);
+        return NULL;
+    }
+    return lister;
+}
+
+void lister_close(DirLister *lister)
+{
+    if (lister == NULL)
+    {
+        return;
+    }
+    if (lister->dir_fd >= 0)
+    {
+        close(lister->dir_fd);
+    }
+    free(lister->dents);
+    free(lister->single_name);
+    free(lister);
+}
+
+static void mode_string(mode_t mode, char *out)
+{
+    if (S_ISDIR(mode))
+        out[0] = 'd';
+    else if (S_ISLNK(mode))
+        out[0] = 'l';
+    else if (S_ISCHR(mode))
+        out[0] = 'c';
+    else if (S_ISBLK(mode))
+        out[0] = 'b';
+    else if (S_ISFIFO(mode))
+        out[0] = 'p';
+    else if (S_ISSOCK(mode))
+        out[0] = 's';
+    else
+        out[0] = '-';
+
+    out[1] = (mode & S_IRUSR) ? 'r' : '-';
+    out[2] = (mode & S_IWUSR) ? 'w' : '-';
+    out[3] = (mode & S_ISUID) ? ((mode & S_IXUSR) ? 's' : 'S') : ((mode & S_IXUSR) ? 'x' : '-');
+    out[4] = (mode & S_IRGRP) ? 'r' : '-';
+    out[5] = (mode & S_IWGRP) ? 'w' : '-';
+    out[6] = (mode & S_ISGID) ? ((mode & S_IXGRP) ? 's' : 'S') : ((mode & S_IXGRP) ? 'x' : '-');
+    out[7] = (mode & S_IROTH) ? 'r' : '-';
+    out[8] = (mode & S_IWOTH) ? 'w' : '-';
+    out[9] = (mode & S_ISVTX) ? ((mode & S_IXOTH) ? 't' : 'T') : ((mode & S_IXOTH) ? 'x' : '-');
+    out[10] = '\0';
+}
+
+// Name lookups go through NSS, so remember the last owner; a directory rarely has more than one
+static const char *owner_name(DirLister *lister, uid_t uid)
+{
+    if (uid != lister->cached_uid)
+    {
+        struct passwd pw;
+        struct passwd *result = NULL;
+        char buf[1024];
+        if (getpwuid_r(uid, &pw, buf, sizeof(buf), &result) == 0 && result != NULL)
+        {
+            snprintf(lister->cached_user, sizeof(lister->cached_user), "%s", pw.pw_name);
+        }
+        else
+        {
+            snprintf(lister->cached_user, sizeof(lister->cached_user), "%u", (unsigned)uid);
+        }
+        lister->cached_uid = uid;
+    }
+    return lister->cached_user;
+}
+
+static const char *group_name(DirLister *lister, gid_t gid)
+{
+    if (gid != lister->cached_gid)
+    {
+        struct group gr;
+        struct group *result = NULL;
+        char buf[1024];
+        if (getgrgid_r(gid, &gr, buf, sizeof(buf), &result) == 0 && result != NULL)
+        {
+            snprintf(lister->cached_group, sizeof(lister->cached_group), "%s", gr.gr_name);
+        }
+        else
+        {
+            snprintf(lister->cached_group, sizeof(lister->cached_group), "%u", (unsigned)gid);
+        }
+        lister->cached_gid = gid;
+    }
+    return lister->cached_group;
+}
+
+// One `ls -l` line; returns 0 if the entry vanished before it could be stat'ed
+static size_t format_ls(DirLister *lister, const char *name, char *out, size_t cap)
+{
+    struct stat st;
+    if (fstatat(lister->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        return 0;
+    }
+
+    char perms[11];
+    mode_string(st.st_mode, perms);
+
+    char date[32];
+    struct tm tm;
+    localtime_r(&st.st_mtime, &tm);
+    long age = (long)(lister->now - st.st_mtime);
+    strftime(date, sizeof(date), (age < SIX_MONTHS && age > -SIX_MONTHS) ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+    int len = snprintf(out, cap, "%s %lu %s %s %lld %s %s", perms, (unsigned long)st.st_nlink,
+                       owner_name(lister, st.st_uid), group_name(lister, st.st_gid),
+                       (long long)st.st_size, date, name);
+    if (len < 0 || (size_t)len >= cap)
+    {
+        return 0;
+    }
+
+    if (S_ISLNK(st.st_mode) && (size_t)len + 4 < cap)
+    {
+        memcpy(out + len, " -> ", 4);
+        ssize_t target = readlinkat(lister->dir_fd, name, out + len + 4, cap - len - 6);
+        len += target > 0 ? 4 + (int)target : 0;
+    }
+
+    if ((size_t)len + 2 >= cap)
+    {
+        return 0;
+    }
+    out[len++] = '\r';
+    out[len++] = '\n';
+    return len;
+}
+
+// Which of the owner/group/other permission triplets applies to this server process
+static int access_bits(const DirLister *lister, const struct stat *st)
+{
+    if (lister->euid == 0)
+    {
+        return 7;
+    }
+    if (st->st_uid == lister->euid)
+    {
+        return (st->st_mode >> 6) & 7;
+    }
+    if (st->st_gid == lister->egid)
+    {
+        return (st->st_mode >> 3) & 7;
+    }
+    return st->st_mode & 7;
+}
+
+// RFC 3659 "perm" fact for an entry, from the mode bits that apply to us
+static void perm_fact(const DirLister *lister, const struct stat *st, char *out)
+{
+    int bits = access_bits(lister, st);
+    int readable = bits & 4;
+    int writable = bits & 2;
+    int searchable = bits & 1;
+    char *p = out;
+
+    if (S_ISDIR(st->st_mode))
+    {
+        if (writable)
+        {
+            *p++ = 'c';
+            *p++ = 'd';
+            *p++ = 'f';
+            *p++ = 'm';
+            *p++ = 'p';
+        }
+        if (searchable)
+        {
+            *p++ = 'e';
+        }
+        if (readable)
+        {
+            *p++ = 'l';
+        }
+    }
+    else
+    {
+        if (writable)
+        {
+            *p++ = 'a';
+            *p++ = 'd';
+            *p++ = 'f';
+            *p++ = 'w';
+        }
+        if (readable)
+        {
+            *p++ = 'r';
+        }
+    }
+    *p = '\0';
+}
+
+static size_t format_mlsd_stat(DirLister *lister, const struct stat *st, const char *name, char *out, size_t cap)
+{
+    const char *type = S_ISDIR(st->st_mode) ? "dir" : S_ISREG(st->st_mode) ? "file" : S_ISLNK(st->st_mode) ? "OS.unix=slink" : "OS.unix=other";
+
+    char modify[16];
+    struct tm tm;
+    gmtime_r(&st->st_mtime, &tm);
+    strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm);
+
+    char perm[12];
+    perm_fact(lister, st, perm);
+
+    int len = snprintf(out, cap, "type=%s;size=%lld;modify=%s;perm=%s; %s\r\n",
+                       type, (long long)st->st_size, modify, perm, name);
+    return (len < 0 || (size_t)len >= cap) ? 0 : (size_t)len;
+}
+
+// One MLSD line. As in LIST, a symlink is described by itself: its target may lie outside the
+// root, and CWD and RETR would refuse to follow it there anyway.
+static size_t format_mlsd(DirLister *lister, const char *name, char *out, size_t cap)
+{
+    struct stat st;
+    if (fstatat(lister->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        return 0;
+    }
+    return format_mlsd_stat(lister, &st, name, out, cap);
+}
+
+static size_t format_entry(DirLister *lister, const char *name, char *out, size_t cap)
+{
+    switch (lister->format)
+    {
+    case LIST_FORMAT_LS:
+        return format_ls(lister, name, out, cap);
+    case LIST_FORMAT_MLSD:
+        return format_mlsd(lister, name, out, cap);
+    }
+    return 0;
+}
+
+// The single MLST fact line for st (without the leading space), named display_name
+size_t list_format_stat(const struct stat *st, const char *display_name, char *out, size_t cap)
+{
+    DirLister lister;
+    memset(&lister, 0, sizeof(lister));
+    lister.euid = geteuid();
+    lister.egid = getegid();
+    return format_mlsd_stat(&lister, st, display_name, out, cap);
+}
+
+// Formats entries into out until it is nearly full or the directory is exhausted.
+// Returns the number of bytes written; 0 means the listing is complete.
+size_t lister_fill(DirLister *lister, char *out, size_t cap)
+{
+    size_t len = 0;
+    if (lister->single_name != NULL)
+    {
+        if (!lister->done)
+        {
+            len = format_entry(lister, lister->single_name, out, cap);
+            lister->done = 1;
+        }
+        return len;
+    }
+
+    while (!lister->done && cap - len >= LIST_LINE_MAX)
+    {
+        if (lister->dents_off >= lister->dents_len)
+        {
+            long n = syscall(SYS_getdents64, lister->dir_fd, lister->dents, LIST_DENTS_SIZE);
+            if (n <= 0)
+            {
+                lister->done = 1;
+                break;
+            }
+            lister->dents_len = n;
+            lister->dents_off = 0;
+        }
+
+        struct linux_dirent64 *entry = (struct linux_dirent64 *)(lister->dents + lister->dents_off);
+        lister->dents_off += entry->d_reclen;
+        if (entry->d_name[0] == '.' && !lister->show_hidden)
+        {
+            continue;
+        }
+        if (lister->format == LIST_FORMAT_MLSD && (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0))
+        {
+            continue;
+        }
+        len += format_entry(lister, entry->d_name, out + len, cap - len);
+    }
+    return len;
+}
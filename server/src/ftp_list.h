@@ -0,0 +1,45 @@
+#ifndef FTP_LIST_H
+#define FTP_LIST_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define LIST_BUFFER_SIZE (64 * 1024)
+#define LIST_DENTS_SIZE (32 * 1024)
+#define LIST_LINE_MAX (PATH_MAX + 512)
+
+typedef enum
+{
+    LIST_FORMAT_LS,  // ls -l style, for LIST
+    LIST_FORMAT_MLSD // RFC 3659 facts, for MLSD and MLST
+} ListFormat;
+
+// Streams one directory (or a single file) as formatted lines, one batch per lister_fill() call
+typedef struct DirLister
+{
+    int dir_fd;
+    ListFormat format;
+    int show_hidden;
+    char *single_name; // non-NULL when the LIST target is a file rather than a directory
+    int done;
+    char *dents;       // raw getdents64() records
+    size_t dents_len;
+    size_t dents_off;
+    time_t now;
+    uid_t euid;
+    gid_t egid;
+    uid_t cached_uid;
+    gid_t cached_gid;
+    char cached_user[32];
+    char cached_group[32];
+} DirLister;
+
+DirLister *lister_open(int dir_fd, const char *single_name, ListFormat format, int show_hidden);
+size_t lister_fill(DirLister *lister, char *out, size_t cap);
+void lister_close(DirLister *lister);
+size_t list_format_stat(const struct stat *st, const char *display_name, char *out, size_t cap);
+
+#endif // FTP_LIST_H
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include "ftp_log.h"
+
+// Single-producer single-consumer byte ring: the owning thread appends whole records and
+// advances head, the flusher writes them out and advances tail. Both only ever grow.
+typedef struct LogRing
+{
+    char *buf;
+    size_t head;
+    size_t tail;
+    uint64_t dropped;          // records that did not fit, written by the owner
+    uint64_t dropped_reported; // flusher only
+    struct LogRing *next;
+} LogRing;
+
+static const char *const level_names[] = {"debug", "info", "warn", "error"};
+
+static LogFormat log_format = LOG_FORMAT_KV;
+static int log_fd = STDOUT_FILENO;
+static LogRing *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread LogRing *thread_ring = NULL;
+static __thread time_t ts_second = -1;
+static __thread char ts_prefix[24]; // "2024-10-18T03:28:00", rebuilt once per second
+
+// Rings are created on a thread's first record and never freed; threads live as long as the server
+static LogRing *log_ring(void)
+{
+    if (thread_ring != NULL)
+    {
+        return thread_ring;
+    }
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (ring == NULL || (ring->buf = malloc(LOG_RING_SIZE)) == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+    thread_ring = ring;
+    return ring;
+}
+
+static void append(LogRecord *rec, const char *s, size_t n)
+{
+    // Two bytes stay free for the terminator log_end() adds
+    size_t room = LOG_RECORD_MAX - 2 - rec->len;
+    if (n > room)
+    {
+        n = room;
+    }
+    memcpy(rec->buf + rec->len, s, n);
+    rec->len += n;
+}
+
+static void append_str(LogRecord *rec, const char *s)
+{
+    append(rec, s, strlen(s));
+}
+
+static void append_escaped(LogRecord *rec, const char *value)
+{
+    static const char hex[] = "0123456789abcdef";
+    int json = log_format == LOG_FORMAT_JSON;
+    int quote = json || value[0] == '\0' || strpbrk(value, " =\"\\") != NULL;
+    for (const char *p = value; !quote && *p != '\0'; p++)
+    {
+        quote = (unsigned char)*p < 0x20;
+    }
+    if (!quote)
+    {
+        append_str(rec, value);
+        return;
+    }
+
+    append(rec, "\"", 1);
+    for (const unsigned char *p = (const unsigned char *)value; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            char escaped[2] = {'\\', (char)*p};
+            append(rec, escaped, 2);
+        }
+        else if (*p < 0x20 && json)
+        {
+            char escaped[6] = {'\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 0xf]};
+            append(rec, escaped, 6);
+        }
+        else if (*p < 0x20)
+        {
+            char escaped[4] = {'\\', 'x', hex[*p >> 4], hex[*p & 0xf]};
+            append(rec, escaped, 4);
+        }
+        else
+        {
+            append(rec, (const char *)p, 1);
+        }
+    }
+    append(rec, "\"", 1);
+}
+
+static void append_key(LogRecord *rec, const char *key)
+{
+    if (log_format == LOG_FORMAT_JSON)
+    {
+        append(rec, ",\"", 2);
+        append_str(rec, key);
+        append(rec, "\":", 2);
+    }
+    else
+    {
+        append(rec, " ", 1);
+        append_str(rec, key);
+        append(rec, "=", 1);
+    }
+}
+
+void log_begin(LogRecord *rec, int level, const char *event)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != ts_second)
+    {
+        struct tm tm;
+        gmtime_r(&now.tv_sec, &tm);
+        strftime(ts_prefix, sizeof(ts_prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+        ts_second = now.tv_sec;
+    }
+    char ts[40];
+    snprintf(ts, sizeof(ts), "%s.%03ldZ", ts_prefix, now.tv_nsec / 1000000);
+
+    rec->len = 0;
+    if (log_format == LOG_FORMAT_JSON)
+    {
+        append(rec, "{\"ts\":\"", 7);
+        append_str(rec, ts);
+        append(rec, "\"", 1);
+    }
+    else
+    {
+        append(rec, "ts=", 3);
+        append_str(rec, ts);
+    }
+    log_str(rec, "level", level_names[level]);
+    log_str(rec, "event", event);
+}
+
+void log_str(LogRecord *rec, const char *key, const char *value)
+{
+    append_key(rec, key);
+    append_escaped(rec, value);
+}
+
+void log_uint(LogRecord *rec, const char *key, uint64_t value)
+{
+    char text[24];
+    int n = snprintf(text, sizeof(text), "%llu", (unsigned long long)value);
+    append_key(rec, key);
+    append(rec, text, n);
+}
+
+void log_int(LogRecord *rec, const char *key, int64_t value)
+{
+    char text[24];
+    int n = snprintf(text, sizeof(text), "%lld", (long long)value);
+    append_key(rec, key);
+    append(rec, text, n);
+}
+
+void log_double(LogRecord *rec, const char *key, double value)
+{
+    char text[32];
+    int n = snprintf(text, sizeof(text), "%.3f", value);
+    append_key(rec, key);
+    append(rec, text, n);
+}
+
+// Never blocks: a record that does not fit in the ring is dropped and counted
+void log_end(LogRecord *rec)
+{
+    if (log_format == LOG_FORMAT_JSON)
+    {
+        rec->buf[rec->len++] = '}';
+    }
+    rec->buf[rec->len++] = '\n';
+
+    LogRing *ring = log_ring();
+    if (ring == NULL)
+    {
+        return;
+    }
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (head - tail) < rec->len)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t offset = head % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - offset < rec->len ? LOG_RING_SIZE - offset : rec->len;
+    memcpy(ring->buf + offset, rec->buf, first);
+    memcpy(ring->buf, rec->buf + first, rec->len - first);
+    __atomic_store_n(&ring->head, head + rec->len, __ATOMIC_RELEASE);
+}
+
+void log_message(int level, const char *fmt, ...)
+{
+    char message[LOG_RECORD_MAX / 2];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
+
+    LogRecord rec;
+    log_begin(&rec, level, "message");
+    log_str(&rec, "msg", message);
+    log_end(&rec);
+}
+
+static void log_drain(LogRing *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t tail = ring->tail;
+    while (tail != head)
+    {
+        size_t offset = tail % LOG_RING_SIZE;
+        size_t len = head - tail;
+        struct iovec iov[2];
+        iov[0].iov_base = ring->buf + offset;
+        iov[0].iov_len = LOG_RING_SIZE - offset < len ? LOG_RING_SIZE - offset : len;
+        iov[1].iov_base = ring->buf;
+        iov[1].iov_len = len - iov[0].iov_len;
+
+        ssize_t written = writev(log_fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        // If the log cannot be written, the records are discarded rather than held
+        tail = written < 0 ? head : tail + (size_t)written;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_reported)
+    {
+        LogRecord rec;
+        log_begin(&rec, LOG_LEVEL_WARN, "log_dropped");
+        log_uint(&rec, "records", dropped - ring->dropped_reported);
+        log_end(&rec);
+        ring->dropped_reported = dropped;
+    }
+}
+
+static void *log_main(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+    for (;;)
+    {
+        nanosleep(&interval, NULL);
+        for (LogRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        {
+            log_drain(ring);
+        }
+    }
+    return NULL;
+}
+
+int log_init(int fd, LogFormat format)
+{
+    log_fd = fd;
+    log_format = format;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_main, NULL) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
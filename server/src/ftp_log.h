@@ -0,0 +1,62 @@
+#ifndef FTP_LOG_H
+#define FTP_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+// Records below this level are compiled out entirely; set with make LOG_LEVEL=n
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE (256 * 1024) // per thread; records that do not fit are dropped and counted
+#define LOG_RECORD_MAX 1024        // longer records are cut short
+#define LOG_FLUSH_INTERVAL_MS 20
+
+typedef enum
+{
+    LOG_FORMAT_KV,  // ts=... level=info event=command cmd=RETR ...
+    LOG_FORMAT_JSON // {"ts":"...","level":"info","event":"command","cmd":"RETR",...}
+} LogFormat;
+
+// One record being assembled on the caller's stack, then copied into the thread's ring
+typedef struct
+{
+    char buf[LOG_RECORD_MAX];
+    size_t len;
+} LogRecord;
+
+// Constant-folded, so a disabled level costs nothing at the call site:
+//     LogRecord rec;
+//     if (LOG_ENABLED(LOG_LEVEL_INFO)) { log_begin(&rec, ...); log_str(&rec, ...); log_end(&rec); }
+#define LOG_ENABLED(level) ((level) >= LOG_LEVEL)
+
+// Free-form message records, for events that have no structure worth keeping
+#define LOG_DEBUG(...) \
+    do { if (LOG_ENABLED(LOG_LEVEL_DEBUG)) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#define LOG_INFO(...) \
+    do { if (LOG_ENABLED(LOG_LEVEL_INFO)) log_message(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#define LOG_WARN(...) \
+    do { if (LOG_ENABLED(LOG_LEVEL_WARN)) log_message(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) \
+    do { if (LOG_ENABLED(LOG_LEVEL_ERROR)) log_message(LOG_LEVEL_ERROR, __VA_ARGS__); } while (0)
+
+// Starts the background thread that drains every thread's ring to fd
+int log_init(int fd, LogFormat format);
+
+void log_begin(LogRecord *rec, int level, const char *event);
+void log_str(LogRecord *rec, const char *key, const char *value);
+void log_uint(LogRecord *rec, const char *key, uint64_t value);
+void log_int(LogRecord *rec, const char *key, int64_t value);
+void log_double(LogRecord *rec, const char *key, double value);
+void log_end(LogRecord *rec);
+
+void log_message(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif // FTP_LOG_H
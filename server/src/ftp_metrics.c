@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "ftp_metrics.h"
+#include "ftp_log.h"
+
+static const char *const transfer_names[METRIC_XFER_KINDS] = {"retr", "stor", "list"};
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+uint64_t metrics_command(Metrics *metrics, CommandId id, uint64_t start_ns)
+{
+    CommandMetrics *command = &metrics->commands[id];
+    uint64_t elapsed = metrics_now_ns() - start_ns;
+    counter_add(&command->calls, 1);
+    histogram_record(&command->latency_ns, elapsed);
+    return elapsed;
+}
+
+uint64_t metrics_transfer(Metrics *metrics, MetricTransfer kind, uint64_t bytes, uint64_t start_ns, int ok)
+{
+    TransferMetrics *transfer = &metrics->transfers[kind];
+    uint64_t elapsed = metrics_now_ns() - start_ns;
+    counter_add(ok ? &transfer->completed : &transfer->failed, 1);
+    counter_add(&transfer->bytes, bytes);
+    histogram_record(&transfer->duration_ns, elapsed);
+    return elapsed;
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void metrics_merge(Metrics *dst, const Metrics *src)
+{
+    for (int i = 0; i < CMD_COUNT; i++)
+    {
+        dst->commands[i].calls += load(&src->commands[i].calls);
+        dst->commands[i].errors += load(&src->commands[i].errors);
+        histogram_merge(&dst->commands[i].latency_ns, &src->commands[i].latency_ns);
+    }
+    for (int i = 0; i < METRIC_XFER_KINDS; i++)
+    {
+        dst->transfers[i].completed += load(&src->transfers[i].completed);
+        dst->transfers[i].failed += load(&src->transfers[i].failed);
+        dst->transfers[i].bytes += load(&src->transfers[i].bytes);
+        histogram_merge(&dst->transfers[i].duration_ns, &src->transfers[i].duration_ns);
+    }
+    dst->sessions_accepted += load(&src->sessions_accepted);
+    dst->sessions_active += load(&src->sessions_active);
+    dst->sessions_rejected += load(&src->sessions_rejected);
+    dst->sessions_rejected_ip += load(&src->sessions_rejected_ip);
+    dst->sessions_timed_out += load(&src->sessions_timed_out);
+    dst->sessions_shed += load(&src->sessions_shed);
+    dst->transfers_stalled += load(&src->transfers_stalled);
+    dst->pasv_ports += load(&src->pasv_ports);
+    dst->pasv_in_use += load(&src->pasv_in_use);
+    dst->pasv_fallback += load(&src->pasv_fallback);
+    dst->file_cache_hits += load(&src->file_cache_hits);
+    dst->file_cache_misses += load(&src->file_cache_misses);
+    dst->listing_cache_hits += load(&src->listing_cache_hits);
+    dst->listing_cache_misses += load(&src->listing_cache_misses);
+    dst->file_cache_evictions += load(&src->file_cache_evictions);
+    dst->file_cache_invalidations += load(&src->file_cache_invalidations);
+    dst->file_cache_entries += load(&src->file_cache_entries);
+    dst->hash_bytes += load(&src->hash_bytes);
+}
+
+static void write_summary(FILE *out, const char *name, const char *label, const char *value, const Histogram *hist)
+{
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        fprintf(out, "%s{%s=\"%s\",quantile=\"%g\"} %.9f\n", name, label, value, quantiles[i],
+                histogram_percentile(hist, quantiles[i]) / 1e9);
+    }
+    fprintf(out, "%s_sum{%s=\"%s\"} %.9f\n", name, label, value, hist->sum / 1e9);
+    fprintf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long)hist->count);
+}
+
+// Prometheus text exposition format, version 0.0.4
+void metrics_write_prometheus(const Metrics *metrics, FILE *out)
+{
+    fprintf(out, "# HELP ftp_command_calls_total Commands dispatched to their handler.\n# TYPE ftp_command_calls_total counter\n");
+    for (int i = 0; i < CMD_COUNT; i++)
+    {
+        fprintf(out, "ftp_command_calls_total{command=\"%s\"} %llu\n", command_name(i), (unsigned long long)metrics->commands[i].calls);
+    }
+    fprintf(out, "# HELP ftp_command_errors_total Commands rejected before their handler for login or syntax.\n# TYPE ftp_command_errors_total counter\n");
+    for (int i = 0; i < CMD_COUNT; i++)
+    {
+        fprintf(out, "ftp_command_errors_total{command=\"%s\"} %llu\n", command_name(i), (unsigned long long)metrics->commands[i].errors);
+    }
+    fprintf(out, "# HELP ftp_command_latency_seconds Time spent in each command handler.\n# TYPE ftp_command_latency_seconds summary\n");
+    for (int i = 0; i < CMD_COUNT; i++)
+    {
+        write_summary(out, "ftp_command_latency_seconds", "command", command_name(i), &metrics->commands[i].latency_ns);
+    }
+    fprintf(out, "# HELP ftp_command_latency_max_seconds Slowest call of each command handler.\n# TYPE ftp_command_latency_max_seconds gauge\n");
+    for (int i = 0; i < CMD_COUNT; i++)
+    {
+        fprintf(out, "ftp_command_latency_max_seconds{command=\"%s\"} %.9f\n", command_name(i), metrics->commands[i].latency_ns.max / 1e9);
+    }
+
+    fprintf(out, "# HELP ftp_transfers_total Data transfers by kind and outcome.\n# TYPE ftp_transfers_total counter\n");
+    for (int i = 0; i < METRIC_XFER_KINDS; i++)
+    {
+        fprintf(out, "ftp_transfers_total{kind=\"%s\",result=\"ok\"} %llu\n", transfer_names[i], (unsigned long long)metrics->transfers[i].completed);
+        fprintf(out, "ftp_transfers_total{kind=\"%s\",result=\"failed\"} %llu\n", transfer_names[i], (unsigned long long)metrics->transfers[i].failed);
+    }
+    fprintf(out, "# HELP ftp_transfer_bytes_total Bytes moved over data connections; stor is received, the rest sent.\n# TYPE ftp_transfer_bytes_total counter\n");
+    for (int i = 0; i < METRIC_XFER_KINDS; i++)
+    {
+        fprintf(out, "ftp_transfer_bytes_total{kind=\"%s\"} %llu\n", transfer_names[i], (unsigned long long)metrics->transfers[i].bytes);
+    }
+    fprintf(out, "# HELP ftp_transfer_duration_seconds Time from the 150 reply to the final reply.\n# TYPE ftp_transfer_duration_seconds summary\n");
+    for (int i = 0; i < METRIC_XFER_KINDS; i++)
+    {
+        write_summary(out, "ftp_transfer_duration_seconds", "kind", transfer_names[i], &metrics->transfers[i].duration_ns);
+    }
+
+    fprintf(out, "# TYPE ftp_sessions_accepted_total counter\nftp_sessions_accepted_total %llu\n", (unsigned long long)metrics->sessions_accepted);
+    fprintf(out, "# TYPE ftp_sessions_active gauge\nftp_sessions_active %llu\n", (unsigned long long)metrics->sessions_active);
+    fprintf(out, "# HELP ftp_sessions_rejected_total Control connections refused with 421 by the admission limits.\n# TYPE ftp_sessions_rejected_total counter\n");
+    fprintf(out, "ftp_sessions_rejected_total{reason=\"server_full\"} %llu\n", (unsigned long long)metrics->sessions_rejected);
+    fprintf(out, "ftp_sessions_rejected_total{reason=\"per_ip\"} %llu\n", (unsigned long long)metrics->sessions_rejected_ip);
+    fprintf(out, "# HELP ftp_sessions_timed_out_total Idle control connections closed with 421; shed ones were cut short under overload.\n# TYPE ftp_sessions_timed_out_total counter\n");
+    fprintf(out, "ftp_sessions_timed_out_total{reason=\"idle\"} %llu\n", (unsigned long long)metrics->sessions_timed_out);
+    fprintf(out, "ftp_sessions_timed_out_total{reason=\"shed\"} %llu\n", (unsigned long long)metrics->sessions_shed);
+    fprintf(out, "# TYPE ftp_transfers_stalled_total counter\nftp_transfers_stalled_total %llu\n", (unsigned long long)metrics->transfers_stalled);
+    fprintf(out, "# TYPE ftp_pasv_ports gauge\nftp_pasv_ports %llu\n", (unsigned long long)metrics->pasv_ports);
+    fprintf(out, "# TYPE ftp_pasv_ports_in_use gauge\nftp_pasv_ports_in_use %llu\n", (unsigned long long)metrics->pasv_in_use);
+    fprintf(out, "# TYPE ftp_pasv_fallback_total counter\nftp_pasv_fallback_total %llu\n", (unsigned long long)metrics->pasv_fallback);
+    fprintf(out, "# HELP ftp_file_cache_lookups_total RETR file and LIST/MLSD listing lookups by outcome.\n# TYPE ftp_file_cache_lookups_total counter\n");
+    fprintf(out, "ftp_file_cache_lookups_total{kind=\"file\",result=\"hit\"} %llu\n", (unsigned long long)metrics->file_cache_hits);
+    fprintf(out, "ftp_file_cache_lookups_total{kind=\"file\",result=\"miss\"} %llu\n", (unsigned long long)metrics->file_cache_misses);
+    fprintf(out, "ftp_file_cache_lookups_total{kind=\"listing\",result=\"hit\"} %llu\n", (unsigned long long)metrics->listing_cache_hits);
+    fprintf(out, "ftp_file_cache_lookups_total{kind=\"listing\",result=\"miss\"} %llu\n", (unsigned long long)metrics->listing_cache_misses);
+    fprintf(out, "# TYPE ftp_file_cache_evictions_total counter\nftp_file_cache_evictions_total %llu\n", (unsigned long long)metrics->file_cache_evictions);
+    fprintf(out, "# TYPE ftp_file_cache_invalidations_total counter\nftp_file_cache_invalidations_total %llu\n", (unsigned long long)metrics->file_cache_invalidations);
+    fprintf(out, "# TYPE ftp_file_cache_entries gauge\nftp_file_cache_entries %llu\n", (unsigned long long)metrics->file_cache_entries);
+    fprintf(out, "# TYPE ftp_hash_bytes_total counter\nftp_hash_bytes_total %llu\n", (unsigned long long)metrics->hash_bytes);
+}
+
+typedef struct
+{
+    int fd;
+    MetricsCollect collect;
+} MetricsServer;
+
+static void metrics_respond(int fd, MetricsCollect collect)
+{
+    // The request itself does not matter, every path gets the metrics
+    char request[1024];
+    if (recv(fd, request, sizeof(request), 0) <= 0)
+    {
+        return;
+    }
+
+    Metrics *snapshot = calloc(1, sizeof(Metrics));
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = snapshot != NULL ? open_memstream(&body, &body_len) : NULL;
+    if (out != NULL)
+    {
+        collect(snapshot);
+        metrics_write_prometheus(snapshot, out);
+        fclose(out);
+
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+        if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len)
+        {
+            for (size_t sent = 0; sent < body_len;)
+            {
+                ssize_t n = send(fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+                if (n <= 0)
+                {
+                    break;
+                }
+                sent += n;
+            }
+        }
+    }
+    free(body);
+    free(snapshot);
+}
+
+// Scrapes are rare, so one blocking connection at a time is enough
+static void *metrics_main(void *arg)
+{
+    MetricsServer *server = arg;
+    int failing = 0;
+    for (;;)
+    {
+        int fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            // Out of descriptors, most likely, since the workers share the table; retrying at
+            // once would only spin until they close some
+            if (!failing)
+            {
+                LOG_WARN("metrics accept: %s, retrying every %d ms", strerror(errno), METRICS_ACCEPT_BACKOFF_MS);
+                failing = 1;
+            }
+            struct timespec pause = {0, METRICS_ACCEPT_BACKOFF_MS * 1000000L};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        failing = 0;
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        metrics_respond(fd, server->collect);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(int port, MetricsCollect collect)
+{
+    static MetricsServer server;
+    server.collect = collect;
+    server.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.fd < 0)
+    {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(server.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    pthread_t thread;
+    if (bind(server.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server.fd, 16) < 0 ||
+        pthread_create(&thread, NULL, metrics_main, &server) != 0)
+    {
+        close(server.fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
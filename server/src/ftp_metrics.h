@@ -0,0 +1,77 @@
+#ifndef FTP_METRICS_H
+#define FTP_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ftp_command.h"
+#include "ftp_histogram.h"
+
+#define DEFAULT_METRICS_PORT 0 // no HTTP endpoint unless -metrics-port is given
+#define METRICS_ACCEPT_BACKOFF_MS 100 // pause after a failed accept() other than EINTR or ECONNABORTED
+
+typedef struct
+{
+    uint64_t calls;
+    uint64_t errors; // rejected before reaching the handler (auth or arity)
+    Histogram latency_ns; // time spent in the handler
+} CommandMetrics;
+
+typedef enum
+{
+    METRIC_XFER_RETR,
+    METRIC_XFER_STOR,
+    METRIC_XFER_LIST,
+    METRIC_XFER_KINDS
+} MetricTransfer;
+
+typedef struct
+{
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t bytes; // data-connection bytes, headers and compression included
+    Histogram duration_ns;
+} TransferMetrics;
+
+// One per worker. Only the owning thread writes, with relaxed atomic stores, so recording
+// never takes a lock and readers on other threads always see whole values.
+typedef struct
+{
+    CommandMetrics commands[CMD_COUNT];
+    TransferMetrics transfers[METRIC_XFER_KINDS];
+    uint64_t sessions_accepted;
+    uint64_t sessions_active;
+    uint64_t sessions_rejected;    // refused with 421 at -max-sessions
+    uint64_t sessions_rejected_ip; // refused with 421 at -max-per-ip
+    uint64_t sessions_timed_out;   // closed after -idle-timeout without a command
+    uint64_t sessions_shed;        // closed idle early because the server was nearly full
+    uint64_t transfers_stalled;    // aborted after -data-timeout without moving a byte
+    uint64_t pasv_ports;   // listeners in the worker's pool
+    uint64_t pasv_in_use;  // pool listeners currently lent to a session
+    uint64_t pasv_fallback; // PASV/EPSV with the worker's ports all in use: refused, or given a kernel-assigned port
+    uint64_t file_cache_hits;     // RETR served from an already open file
+    uint64_t file_cache_misses;
+    uint64_t listing_cache_hits;  // LIST or MLSD served from an already formatted body
+    uint64_t listing_cache_misses;
+    uint64_t file_cache_evictions; // dropped to make room, files and listings alike
+    uint64_t file_cache_invalidations; // dropped because inotify reported a change
+    uint64_t file_cache_entries;
+    uint64_t hash_bytes; // read by HASH, XCRC, XMD5 and XSHA256
+} Metrics;
+
+uint64_t metrics_now_ns(void);
+
+// Both return the elapsed time they recorded
+uint64_t metrics_command(Metrics *metrics, CommandId id, uint64_t start_ns);
+uint64_t metrics_transfer(Metrics *metrics, MetricTransfer kind, uint64_t bytes, uint64_t start_ns, int ok);
+
+// Adds a snapshot of src into dst; dst is private to the caller
+void metrics_merge(Metrics *dst, const Metrics *src);
+void metrics_write_prometheus(const Metrics *metrics, FILE *out);
+
+// Fills a private snapshot of every worker's metrics
+typedef void (*MetricsCollect)(Metrics *out);
+
+// Serves metrics_write_prometheus() output over HTTP on 127.0.0.1:port from its own thread
+int metrics_serve(int port, MetricsCollect collect);
+
+#endif // FTP_METRICS_H
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "ftp_pasv.h"
+#include "ftp_log.h"
+
+int pasv_ephemeral = 0;
+struct in_addr pasv_address = {INADDR_ANY};
+
+static int open_data_listener(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in data_addr;
+    memset(&data_addr, 0, sizeof(data_addr));
+    data_addr.sin_family = AF_INET;
+    data_addr.sin_addr.s_addr = INADDR_ANY;
+    data_addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0 || listen(fd, PASV_BACKLOG) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Binds and listens on every port in [first_port, last_port] once, at startup.
+// Ports that cannot be bound are left out of the pool.
+int pasv_pool_init(PasvPool *pool, int first_port, int last_port)
+{
+    memset(pool, 0, sizeof(*pool));
+    int count = last_port >= first_port ? last_port - first_port + 1 : 0;
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    pool->listeners = calloc(count, sizeof(PasvListener));
+    pool->free_ring = calloc(count, sizeof(int));
+    if (pool->listeners == NULL || pool->free_ring == NULL)
+    {
+        return -1;
+    }
+
+    // A range taken by another process would otherwise log one line per port
+    int skipped = 0;
+    int first_skipped = 0;
+    int first_errno = 0;
+    for (int port = first_port; port <= last_port; port++)
+    {
+        int fd = open_data_listener(port);
+        if (fd < 0)
+        {
+            if (skipped++ == 0)
+            {
+                first_skipped = port;
+                first_errno = errno;
+            }
+            continue;
+        }
+        pool->listeners[pool->size].fd = fd;
+        pool->listeners[pool->size].port = port;
+        pool->free_ring[pool->size] = pool->size;
+        pool->size++;
+    }
+    pool->free_count = pool->size;
+    if (skipped > 0)
+    {
+        LOG_WARN("Passive ports %d-%d: %d bound, %d skipped (port %d: %s)", first_port, last_port, pool->size, skipped,
+                 first_skipped, strerror(first_errno));
+    }
+    return 0;
+}
+
+// Pool exhausted with -pasv-ephemeral: let the kernel pick a free port, which also needs no retries
+static int pasv_acquire_ephemeral(ClientSession *session)
+{
+    session->pasv.fd = open_data_listener(0);
+    if (session->pasv.fd < 0)
+    {
+        return -1;
+    }
+
+    struct sockaddr_in bound;
+    socklen_t bound_len = sizeof(bound);
+    if (getsockname(session->pasv.fd, (struct sockaddr *)&bound, &bound_len) < 0)
+    {
+        ev_close(session->worker, &session->pasv);
+        return -1;
+    }
+    ev_set(session->worker, &session->pasv, EPOLLIN);
+    return ntohs(bound.sin_port);
+}
+
+// Hands the session the least recently used listener of its worker in O(1). With the worker's
+// slice in use it fails, as a port outside the range is usually not reachable through a firewall
+// or a container's published ports.
+int pasv_acquire(ClientSession *session)
+{
+    PasvPool *pool = &session->worker->pasv_pool;
+    pasv_release(session);
+    if (pool->free_count == 0)
+    {
+        counter_add(&session->worker->metrics.pasv_fallback, 1);
+        return pasv_ephemeral ? pasv_acquire_ephemeral(session) : -1;
+    }
+
+    int slot = pool->free_ring[pool->free_head];
+    pool->free_head = (pool->free_head + 1) % pool->size;
+    pool->free_count--;
+    counter_add(&session->worker->metrics.pasv_in_use, 1);
+
+    // Drop connections that reached this port after its previous owner gave it up
+    PasvListener *listener = &pool->listeners[slot];
+    int stale;
+    while ((stale = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+        close(stale);
+    }
+
+    session->pasv.fd = listener->fd;
+    session->pasv_slot = slot;
+    ev_set(session->worker, &session->pasv, EPOLLIN);
+    return listener->port;
+}
+
+void pasv_release(ClientSession *session)
+{
+    if (session->pasv_slot < 0)
+    {
+        ev_close(session->worker, &session->pasv);
+        return;
+    }
+
+    PasvPool *pool = &session->worker->pasv_pool;
+    if (session->pasv.registered)
+    {
+        epoll_ctl(session->worker->epoll_fd, EPOLL_CTL_DEL, session->pasv.fd, NULL);
+    }
+    session->pasv.fd = -1;
+    session->pasv.registered = 0;
+    session->pasv.events = 0;
+
+    pool->free_ring[(pool->free_head + pool->free_count) % pool->size] = session->pasv_slot;
+    pool->free_count++;
+    counter_sub(&session->worker->metrics.pasv_in_use, 1);
+    session->pasv_slot = -1;
+}
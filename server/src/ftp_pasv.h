@@ -0,0 +1,22 @@
+#ifndef FTP_PASV_H
+#define FTP_PASV_H
+
+#include <netinet/in.h>
+#include "ftp_server.h"
+
+#define DEFAULT_PASV_PORT_MIN 50000
+#define DEFAULT_PASV_PORT_MAX 50999
+#define PASV_BACKLOG 8
+
+// Set by -pasv-ephemeral: a worker whose slice of the range is in use listens on a kernel-assigned
+// port outside it, instead of refusing PASV/EPSV
+extern int pasv_ephemeral;
+// Set by -pasv-address: advertised in 227 replies instead of the control connection's local
+// address, for a server behind NAT or in a container
+extern struct in_addr pasv_address;
+
+int pasv_pool_init(PasvPool *pool, int first_port, int last_port);
+int pasv_acquire(ClientSession *session);
+void pasv_release(ClientSession *session);
+
+#endif // FTP_PASV_H
@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include "ftp_path.h"
+
+int root_fd = -1;
+
+// Kernels before 5.6 lack openat2(); paths are still normalized lexically there, so only
+// symlinks inside the root can lead out of it
+static int have_openat2 = 1;
+
+int path_init(const char *root)
+{
+    root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    return root_fd < 0 ? -1 : 0;
+}
+
+static int open_beneath(int dir_fd, const char *name, int flags, mode_t mode)
+{
+    if (have_openat2)
+    {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags | O_CLOEXEC;
+        how.mode = (flags & O_CREAT) ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = syscall(SYS_openat2, dir_fd, name, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS)
+        {
+            return fd;
+        }
+        have_openat2 = 0;
+    }
+    return openat(dir_fd, name, flags | O_CLOEXEC, mode);
+}
+
+// Joins arg onto cwd and folds "." and ".." without touching the filesystem; ".." stops at the root
+int path_normalize(const char *cwd, const char *arg, char *out, size_t cap)
+{
+    size_t len = 0;
+    const char *parts[2] = {arg[0] == '/' ? "" : cwd, arg};
+
+    for (int i = 0; i < 2; i++)
+    {
+        const char *p = parts[i];
+        while (*p != '\0')
+        {
+            while (*p == '/')
+            {
+                p++;
+            }
+            const char *start = p;
+            while (*p != '\0' && *p != '/')
+            {
+                p++;
+            }
+            size_t n = p - start;
+
+            if (n == 0 || (n == 1 && start[0] == '.'))
+            {
+                continue;
+            }
+            if (n == 2 && start[0] == '.' && start[1] == '.')
+            {
+                while (len > 0 && out[len - 1] != '/')
+                {
+                    len--;
+                }
+                if (len > 0)
+                {
+                    len--;
+                }
+                continue;
+            }
+            if (len + 1 + n + 1 > cap)
+            {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            out[len++] = '/';
+            memcpy(out + len, start, n);
+            len += n;
+        }
+    }
+
+    if (len == 0)
+    {
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    return 0;
+}
+
+static size_t handle_slot(const char *vdir)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)vdir; *p != '\0'; p++)
+    {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash % DIR_HANDLE_SLOTS;
+}
+
+// Returns a cached O_PATH handle for the virtual directory vdir, opening it on a miss.
+// *cached tells the caller whether a stale handle could be to blame for a later ENOENT.
+static int dir_handle(Worker *worker, const char *vdir, int *cached)
+{
+    if (strcmp(vdir, "/") == 0)
+    {
+        *cached = 0;
+        return root_fd;
+    }
+
+    DirHandle *slot = &worker->dir_handles[handle_slot(vdir)];
+    if (slot->path != NULL && strcmp(slot->path, vdir) == 0)
+    {
+        *cached = 1;
+        return slot->fd;
+    }
+
+    *cached = 0;
+    int fd = open_beneath(root_fd, vdir + 1, O_PATH | O_DIRECTORY, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    char *copy = strdup(vdir);
+    if (copy == NULL)
+    {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (slot->path != NULL)
+    {
+        close(slot->fd);
+        free(slot->path);
+    }
+    slot->path = copy;
+    slot->fd = fd;
+    return fd;
+}
+
+// Drops the cached handle for vdir, e.g. after RMD or when it turned out to be stale
+void path_forget(Worker *worker, const char *vdir)
+{
+    DirHandle *slot = &worker->dir_handles[handle_slot(vdir)];
+    if (slot->path != NULL && strcmp(slot->path, vdir) == 0)
+    {
+        close(slot->fd);
+        free(slot->path);
+        slot->path = NULL;
+        slot->fd = -1;
+    }
+}
+
+// Drops the handles for vdir and every directory below it, once vdir was renamed or removed
+void path_forget_tree(Worker *worker, const char *vdir)
+{
+    size_t len = vdir[1] == '\0' ? 0 : strlen(vdir);
+    for (int i = 0; i < DIR_HANDLE_SLOTS; i++)
+    {
+        DirHandle *slot = &worker->dir_handles[i];
+        if (slot->path != NULL && strncmp(slot->path, vdir, len) == 0 && (slot->path[len] == '\0' || slot->path[len] == '/'))
+        {
+            close(slot->fd);
+            free(slot->path);
+            slot->path = NULL;
+            slot->fd = -1;
+        }
+    }
+}
+
+typedef enum
+{
+    PATH_OP_OPEN,
+    PATH_OP_STAT,
+    PATH_OP_MKDIR,
+    PATH_OP_RMDIR,
+    PATH_OP_UNLINK
+} PathOp;
+
+typedef struct
+{
+    int flags;
+    mode_t mode;
+    struct stat *st;
+} PathArgs;
+
+// Splits vpath into its parent handle and last component
+static int split(Worker *worker, ResolvedPath *resolved, int *cached)
+{
+    char *slash = strrchr(resolved->vpath, '/');
+    if (slash[1] == '\0')
+    {
+        resolved->name = ".";
+        resolved->dir_fd = root_fd;
+        *cached = 0;
+        return 0;
+    }
+
+    resolved->name = slash + 1;
+    if (slash == resolved->vpath)
+    {
+        resolved->dir_fd = root_fd;
+        *cached = 0;
+        return 0;
+    }
+
+    *slash = '\0';
+    resolved->dir_fd = dir_handle(worker, resolved->vpath, cached);
+    *slash = '/';
+    return resolved->dir_fd < 0 ? -1 : 0;
+}
+
+static int apply(const ResolvedPath *resolved, PathOp op, const PathArgs *args)
+{
+    switch (op)
+    {
+    case PATH_OP_OPEN:
+        return open_beneath(resolved->dir_fd, resolved->name, args->flags, args->mode);
+    case PATH_OP_STAT:
+    {
+        int fd = open_beneath(resolved->dir_fd, resolved->name, O_PATH, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        int rc = fstat(fd, args->st);
+        close(fd);
+        return rc;
+    }
+    case PATH_OP_MKDIR:
+        return mkdirat(resolved->dir_fd, resolved->name, 0777);
+    case PATH_OP_RMDIR:
+        return unlinkat(resolved->dir_fd, resolved->name, AT_REMOVEDIR);
+    case PATH_OP_UNLINK:
+        return unlinkat(resolved->dir_fd, resolved->name, 0);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+// The last component is never followed out of the root: open and stat go through openat2(),
+// and mkdirat()/unlinkat() do not follow a trailing symlink at all
+static int resolve_and_apply(ClientSession *session, const char *arg, PathOp op, const PathArgs *args, ResolvedPath *resolved)
+{
+    if (path_normalize(session->cwd, arg, resolved->vpath, sizeof(resolved->vpath)) < 0)
+    {
+        return -1;
+    }
+
+    int cached;
+    if (split(session->worker, resolved, &cached) < 0)
+    {
+        return -1;
+    }
+    int rc = apply(resolved, op, args);
+    if (rc < 0 && errno == ENOENT && cached)
+    {
+        // The parent may have been removed and recreated since its handle was cached
+        char *slash = strrchr(resolved->vpath, '/');
+        *slash = '\0';
+        path_forget(session->worker, resolved->vpath);
+        *slash = '/';
+        if (split(session->worker, resolved, &cached) < 0)
+        {
+            return -1;
+        }
+        rc = apply(resolved, op, args);
+    }
+    return rc;
+}
+
+int path_open(ClientSession *session, const char *arg, int flags, mode_t mode, ResolvedPath *resolved)
+{
+    PathArgs args = {flags, mode, NULL};
+    return resolve_and_apply(session, arg, PATH_OP_OPEN, &args, resolved);
+}
+
+int path_stat(ClientSession *session, const char *arg, struct stat *st, ResolvedPath *resolved)
+{
+    PathArgs args = {0, 0, st};
+    return resolve_and_apply(session, arg, PATH_OP_STAT, &args, resolved);
+}
+
+int path_mkdir(ClientSession *session, const char *arg, ResolvedPath *resolved)
+{
+    PathArgs args = {0, 0, NULL};
+    return resolve_and_apply(session, arg, PATH_OP_MKDIR, &args, resolved);
+}
+
+int path_rmdir(ClientSession *session, const char *arg, ResolvedPath *resolved)
+{
+    PathArgs args = {0, 0, NULL};
+    if (resolve_and_apply(session, arg, PATH_OP_RMDIR, &args, resolved) < 0)
+    {
+        return -1;
+    }
+    path_forget(session->worker, resolved->vpath);
+    return 0;
+}
+
+int path_unlink(ClientSession *session, const char *arg, ResolvedPath *resolved)
+{
+    PathArgs args = {0, 0, NULL};
+    return resolve_and_apply(session, arg, PATH_OP_UNLINK, &args, resolved);
+}
+
+// Changes the session's virtual working directory; the handle stays cached for the commands that follow
+int path_chdir(ClientSession *session, const char *arg)
+{
+    char vpath[PATH_MAX];
+    if (path_normalize(session->cwd, arg, vpath, sizeof(vpath)) < 0)
+    {
+        return -1;
+    }
+    int cached;
+    if (dir_handle(session->worker, vpath, &cached) < 0)
+    {
+        return -1;
+    }
+    memcpy(session->cwd, vpath, strlen(vpath) + 1);
+    return 0;
+}
+
+// Creates every missing directory above vpath, like mkdir -p on its parent
+int path_make_parents(Worker *worker, const char *vpath)
+{
+    char dir[PATH_MAX];
+    size_t len = strlen(vpath);
+    if (len >= sizeof(dir))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(dir, vpath, len + 1);
+
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+    {
+        return 0;
+    }
+    *slash = '\0';
+
+    int cached;
+    if (dir_handle(worker, dir, &cached) >= 0)
+    {
+        return 0;
+    }
+    if (errno != ENOENT || path_make_parents(worker, dir) < 0)
+    {
+        return -1;
+    }
+
+    // The parent of dir exists now
+    slash = strrchr(dir, '/');
+    int parent_fd;
+    if (slash == dir)
+    {
+        parent_fd = root_fd;
+    }
+    else
+    {
+        *slash = '\0';
+        parent_fd = dir_handle(worker, dir, &cached);
+        *slash = '/';
+    }
+    if (parent_fd < 0 || (mkdirat(parent_fd, slash + 1, 0777) != 0 && errno != EEXIST))
+    {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef FTP_PATH_H
+#define FTP_PATH_H
+
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "ftp_server.h"
+
+// A client path resolved against the session's virtual working directory
+typedef struct
+{
+    char vpath[PATH_MAX]; // normalized, "/" is the root directory
+    int dir_fd;           // O_PATH handle of the parent directory, owned by the worker's cache
+    const char *name;     // last component of vpath, "." for the root itself
+} ResolvedPath;
+
+extern int root_fd;
+
+int path_init(const char *root);
+int path_normalize(const char *cwd, const char *arg, char *out, size_t cap);
+
+// Each of these resolves arg for the session and fills *resolved. Containment in the root is
+// enforced by openat2(RESOLVE_BENEATH); they return -1 with errno set on failure.
+int path_open(ClientSession *session, const char *arg, int flags, mode_t mode, ResolvedPath *resolved);
+int path_stat(ClientSession *session, const char *arg, struct stat *st, ResolvedPath *resolved);
+int path_mkdir(ClientSession *session, const char *arg, ResolvedPath *resolved);
+int path_rmdir(ClientSession *session, const char *arg, ResolvedPath *resolved);
+int path_unlink(ClientSession *session, const char *arg, ResolvedPath *resolved);
+int path_chdir(ClientSession *session, const char *arg);
+
+int path_make_parents(Worker *worker, const char *vpath);
+void path_forget(Worker *worker, const char *vdir);
+void path_forget_tree(Worker *worker, const char *vdir);
+
+#endif // FTP_PATH_H
@@ -1,626 +1,1795 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <limits.h> // For PATH_MAX
-#include <libgen.h> // For dirname() function
 #include <errno.h> // For errno
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include "ftp_server.h"
+#include "ftp_transfer.h"
+#include "ftp_list.h"
+#include "ftp_pasv.h"
+#include "ftp_control.h"
+#include "ftp_command.h"
+#include "ftp_path.h"
+#include "ftp_block.h"
+#include "ftp_codec.h"
+#include "ftp_arena.h"
+#include "ftp_metrics.h"
+#include "ftp_log.h"
+#include "ftp_uring.h"
+#include "ftp_filecache.h"
+#include "ftp_hash.h"
+#include "ftp_admission.h"
+#include "ftp_timer.h"
 
-int data_socket = -1;
-struct sockaddr_in data_addr;
 char *root_dir = NULL;
+int pasv_port_min = DEFAULT_PASV_PORT_MIN;
+int pasv_port_max = DEFAULT_PASV_PORT_MAX;
+static Worker *workers = NULL;
+static int num_workers = 0;
+static int max_sessions = 0;
+static int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static int data_timeout = DEFAULT_DATA_TIMEOUT;
 
-typedef struct
+static void session_close(ClientSession *session);
+
+void ev_set(Worker *worker, EventSource *ev, uint32_t events)
 {
-    int client_socket;
-    int logged_in;
-} ClientSession;
+    if (ev->fd < 0 || (ev->registered && ev->events == events))
+    {
+        return;
+    }
 
-char* get_absolute_path(const char* relative_path) {
-    printf("DEBUG: get_absolute_path called with: %s\n", relative_path);
-    
-    char* abs_path = malloc(PATH_MAX);
-    if (abs_path == NULL) {
-        printf("DEBUG: Failed to allocate memory for abs_path\n");
-        return NULL;
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+    ee.events = events;
+    ee.data.ptr = ev;
+    if (epoll_ctl(worker->epoll_fd, ev->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, ev->fd, &ee) == 0)
+    {
+        ev->registered = 1;
+        ev->events = events;
+    }
+    else
+    {
+        LOG_ERROR("epoll_ctl: %s", strerror(errno));
     }
+}
 
-    if (relative_path[0] == '/') {
-        // It's already an absolute path
-        snprintf(abs_path, PATH_MAX, "%s%s", root_dir, relative_path);
-    } else {
-        // It's a relative path
-        char cwd[PATH_MAX];
-        if (getcwd(cwd, sizeof(cwd)) == NULL) {
-            printf("DEBUG: Failed to get current working directory\n");
-            free(abs_path);
-            return NULL;
+void ev_close(Worker *worker, EventSource *ev)
+{
+    if (ev->fd < 0)
+    {
+        return;
+    }
+    if (ev->registered)
+    {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL);
+    }
+    close(ev->fd);
+    ev->fd = -1;
+    ev->registered = 0;
+    ev->events = 0;
+}
+
+// Stops watching ev and hands its still-open fd to the caller
+int ev_detach(Worker *worker, EventSource *ev)
+{
+    int fd = ev->fd;
+    if (ev->registered)
+    {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    ev->fd = -1;
+    ev->registered = 0;
+    ev->events = 0;
+    return fd;
+}
+
+// Handles one command read from the control connection
+void handle_client(ClientSession *session, char *line)
+{
+    char *saveptr = NULL;
+    char *command = strtok_r(line, " \r\n", &saveptr);
+    if (command == NULL)
+    {
+        return;
+    }
+
+    char *args = strtok_r(NULL, "\r\n", &saveptr);
+    if (args == NULL)
+    {
+        args = "";
+    }
+
+    const FtpCommand *cmd = command_lookup(command);
+    if (cmd == NULL)
+    {
+        send_response(session, session->logged_in ? "502 Command not implemented\r\n" : "530 Not logged in\r\n");
+        LOG_DEBUG("worker %d session %llu: unknown command %.16s", session->worker->id, (unsigned long long)session->id, command);
+        return;
+    }
+
+    Metrics *metrics = &session->worker->metrics;
+    if (cmd->auth == AUTH_REQUIRED && !session->logged_in)
+    {
+        counter_add(&metrics->commands[cmd->id].errors, 1);
+        send_response(session, "530 Not logged in\r\n");
+        return;
+    }
+    if ((cmd->arity == ARG_REQUIRED && args[0] == '\0') || (cmd->arity == ARG_NONE && args[0] != '\0'))
+    {
+        counter_add(&metrics->commands[cmd->id].errors, 1);
+        send_response(session, "501 Syntax error in parameters or arguments\r\n");
+        return;
+    }
+
+    // Started before the handler, which may rewrite args in place
+    LogRecord rec;
+    if (LOG_ENABLED(LOG_LEVEL_INFO))
+    {
+        log_begin(&rec, LOG_LEVEL_INFO, "command");
+        log_int(&rec, "worker", session->worker->id);
+        log_uint(&rec, "session", session->id);
+        log_str(&rec, "cmd", cmd->name);
+        if (args[0] != '\0')
+        {
+            log_str(&rec, "arg", cmd->id == CMD_PASS ? "***" : args);
         }
-        snprintf(abs_path, PATH_MAX, "%s/%s", cwd, relative_path);
     }
 
-    printf("DEBUG: Constructed path: %s\n", abs_path);
+    session->reply_code = 0;
+    uint64_t start = metrics_now_ns();
+    cmd->handler(session, args);
+    uint64_t elapsed = metrics_command(metrics, cmd->id, start);
 
-    // Check if the path is within the root directory
-    char* real_root = realpath(root_dir, NULL);
-    if (real_root == NULL) {
-        printf("DEBUG: Failed to resolve root directory\n");
-        free(abs_path);
-        return NULL;
+    if (LOG_ENABLED(LOG_LEVEL_INFO))
+    {
+        log_int(&rec, "code", session->reply_code);
+        log_double(&rec, "latency_us", elapsed / 1e3);
+        log_end(&rec);
     }
+    arena_reset(&session->arena);
 
-    if (strncmp(abs_path, real_root, strlen(real_root)) != 0) {
-        printf("DEBUG: Path is outside root directory\n");
-        free(abs_path);
-        free(real_root);
-        return NULL;
+    // A restart marker is only good for the transfer command immediately after REST
+    if (cmd->id != CMD_REST)
+    {
+        session->restart_offset = 0;
+    }
+    if (cmd->id != CMD_RANG)
+    {
+        session->range_start = 0;
+        session->range_end = 0;
     }
+}
 
-    free(real_root);
-    return abs_path;
+static int flush_output(ClientSession *session)
+{
+    size_t sent_total = 0;
+    while (sent_total < session->out_len)
+    {
+        ssize_t sent = send(session->ctrl.fd, session->out + sent_total, session->out_len - sent_total, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        sent_total += sent;
+    }
+
+    memmove(session->out, session->out + sent_total, session->out_len - sent_total);
+    session->out_len -= sent_total;
+    return 0;
 }
 
-void handle_client(int client_socket)
+// Formats a reply in the session's arena and queues it
+void send_responsef(ClientSession *session, const char *fmt, ...)
 {
-    ClientSession session = {client_socket, 0}; // Initialize session with client_socket and logged_in = 0
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
+    va_list ap;
+    va_start(ap, fmt);
+    char *response = arena_vprintf(&session->arena, fmt, ap);
+    va_end(ap);
+    send_response(session, response != NULL ? response : "451 Requested action aborted: local error in processing\r\n");
+}
 
-    send_response(session.client_socket, "220 Anonymous FTP server ready.\r\n");
+// Queues a reply; everything queued while handling one event goes out in a single send
+void send_response(ClientSession *session, const char *response)
+{
+    if (session->dead)
+    {
+        return;
+    }
 
-    while ((bytes_read = recv(session.client_socket, buffer, BUFFER_SIZE, 0)) > 0)
+    size_t len = strlen(response);
+    if (session->out_len + len > session->out_cap)
     {
-        buffer[bytes_read] = '\0';
-        char *command = strtok(buffer, " \r\n");
+        size_t cap = session->out_cap > 0 ? session->out_cap : 512;
+        while (cap < session->out_len + len)
+        {
+            cap *= 2;
+        }
+        char *grown = cap <= REPLY_MAX ? realloc(session->out, cap) : NULL;
+        if (grown == NULL)
+        {
+            // The client is not reading its replies
+            session_close(session);
+            return;
+        }
+        session->out = grown;
+        session->out_cap = cap;
+    }
+
+    memcpy(session->out + session->out_len, response, len);
+    session->out_len += len;
+    session->reply_code = atoi(response);
+}
 
-        char *args = strtok(NULL, "\r\n");
-        printf("Command Received: %s, socket: %d, args: %s\n", command, session.client_socket, args);
+static int session_busy(const ClientSession *session)
+{
+    return session->xfer.kind != XFER_NONE || session->data_connecting || session->hash != NULL;
+}
 
-        if (strcasecmp(command, "USER") == 0)
+// Commands are read ahead while a transfer runs, but only ABOR is acted on before it completes
+void session_update_events(ClientSession *session)
+{
+    if (session->dead)
+    {
+        return;
+    }
+
+    uint32_t events = 0;
+    if (!session->closing && !session->input_eof && ring_space(&session->in) > 0)
+    {
+        events |= EPOLLIN;
+    }
+    if (session->out_len > 0)
+    {
+        events |= EPOLLOUT;
+    }
+    ev_set(session->worker, &session->ctrl, events);
+}
+
+// Runs queued command lines in order. Returns 1 if it stopped because too many replies are
+// waiting to be sent.
+static int session_process_input(ClientSession *session)
+{
+    char line[CMD_BUFFER_SIZE + 1];
+    size_t consumed;
+
+    while (!session->dead && !session->closing)
+    {
+        if (session->out_len >= REPLY_HIGH_WATER)
         {
-            handle_user(session.client_socket, args);
+            return 1;
         }
-        else if (strcasecmp(command, "PASS") == 0)
+
+        int ready = ring_peek_line(&session->in, line, sizeof(line), &consumed);
+        if (ready < 0)
         {
-            handle_pass(session.client_socket, args);
-            session.logged_in = 1;
+            send_response(session, "500 Command line too long\r\n");
+            continue;
         }
-        else if (session.logged_in)
+        if (ready == 0)
+        {
+            break;
+        }
+
+        if (session_busy(session))
         {
-            if (strcasecmp(command, "QUIT") == 0)
+            // ABOR is the one command allowed to overtake a running transfer
+            char *saveptr = NULL;
+            char *command = strtok_r(line, " ", &saveptr);
+            const FtpCommand *cmd = command != NULL ? command_lookup(command) : NULL;
+            if (cmd == NULL || cmd->id != CMD_ABOR)
             {
-                handle_quit(session.client_socket);
                 break;
             }
-            else if (strcasecmp(command, "RETR") == 0)
-            {
-                handle_retr(session.client_socket, args);
-            }
-            else if (strcasecmp(command, "STOR") == 0)
-            {
-                handle_stor(session.client_socket, args);
-            }
-            else if (strcasecmp(command, "PORT") == 0)
-            {
-                handle_port(session.client_socket, args);
-            }
-            else if (strcasecmp(command, "PASV") == 0)
-            {
-                handle_pasv(session.client_socket);
-            }
-            else if (strcasecmp(command, "TYPE") == 0)
-            {
-                handle_type(session.client_socket, args);
-            }
-            else if (strcasecmp(command, "LIST") == 0)
-            {
-                handle_list(session.client_socket, args);
-            }
-            else if (strcasecmp(command, "MKD") == 0)
-            {
-                handle_mkd(session.client_socket, args);
-            }
-            else if (strcasecmp(command, "CWD") == 0)
-            {
-                handle_cwd(session.client_socket, args);
-            }
-            else if (strcasecmp(command, "PWD") == 0)
-            {
-                handle_pwd(session.client_socket);
-            }
-            else if (strcasecmp(command, "RMD") == 0)
-            {
-                handle_rmd(session.client_socket, args);
-            }
-            else if (strcasecmp(command, "SYST") == 0)
-            {
-                handle_syst(session.client_socket);
-            }
-            else if (strcasecmp(command, "ABOR") == 0)
-            {
-                handle_abor(session.client_socket);
-            }
-            else if (strcasecmp(command, "EPSV") == 0)
-            {
-                handle_epsv(session.client_socket);
-            }
-            else if (strcasecmp(command, "TYPE") == 0)
+            ring_consume(&session->in, consumed);
+            handle_abor(session, "");
+            continue;
+        }
+
+        ring_consume(&session->in, consumed);
+        handle_client(session, line);
+    }
+    return 0;
+}
+
+// Called after every event on any of the session's sockets
+static void session_service(ClientSession *session)
+{
+    session->last_active = session->worker->timers.now;
+    int throttled;
+    do
+    {
+        throttled = session_process_input(session);
+        if (session->dead)
+        {
+            return;
+        }
+        if (session->out_len > 0 && flush_output(session) < 0)
+        {
+            session_close(session);
+            return;
+        }
+    } while (throttled && session->out_len < REPLY_HIGH_WATER);
+
+    if (session->out_len == 0 && (session->closing || (session->input_eof && !session_busy(session))))
+    {
+        session_close(session);
+        return;
+    }
+    session_update_events(session);
+}
+
+// Drops any data connection or passive listener the session holds
+void data_reset(ClientSession *session)
+{
+    ev_close(session->worker, &session->data);
+    block_reset(session);
+    pasv_release(session);
+    session->data_connecting = 0;
+}
+
+static int data_available(ClientSession *session)
+{
+    return session->data.fd >= 0 || session->pasv.fd >= 0 || session->data_connecting || session->stream_count > 0;
+}
+
+static void on_data_event(ClientSession *session, uint32_t events)
+{
+    if (session->data_connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(session->data.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        session->data_connecting = 0;
+        if (err != 0)
+        {
+            ev_close(session->worker, &session->data);
+            send_response(session, "425 Can't open data connection\r\n");
+            return;
+        }
+        ev_set(session->worker, &session->data, 0);
+        send_response(session, "200 PORT command successful\r\n");
+        return;
+    }
+
+    if (session->xfer.kind != XFER_NONE)
+    {
+        transfer_pump(session);
+    }
+    else if (events & (EPOLLHUP | EPOLLERR))
+    {
+        // The client dropped an idle data connection
+        ev_close(session->worker, &session->data);
+    }
+}
+
+static void on_pasv_event(ClientSession *session)
+{
+    struct sockaddr_in client_data_addr;
+    socklen_t client_data_addr_len = sizeof(client_data_addr);
+    int fd = accept4(session->pasv.fd, (struct sockaddr *)&client_data_addr, &client_data_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return;
+        }
+        pasv_release(session);
+        if (session->xfer.kind != XFER_NONE)
+        {
+            transfer_finish(session, "425 Can't open data connection\r\n");
+        }
+        return;
+    }
+
+    // Only the client on the control connection may use the data port
+    if (client_data_addr.sin_addr.s_addr != session->peer_addr.sin_addr.s_addr)
+    {
+        close(fd);
+        return;
+    }
+
+    if (session->mode == DATA_MODE_BLOCK)
+    {
+        // Keep listening until all the connections announced with OPTS have arrived
+        block_add_stream(session, fd);
+        if (session->stream_count >= session->parallelism)
+        {
+            pasv_release(session);
+        }
+        return;
+    }
+
+    pasv_release(session);
+    ev_close(session->worker, &session->data);
+    session->data.fd = fd;
+    if (session->xfer.kind != XFER_NONE)
+    {
+        transfer_data_ready(session);
+    }
+    else
+    {
+        ev_set(session->worker, &session->data, 0);
+    }
+}
+
+static void on_control_event(ClientSession *session, uint32_t events)
+{
+    if ((events & EPOLLOUT) && flush_output(session) < 0)
+    {
+        session_close(session);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        ssize_t bytes_read = ring_fill(&session->in, session->ctrl.fd);
+        if (bytes_read == 0)
+        {
+            // Still answer whatever complete commands arrived before the EOF
+            session->input_eof = 1;
+        }
+        else if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            session_close(session);
+            return;
+        }
+    }
+
+    session_service(session);
+}
+
+static int timeouts_enabled(void)
+{
+    return idle_timeout > 0 || data_timeout > 0 || max_sessions > 0;
+}
+
+// Under overload, idle control connections give way to the clients being refused
+static int idle_limit(void)
+{
+    if (admission_overloaded() && (idle_timeout == 0 || idle_timeout > ADMISSION_SHED_IDLE))
+    {
+        return ADMISSION_SHED_IDLE;
+    }
+    return idle_timeout;
+}
+
+// The next check is the idle deadline, but never further out than a quarter of -data-timeout,
+// so a transfer started in between is watched from early on, nor than the shed timeout while
+// shedding can begin. Events only move last_active; the check itself reschedules, so the wheel
+// is not touched per command.
+static void session_schedule(ClientSession *session)
+{
+    if (!timeouts_enabled())
+    {
+        return;
+    }
+    TimerWheel *timers = &session->worker->timers;
+    uint64_t due = timers->now + TIMER_SLOTS;
+    if (data_timeout > 0 && timers->now + (data_timeout + 3) / 4 < due)
+    {
+        due = timers->now + (data_timeout + 3) / 4;
+    }
+    if (max_sessions > 0 && timers->now + ADMISSION_SHED_IDLE < due)
+    {
+        due = timers->now + ADMISSION_SHED_IDLE;
+    }
+    int limit = idle_limit();
+    if (session->xfer.kind == XFER_NONE && limit > 0 && session->last_active + limit < due)
+    {
+        due = session->last_active + limit;
+    }
+    timer_schedule(timers, &session->timer, due);
+}
+
+static void log_timeout(ClientSession *session, const char *event, int seconds)
+{
+    if (LOG_ENABLED(LOG_LEVEL_INFO))
+    {
+        LogRecord rec;
+        log_begin(&rec, LOG_LEVEL_INFO, event);
+        log_int(&rec, "worker", session->worker->id);
+        log_uint(&rec, "session", session->id);
+        log_int(&rec, "seconds", seconds);
+        log_end(&rec);
+    }
+}
+
+// A session's timer came due: abort a transfer that has stopped moving, or close a control
+// connection that has gone quiet. Checksums in progress count as activity.
+static void session_expire(TimerNode *node)
+{
+    ClientSession *session = (ClientSession *)((char *)node - offsetof(ClientSession, timer));
+    Worker *worker = session->worker;
+    uint64_t now = worker->timers.now;
+
+    // The 421 from an earlier expiry is still unread
+    if (session->closing)
+    {
+        session_close(session);
+        return;
+    }
+
+    if (session->xfer.kind != XFER_NONE)
+    {
+        Transfer *xfer = &session->xfer;
+        if (session->stall_xfer != xfer->started_ns || session->stall_bytes != xfer->bytes)
+        {
+            session->stall_xfer = xfer->started_ns;
+            session->stall_bytes = xfer->bytes;
+            session->stall_since = now;
+        }
+        else if (data_timeout > 0 && now - session->stall_since >= (uint64_t)data_timeout)
+        {
+            counter_add(&worker->metrics.transfers_stalled, 1);
+            log_timeout(session, "transfer_stalled", data_timeout);
+            transfer_finish(session, "426 Data connection timed out; transfer aborted\r\n");
+            session_service(session);
+        }
+    }
+    else if (session->hash == NULL)
+    {
+        int limit = idle_limit();
+        if (limit > 0 && now - session->last_active >= (uint64_t)limit)
+        {
+            int shed = limit != idle_timeout;
+            counter_add(shed ? &worker->metrics.sessions_shed : &worker->metrics.sessions_timed_out, 1);
+            log_timeout(session, shed ? "session_shed" : "session_timeout", limit);
+            send_response(session, shed ? "421 Server busy, closing idle control connection\r\n"
+                                         : "421 Timeout, closing idle control connection\r\n");
+            session->closing = 1;
+            session_service(session);
+        }
+    }
+
+    if (!session->dead)
+    {
+        session_schedule(session);
+    }
+}
+
+// Each pool object is a ClientSession followed by its arena storage, rounded to a cache line
+static size_t session_stride(void)
+{
+    return (SESSION_ARENA_OFFSET + SESSION_ARENA_SIZE + 63) & ~(size_t)63;
+}
+
+// Sessions come from slabs owned by the worker and go back on its free list when reaped, so
+// connection churn never reaches the shared allocator
+static ClientSession *session_alloc(Worker *worker)
+{
+    if (worker->session_free == NULL)
+    {
+        size_t stride = session_stride();
+        char *slab = aligned_alloc(64, stride * SESSION_SLAB_SIZE);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        for (int i = SESSION_SLAB_SIZE - 1; i >= 0; i--)
+        {
+            ClientSession *session = (ClientSession *)(slab + i * stride);
+            session->next_free = worker->session_free;
+            worker->session_free = session;
+        }
+    }
+
+    ClientSession *session = worker->session_free;
+    worker->session_free = session->next_free;
+    memset(session, 0, sizeof(ClientSession));
+    arena_init(&session->arena, (char *)session + SESSION_ARENA_OFFSET, SESSION_ARENA_SIZE);
+    return session;
+}
+
+static void session_free(Worker *worker, ClientSession *session)
+{
+    free(session->out);
+    arena_reset(&session->arena);
+    session->next_free = worker->session_free;
+    worker->session_free = session;
+}
+
+// Refused before any session exists; a fresh socket always has room for the one line
+static void session_reject(Worker *worker, int fd, const struct sockaddr_in *peer_addr, Admission admission)
+{
+    const char *reply = admission == ADMIT_IP_FULL ? "421 Too many connections from your address\r\n"
+                                                   : "421 Too many connections, try again later\r\n";
+    send(fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+    counter_add(admission == ADMIT_IP_FULL ? &worker->metrics.sessions_rejected_ip : &worker->metrics.sessions_rejected, 1);
+    if (LOG_ENABLED(LOG_LEVEL_INFO))
+    {
+        char peer[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer_addr->sin_addr, peer, sizeof(peer));
+        LogRecord rec;
+        log_begin(&rec, LOG_LEVEL_INFO, "session_reject");
+        log_int(&rec, "worker", worker->id);
+        log_str(&rec, "peer", peer);
+        log_str(&rec, "reason", admission == ADMIT_IP_FULL ? "per_ip" : "server_full");
+        log_end(&rec);
+    }
+}
+
+static void session_open(Worker *worker, int fd, const struct sockaddr_in *peer_addr)
+{
+    Admission admission = admission_enter(peer_addr->sin_addr);
+    if (admission != ADMIT_OK)
+    {
+        session_reject(worker, fd, peer_addr, admission);
+        return;
+    }
+    ClientSession *session = session_alloc(worker);
+    if (session == NULL)
+    {
+        admission_leave(peer_addr->sin_addr);
+        close(fd);
+        return;
+    }
+
+    session->worker = worker;
+    session->ctrl = (EventSource){EV_CONTROL, fd, 0, 0, session};
+    session->data = (EventSource){EV_DATA, -1, 0, 0, session};
+    session->pasv = (EventSource){EV_PASV, -1, 0, 0, session};
+    session->pasv_slot = -1;
+    for (int i = 0; i < MAX_STREAMS; i++)
+    {
+        session->streams[i].ev = (EventSource){EV_STREAM, -1, 0, 0, session};
+    }
+    session->parallelism = 1;
+    session->peer_addr = *peer_addr;
+    socklen_t local_len = sizeof(session->local_addr);
+    if (getsockname(fd, (struct sockaddr *)&session->local_addr, &local_len) < 0)
+    {
+        session->local_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    transfer_init(&session->xfer);
+    strcpy(session->cwd, "/");
+    counter_add(&worker->metrics.sessions_accepted, 1);
+    counter_add(&worker->metrics.sessions_active, 1);
+    session->id = worker->metrics.sessions_accepted;
+    if (LOG_ENABLED(LOG_LEVEL_INFO))
+    {
+        char peer[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer_addr->sin_addr, peer, sizeof(peer));
+        LogRecord rec;
+        log_begin(&rec, LOG_LEVEL_INFO, "session_open");
+        log_int(&rec, "worker", worker->id);
+        log_uint(&rec, "session", session->id);
+        log_str(&rec, "peer", peer);
+        log_int(&rec, "port", ntohs(peer_addr->sin_port));
+        log_end(&rec);
+    }
+
+    send_response(session, "220 Anonymous FTP server ready.\r\n");
+    session_service(session);
+    if (!session->dead)
+    {
+        session_schedule(session);
+    }
+}
+
+static void session_close(ClientSession *session)
+{
+    if (session->dead)
+    {
+        return;
+    }
+
+    Worker *worker = session->worker;
+    session->dead = 1;
+    transfer_abandon(session);
+    hash_cancel(session);
+    codec_destroy(session->compressor);
+    codec_destroy(session->decompressor);
+    data_reset(session);
+    ev_close(worker, &session->ctrl);
+    timer_cancel(&worker->timers, &session->timer);
+    admission_leave(session->peer_addr.sin_addr);
+
+    // Events for this session may still be pending in the current batch
+    session->next_dead = worker->graveyard;
+    worker->graveyard = session;
+    counter_sub(&worker->metrics.sessions_active, 1);
+    if (LOG_ENABLED(LOG_LEVEL_INFO))
+    {
+        LogRecord rec;
+        log_begin(&rec, LOG_LEVEL_INFO, "session_close");
+        log_int(&rec, "worker", worker->id);
+        log_uint(&rec, "session", session->id);
+        log_end(&rec);
+    }
+}
+
+static void accept_clients(Worker *worker)
+{
+    for (int i = 0; i < ACCEPT_BURST; i++)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_socket = accept4(worker->listener.fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
             {
-                handle_type(session.client_socket, args);
+                LOG_ERROR("accept: %s", strerror(errno));
             }
-            else if (strcasecmp(command, "DELE") == 0)
+            return;
+        }
+        // Replies are already batched per event; without this, a 226 queued behind an unacked
+        // 150 waits for the client's delayed ACK
+        int one = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        session_open(worker, client_socket, &client_addr);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        // Queued checksums run between batches, so only block when there are none, and wake
+        // every second while any session has a timeout pending
+        int timeout = worker->hash_jobs != NULL ? 0 : worker->timers.armed > 0 ? 1000 : -1;
+        int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR)
             {
-                handle_dele(session.client_socket, args);
+                continue;
             }
-            else if (strcasecmp(command, "SIZE") == 0)
+            LOG_ERROR("epoll_wait: %s", strerror(errno));
+            break;
+        }
+        timer_advance(&worker->timers, session_expire);
+
+        for (int i = 0; i < n; i++)
+        {
+            EventSource *ev = events[i].data.ptr;
+            if (ev->fd < 0 || (ev->session != NULL && ev->session->dead))
             {
-                handle_size(session.client_socket, args);
+                continue;
             }
-            else
+
+            switch (ev->kind)
             {
-                send_response(session.client_socket, "502 Command not implemented\r\n");
+            case EV_LISTEN:
+                accept_clients(worker);
+                break;
+            case EV_CONTROL:
+                on_control_event(ev->session, events[i].events);
+                break;
+            case EV_DATA:
+                on_data_event(ev->session, events[i].events);
+                session_service(ev->session);
+                break;
+            case EV_PASV:
+                on_pasv_event(ev->session);
+                session_service(ev->session);
+                break;
+            case EV_STREAM:
+                block_pump(ev->session, (DataStream *)ev, events[i].events);
+                session_service(ev->session);
+                break;
+            case EV_URING:
+                uring_reap(worker->uring, session_service);
+                break;
+            case EV_FILE_CACHE:
+                file_cache_sync(worker->file_cache);
+                break;
             }
         }
-        else
+
+        if (worker->hash_jobs != NULL)
+        {
+            hash_run(worker, session_service);
+        }
+
+        // Everything queued by this batch, for every session, goes to the kernel in one call
+        if (worker->uring != NULL)
         {
-            send_response(session.client_socket, "530 Not logged in\r\n");
+            uring_submit(worker->uring);
+        }
+
+        while (worker->graveyard != NULL)
+        {
+            ClientSession *dead = worker->graveyard;
+            worker->graveyard = dead->next_dead;
+            session_free(worker, dead);
         }
     }
 
-    close(session.client_socket);
+    return NULL;
 }
 
-void send_response(int client_socket, const char *response)
+static int open_listener(int port)
 {
-    send(client_socket, response, strlen(response), 0);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, LISTEN_BACKLOG) < 0)
+    {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
 }
 
-void handle_user(int client_socket, char *args)
+static int worker_init(Worker *worker, int id, int port)
+{
+    memset(worker, 0, sizeof(*worker));
+    worker->id = id;
+    timer_init(&worker->timers);
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    worker->listener = (EventSource){EV_LISTEN, open_listener(port), 0, 0, NULL};
+    if (worker->listener.fd < 0)
+    {
+        close(worker->epoll_fd);
+        return -1;
+    }
+    ev_set(worker, &worker->listener, EPOLLIN);
+    if (io_uring_enabled)
+    {
+        worker->uring = uring_create(worker);
+    }
+    if (file_cache_enabled)
+    {
+        worker->file_cache = file_cache_create(worker);
+    }
+    return 0;
+}
+
+void handle_user(ClientSession *session, char *args)
 {
     if (strcasecmp(args, "anonymous") == 0)
     {
-        send_response(client_socket, "331 Guest login ok, send your complete e-mail address as password.\r\n");
+        send_response(session, "331 Guest login ok, send your complete e-mail address as password.\r\n");
     }
     else
     {
-        send_response(client_socket, "530 Only anonymous login is supported\r\n");
+        send_response(session, "530 Only anonymous login is supported\r\n");
     }
 }
 
-void handle_pass(int client_socket, char *args)
+void handle_pass(ClientSession *session, char *args)
 {
-    send_response(client_socket, "230 Guest login ok, access restrictions apply.\r\n");
+    (void)args;
+    session->logged_in = 1;
+    send_response(session, "230 Guest login ok, access restrictions apply.\r\n");
 }
 
-void handle_quit(int client_socket)
+void handle_quit(ClientSession *session, char *args)
 {
-    send_response(client_socket, "221 Goodbye.\r\n");
+    (void)args;
+    send_response(session, "221 Goodbye.\r\n");
+    session->closing = 1;
 }
 
-void handle_retr(int client_socket, char *filename)
+// Gives back a descriptor from file_cache_open()
+static void release_file(int file_fd, struct FileCacheEntry *cached)
 {
-    char* filepath = get_absolute_path(filename);
-    if (filepath == NULL) {
-        send_response(client_socket, "550 Invalid file path\r\n");
-        return;
+    if (cached != NULL)
+    {
+        file_cache_release(cached);
     }
+    else
+    {
+        close(file_fd);
+    }
+}
 
-    int file_fd = open(filepath, O_RDONLY);
+void handle_retr(ClientSession *session, char *filename)
+{
+    off_t size;
+    struct FileCacheEntry *cached;
+    int file_fd = file_cache_open(session, filename, &size, &cached);
     if (file_fd < 0)
     {
-        send_response(client_socket, "550 File not found\r\n");
-        free(filepath);
+        send_response(session, "550 File not found\r\n");
         return;
     }
 
-    send_response(client_socket, "150 Opening binary mode data connection\r\n");
-
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    while ((bytes_read = read(file_fd, buffer, BUFFER_SIZE)) > 0)
+    const char *error = NULL;
+    if (session->restart_offset > size)
+    {
+        error = "554 Invalid REST parameter\r\n";
+    }
+    else if (!data_available(session))
     {
-        send(data_socket, buffer, bytes_read, 0);
+        error = "425 Use PORT or PASV first\r\n";
+    }
+    if (error != NULL)
+    {
+        release_file(file_fd, cached);
+        send_response(session, error);
+        return;
     }
 
-    close(file_fd);
-    close(data_socket);
-    send_response(client_socket, "226 Transfer complete\r\n");
-    free(filepath);
+    send_response(session, "150 Opening binary mode data connection\r\n");
+    session->xfer.cached = cached;
+    transfer_begin(session, XFER_RETR, file_fd, session->restart_offset);
 }
 
-void handle_stor(int client_socket, char *filename)
+// Shared by STOR and APPE. STOR after REST rewrites the file from the restart offset onwards,
+// keeping the bytes before it; APPE always continues at the current end of the file.
+static void store_file(ClientSession *session, char *filename, int append)
 {
-    printf("DEBUG: Attempting to store file: %s\n", filename);
-    
-    char* filepath = get_absolute_path(filename);
-    if (filepath == NULL) {
-        printf("DEBUG: get_absolute_path returned NULL\n");
-        send_response(client_socket, "550 Invalid file path\r\n");
+    off_t alloc_size = session->alloc_size;
+    session->alloc_size = 0;
+
+    if (!data_available(session))
+    {
+        send_response(session, "425 Use PORT or PASV first\r\n");
         return;
     }
-    
-    printf("DEBUG: Absolute filepath: %s\n", filepath);
 
-    // Create directories if they don't exist
-    char *dir_path = strdup(filepath);
-    char *dir_name = dirname(dir_path);
-    
-    printf("DEBUG: Directory path: %s\n", dir_name);
+    // No O_APPEND: splice() refuses append-mode files, so appends write at an explicit offset
+    ResolvedPath resolved;
+    int flags = O_WRONLY | O_CREAT | (append || session->restart_offset > 0 ? 0 : O_TRUNC);
+    int file_fd = path_open(session, filename, flags, 0666, &resolved);
+    if (file_fd < 0 && errno == ENOENT)
+    {
+        // Create missing parent directories; known ones are already in the worker's handle cache
+        if (path_make_parents(session->worker, resolved.vpath) == 0)
+        {
+            file_fd = path_open(session, filename, flags, 0666, &resolved);
+        }
+    }
+    if (file_fd < 0)
+    {
+        send_response(session, "550 Cannot create file\r\n");
+        return;
+    }
+    file_cache_forget(session->worker, resolved.vpath, 1);
 
-    char temp_path[PATH_MAX] = "";
-    char *token = strtok(dir_name, "/");
-    while (token != NULL) {
-        strcat(temp_path, "/");
-        strcat(temp_path, token);
-        printf("DEBUG: Creating directory: %s\n", temp_path);
-        if (mkdir(temp_path, 0777) != 0 && errno != EEXIST) {
-            printf("DEBUG: Failed to create directory: %s (errno: %d)\n", temp_path, errno);
-            send_response(client_socket, "550 Failed to create directory\r\n");
-            free(dir_path);
-            free(filepath);
+    off_t offset = session->restart_offset;
+    off_t file_size = 0;
+    if (append || offset > 0)
+    {
+        struct stat st;
+        if (fstat(file_fd, &st) != 0 || offset > st.st_size)
+        {
+            close(file_fd);
+            send_response(session, "554 Invalid REST parameter\r\n");
             return;
         }
-        token = strtok(NULL, "/");
+        file_size = st.st_size;
+        if (append)
+        {
+            offset = file_size;
+        }
     }
-    free(dir_path);
 
-    int file_fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (file_fd < 0)
+    // Reserve the blocks announced by ALLO up front so the file is laid out contiguously. Only
+    // done when writing at the end of the file, so trimming the unused tail never cuts old data.
+    if (offset != file_size)
+    {
+        alloc_size = 0;
+    }
+    if (alloc_size > 0 && fallocate(file_fd, 0, offset, alloc_size) != 0 && errno == ENOSPC)
+    {
+        close(file_fd);
+        if (!append && session->restart_offset == 0)
+        {
+            unlinkat(resolved.dir_fd, resolved.name, 0);
+        }
+        send_response(session, "452 Insufficient storage space\r\n");
+        return;
+    }
+
+    send_response(session, "150 Opening binary mode data connection\r\n");
+    transfer_begin(session, XFER_STOR, file_fd, offset);
+    session->xfer.preallocated = alloc_size > 0 ? offset + alloc_size : 0;
+}
+
+void handle_stor(ClientSession *session, char *filename)
+{
+    store_file(session, filename, 0);
+}
+
+void handle_appe(ClientSession *session, char *filename)
+{
+    store_file(session, filename, 1);
+}
+
+void handle_rest(ClientSession *session, char *args)
+{
+    char *end = NULL;
+    long long offset = strtoll(args, &end, 10);
+    if (end == args || *end != '\0' || offset < 0)
     {
-        printf("DEBUG: Failed to open file: %s (errno: %d)\n", filepath, errno);
-        send_response(client_socket, "550 Cannot create file\r\n");
-        free(filepath);
+        send_response(session, "501 Syntax error in parameters or arguments\r\n");
         return;
     }
 
-    send_response(client_socket, "150 Opening binary mode data connection\r\n");
+    session->restart_offset = offset;
+    send_responsef(session, "350 Restarting at %lld. Send STORE or RETRIEVE to initiate transfer\r\n", offset);
+}
 
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    while ((bytes_read = recv(data_socket, buffer, BUFFER_SIZE, 0)) > 0)
+void handle_allo(ClientSession *session, char *args)
+{
+    char *end = NULL;
+    long long size = strtoll(args, &end, 10);
+    if (end == args || size < 0)
+    {
+        send_response(session, "501 Syntax error in parameters or arguments\r\n");
+        return;
+    }
+
+    session->alloc_size = size;
+    send_response(session, "200 ALLO command successful\r\n");
+}
+
+// Adds up every worker's counters; they keep changing while we read, so the totals are only
+// consistent per value
+static void collect_metrics(Metrics *out)
+{
+    for (int i = 0; i < num_workers; i++)
+    {
+        metrics_merge(out, &workers[i].metrics);
+    }
+}
+
+static void site_stats(ClientSession *session)
+{
+    Metrics *snapshot = calloc(1, sizeof(Metrics));
+    if (snapshot == NULL)
+    {
+        send_response(session, "451 Requested action aborted: local error in processing\r\n");
+        return;
+    }
+    collect_metrics(snapshot);
+
+    send_responsef(session, "211-Server statistics\r\n Sessions: %llu active, %llu accepted\r\n",
+                   (unsigned long long)snapshot->sessions_active, (unsigned long long)snapshot->sessions_accepted);
+    send_responsef(session, " Admission: %llu refused at the session limit, %llu at the per-IP limit\r\n",
+                   (unsigned long long)snapshot->sessions_rejected, (unsigned long long)snapshot->sessions_rejected_ip);
+    send_responsef(session, " Timeouts: %llu idle sessions closed, %llu shed under load, %llu stalled transfers aborted\r\n",
+                   (unsigned long long)snapshot->sessions_timed_out, (unsigned long long)snapshot->sessions_shed,
+                   (unsigned long long)snapshot->transfers_stalled);
+    send_responsef(session, " Passive ports: %llu of %llu in use, %llu kernel-assigned\r\n",
+                   (unsigned long long)snapshot->pasv_in_use, (unsigned long long)snapshot->pasv_ports,
+                   (unsigned long long)snapshot->pasv_fallback);
+    send_responsef(session, " File cache: %llu entries, %llu evicted, %llu invalidated\r\n",
+                   (unsigned long long)snapshot->file_cache_entries, (unsigned long long)snapshot->file_cache_evictions,
+                   (unsigned long long)snapshot->file_cache_invalidations);
+    send_responsef(session, " File cache lookups: RETR %llu hits, %llu misses; LIST/MLSD %llu hits, %llu misses\r\n",
+                   (unsigned long long)snapshot->file_cache_hits, (unsigned long long)snapshot->file_cache_misses,
+                   (unsigned long long)snapshot->listing_cache_hits, (unsigned long long)snapshot->listing_cache_misses);
+
+    static const char *const transfer_names[METRIC_XFER_KINDS] = {"RETR", "STOR", "LIST"};
+    send_response(session, " Transfer        ok   failed          bytes    p50 ms    p99 ms    max ms\r\n");
+    for (int i = 0; i < METRIC_XFER_KINDS; i++)
+    {
+        const TransferMetrics *t = &snapshot->transfers[i];
+        send_responsef(session, " %-8s %9llu %8llu %14llu %9.3f %9.3f %9.3f\r\n", transfer_names[i],
+                       (unsigned long long)t->completed, (unsigned long long)t->failed, (unsigned long long)t->bytes,
+                       histogram_percentile(&t->duration_ns, 0.5) / 1e6, histogram_percentile(&t->duration_ns, 0.99) / 1e6,
+                       t->duration_ns.max / 1e6);
+    }
+
+    send_response(session, " Command      calls   errors    p50 us    p90 us    p99 us    max us\r\n");
+    for (int i = 0; i < CMD_COUNT; i++)
+    {
+        const CommandMetrics *c = &snapshot->commands[i];
+        if (c->calls == 0 && c->errors == 0)
+        {
+            continue;
+        }
+        send_responsef(session, " %-8s %9llu %8llu %9.1f %9.1f %9.1f %9.1f\r\n", command_name(i),
+                       (unsigned long long)c->calls, (unsigned long long)c->errors,
+                       histogram_percentile(&c->latency_ns, 0.5) / 1e3, histogram_percentile(&c->latency_ns, 0.9) / 1e3,
+                       histogram_percentile(&c->latency_ns, 0.99) / 1e3, c->latency_ns.max / 1e3);
+    }
+    send_response(session, "211 End\r\n");
+    free(snapshot);
+}
+
+void handle_site(ClientSession *session, char *args)
+{
+    if (strcasecmp(args, "STATS") == 0)
+    {
+        site_stats(session);
+    }
+    else
     {
-        write(file_fd, buffer, bytes_read);
+        send_response(session, "504 Command not implemented for that parameter\r\n");
     }
-
-    close(file_fd);
-    close(data_socket);
-    send_response(client_socket, "226 Transfer complete\r\n");
-    free(filepath);
 }
 
-void handle_port(int client_socket, char *args)
+void handle_port(ClientSession *session, char *args)
 {
     int h1, h2, h3, h4, p1, p2;
-    sscanf(args, "%d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2);
+    if (sscanf(args, "%d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2) != 6)
+    {
+        send_response(session, "501 Syntax error in parameters or arguments\r\n");
+        return;
+    }
     int port = p1 * 256 + p2;
     char ip[16];
     snprintf(ip, sizeof(ip), "%d.%d.%d.%d", h1, h2, h3, h4);
 
-    data_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (data_socket < 0)
+    data_reset(session);
+    session->data.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (session->data.fd < 0)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
+        send_response(session, "425 Can't open data connection\r\n");
         return;
     }
 
+    struct sockaddr_in data_addr;
     memset(&data_addr, 0, sizeof(data_addr));
     data_addr.sin_family = AF_INET;
     data_addr.sin_port = htons(port);
     inet_pton(AF_INET, ip, &data_addr.sin_addr);
 
-    if (connect(data_socket, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0)
+    if (connect(session->data.fd, (struct sockaddr *)&data_addr, sizeof(data_addr)) == 0)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
-        close(data_socket);
+        ev_set(session->worker, &session->data, 0);
+        send_response(session, "200 PORT command successful\r\n");
+        return;
+    }
+    if (errno != EINPROGRESS)
+    {
+        send_response(session, "425 Can't open data connection\r\n");
+        ev_close(session->worker, &session->data);
         return;
     }
 
-    send_response(client_socket, "200 PORT command successful\r\n");
+    // The 200 reply is sent once the connect completes
+    session->data_connecting = 1;
+    ev_set(session->worker, &session->data, EPOLLOUT);
+    session_update_events(session);
 }
 
-void handle_pasv(int client_socket)
+void handle_pasv(ClientSession *session, char *args)
 {
-    int port = 20000 + rand() % 45536;
+    (void)args;
+    data_reset(session);
+    int port = pasv_acquire(session);
+    if (port < 0)
+    {
+        send_response(session, "425 Can't open data connection\r\n");
+        return;
+    }
     int p1 = port / 256;
     int p2 = port % 256;
 
-    // Assuming the server's IP address is 127.0.0.1
-    char ip[16] = "127.0.0.1";
-    int h1, h2, h3, h4;
-    sscanf(ip, "%d.%d.%d.%d", &h1, &h2, &h3, &h4);
+    // Advertise -pasv-address, or else the address the client used to reach the control connection
+    uint32_t ip = ntohl(pasv_address.s_addr != INADDR_ANY ? pasv_address.s_addr : session->local_addr.sin_addr.s_addr);
+    int h1 = (ip >> 24) & 0xff, h2 = (ip >> 16) & 0xff, h3 = (ip >> 8) & 0xff, h4 = ip & 0xff;
 
-    char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response), "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\r\n", h1, h2, h3, h4, p1, p2);
-    send_response(client_socket, response);
+    send_responsef(session, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\r\n", h1, h2, h3, h4, p1, p2);
+}
 
-    data_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (data_socket < 0)
+void handle_type(ClientSession *session, char *args)
+{
+    if (strcasecmp(args, "I") == 0)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
-        return;
+        send_response(session, "200 Type set to I.\r\n");
     }
-
-    memset(&data_addr, 0, sizeof(data_addr));
-    data_addr.sin_family = AF_INET;
-    data_addr.sin_addr.s_addr = INADDR_ANY;
-    data_addr.sin_port = htons(port);
-
-    if (bind(data_socket, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0)
+    else
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
-        close(data_socket);
-        return;
+        send_response(session, "504 Command not implemented for that parameter\r\n");
     }
+}
 
-    if (listen(data_socket, 1) < 0)
+// Opens target for LIST/MLSD; a plain file is listed as its single entry
+static DirLister *open_listing(ClientSession *session, const char *target, ListFormat format, int show_hidden)
+{
+    ResolvedPath resolved;
+    int dir_fd = path_open(session, target, O_RDONLY | O_DIRECTORY, 0, &resolved);
+    if (dir_fd >= 0)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
-        close(data_socket);
-        return;
+        return lister_open(dir_fd, NULL, format, show_hidden);
+    }
+    if (errno != ENOTDIR)
+    {
+        return NULL;
     }
 
-    struct sockaddr_in client_data_addr;
-    socklen_t client_data_addr_len = sizeof(client_data_addr);
-    data_socket = accept(data_socket, (struct sockaddr *)&client_data_addr, &client_data_addr_len);
-    if (data_socket < 0)
+    struct stat st;
+    if (fstatat(resolved.dir_fd, resolved.name, &st, AT_SYMLINK_NOFOLLOW) != 0)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
-        close(data_socket);
-        return;
+        return NULL;
+    }
+    int parent_fd = fcntl(resolved.dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (parent_fd < 0)
+    {
+        return NULL;
     }
+    return lister_open(parent_fd, resolved.name, format, show_hidden);
 }
 
-void handle_type(int client_socket, char *args)
+void handle_mode(ClientSession *session, char *args)
 {
-    if (strcasecmp(args, "I") == 0)
+    DataMode mode;
+    if (strcasecmp(args, "S") == 0)
+    {
+        mode = DATA_MODE_STREAM;
+    }
+    else if (strcasecmp(args, "E") == 0)
+    {
+        mode = DATA_MODE_BLOCK;
+    }
+    else if (strcasecmp(args, "Z") == 0)
     {
-        send_response(client_socket, "200 Type set to I.\r\n");
+        mode = DATA_MODE_DEFLATE;
     }
     else
     {
-        send_response(client_socket, "504 Command not implemented for that parameter\r\n");
+        send_response(session, "504 Command not implemented for that parameter\r\n");
+        return;
     }
+
+    data_reset(session);
+    session->mode = mode;
+    send_responsef(session, "200 Mode set to %c.\r\n", toupper((unsigned char)args[0]));
 }
 
-void handle_list(int client_socket, char *args)
+// OPTS RETR Parallelism=<n>[,<min>,<max>]; sets how many data connections MODE E transfers use
+static void opts_parallelism(ClientSession *session, const char *value)
 {
-    send_response(client_socket, "150 Opening ASCII mode data connection for file list\r\n");
-
-    FILE *ls = popen("ls -l", "r");
-    char buffer[BUFFER_SIZE];
-    
-    // Skip the first line (total)
-    if (fgets(buffer, sizeof(buffer), ls) != NULL) {
-        // First line read and discarded
+    int parallelism;
+    if (sscanf(value, "Parallelism=%d", &parallelism) != 1)
+    {
+        send_response(session, "501 Option not understood\r\n");
+        return;
     }
-    
-    // Send the rest of the lines
-    while (fgets(buffer, sizeof(buffer), ls) != NULL)
+    if (parallelism < 1 || parallelism > MAX_STREAMS)
     {
-        send(data_socket, buffer, strlen(buffer), 0);
+        send_response(session, "501 Parallelism out of range\r\n");
+        return;
     }
-    pclose(ls);
 
-    close(data_socket);
-    send_response(client_socket, "226 Transfer complete\r\n");
+    session->parallelism = parallelism;
+    send_responsef(session, "200 Parallel streams set to %d.\r\n", parallelism);
 }
 
-void handle_mkd(int client_socket, char *dirname)
+// OPTS MODE Z LEVEL <n> | ENGINE <deflate|zstd>
+static void opts_mode_z(ClientSession *session, const char *value)
 {
-    if (mkdir(dirname, 0777) == 0)
+    char name[16];
+    char arg[16];
+    if (sscanf(value, "%15s %15s", name, arg) != 2)
+    {
+        send_response(session, "501 Option not understood\r\n");
+        return;
+    }
+
+    if (strcasecmp(name, "ENGINE") == 0)
+    {
+        CodecKind kind;
+        if (strcasecmp(arg, "deflate") == 0)
+        {
+            kind = CODEC_DEFLATE;
+        }
+        else if (strcasecmp(arg, "zstd") == 0 && codec_available(CODEC_ZSTD))
+        {
+            kind = CODEC_ZSTD;
+        }
+        else
+        {
+            send_response(session, "501 Unsupported compression engine\r\n");
+            return;
+        }
+        if ((int)kind != session->codec_kind)
+        {
+            // The level scale differs between engines
+            session->codec_kind = kind;
+            session->codec_level = 0;
+        }
+        send_response(session, "200 MODE Z ENGINE set.\r\n");
+    }
+    else if (strcasecmp(name, "LEVEL") == 0)
     {
-        send_response(client_socket, "257 Directory created\r\n");
+        char *end = NULL;
+        long level = strtol(arg, &end, 10);
+        if (*end != '\0' || level < 1 || level > codec_max_level(session->codec_kind))
+        {
+            send_response(session, "501 Compression level out of range\r\n");
+            return;
+        }
+        session->codec_level = (int)level;
+        send_response(session, "200 MODE Z LEVEL set.\r\n");
     }
     else
     {
-        send_response(client_socket, "550 Failed to create directory\r\n");
+        send_response(session, "501 Option not understood\r\n");
     }
 }
 
-void handle_cwd(int client_socket, char *dirname)
+// OPTS HASH [algorithm]; with no argument, reports the current one
+static void opts_hash(ClientSession *session, const char *value)
 {
-    char new_path[PATH_MAX];
-    char real_root[PATH_MAX];
-    char real_new_path[PATH_MAX];
-
-    // Resolve the root directory path
-    if (realpath(root_dir, real_root) == NULL)
+    while (*value == ' ')
     {
-        send_response(client_socket, "550 Failed to resolve root directory\r\n");
-        return;
+        value++;
+    }
+    if (*value != '\0')
+    {
+        int algo = digest_lookup(value);
+        if (algo < 0)
+        {
+            send_response(session, "504 Unknown algorithm\r\n");
+            return;
+        }
+        session->hash_algo = algo;
     }
+    send_responsef(session, "200 %s\r\n", digest_name(session->hash_algo));
+}
 
-    // Construct the new path
-    if (dirname[0] == '/')
+void handle_opts(ClientSession *session, char *args)
+{
+    if (strncasecmp(args, "RETR ", 5) == 0)
+    {
+        opts_parallelism(session, args + 5);
+    }
+    else if (strncasecmp(args, "MODE Z ", 7) == 0)
+    {
+        opts_mode_z(session, args + 7);
+    }
+    else if (strncasecmp(args, "HASH", 4) == 0 && (args[4] == '\0' || args[4] == ' '))
     {
-        // Absolute path
-        snprintf(new_path, sizeof(new_path), "%s%s", root_dir, dirname);
+        opts_hash(session, args + 4);
     }
     else
     {
-        // Relative path
-        char current_dir[PATH_MAX];
-        if (getcwd(current_dir, sizeof(current_dir)) == NULL)
+        send_response(session, "501 Option not understood\r\n");
+    }
+}
+
+// Starts LIST or MLSD of target. In MODE S a directory's listing comes from the worker's
+// cache, or is formatted up front and cached when it fits in a single batch; anything else
+// streams from the lister as it is sent.
+static void send_listing(ClientSession *session, const char *target, ListFormat format, int show_hidden)
+{
+    const char *opening = format == LIST_FORMAT_MLSD ? "150 Opening ASCII mode data connection for MLSD\r\n"
+                                                     : "150 Opening ASCII mode data connection for file list\r\n";
+    char vdir[PATH_MAX];
+    FileCachePending pending = {.watch = -1};
+    if (session->mode == DATA_MODE_STREAM && path_normalize(session->cwd, target, vdir, sizeof(vdir)) == 0)
+    {
+        struct FileCacheEntry *cached = file_cache_listing(session, vdir, format, show_hidden, &pending);
+        if (cached != NULL)
         {
-            send_response(client_socket, "550 Failed to get current directory\r\n");
+            send_response(session, opening);
+            session->xfer.cached = cached;
+            transfer_begin(session, XFER_LIST, -1, 0);
             return;
         }
-        snprintf(new_path, sizeof(new_path), "%s/%s", current_dir, dirname);
     }
 
-    // Resolve the new path
-    if (realpath(new_path, real_new_path) == NULL)
+    DirLister *lister = open_listing(session, target, format, show_hidden);
+    if (lister == NULL)
     {
-        send_response(client_socket, "550 Failed to resolve path\r\n");
+        file_cache_cancel(session->worker, &pending);
+        send_response(session, "550 No such file or directory\r\n");
         return;
     }
-
-    // Check if the new path is within the root directory
-    if (strncmp(real_new_path, real_root, strlen(real_root)) != 0)
+    if (format == LIST_FORMAT_MLSD && lister->single_name != NULL)
     {
-        send_response(client_socket, "550 Access denied\r\n");
+        file_cache_cancel(session->worker, &pending);
+        lister_close(lister);
+        send_response(session, "501 Not a directory\r\n");
         return;
     }
 
-    // Change to the new directory
-    if (chdir(real_new_path) == 0)
+    struct FileCacheEntry *cached = NULL;
+    char *body = NULL;
+    size_t len = 0;
+    if (pending.watch >= 0 && lister->single_name == NULL && (body = malloc(LIST_BUFFER_SIZE)) != NULL)
+    {
+        len = lister_fill(lister, body, LIST_BUFFER_SIZE);
+        if (lister->done)
+        {
+            cached = file_cache_put_listing(session->worker, &pending, vdir, format, show_hidden, body, len);
+        }
+    }
+    file_cache_cancel(session->worker, &pending);
+
+    send_response(session, opening);
+    if (cached != NULL)
     {
-        send_response(client_socket, "250 Directory successfully changed\r\n");
+        lister_close(lister);
+        session->xfer.cached = cached;
     }
     else
     {
-        send_response(client_socket, "550 Failed to change directory\r\n");
+        // The batch already formatted goes out first, then the lister carries on
+        session->xfer.lister = lister;
+        session->xfer.buffer = body;
+        session->xfer.buf_cap = body != NULL ? LIST_BUFFER_SIZE : 0;
+        session->xfer.buf_len = len;
     }
+    transfer_begin(session, XFER_LIST, -1, 0);
 }
 
-void handle_pwd(int client_socket)
+void handle_list(ClientSession *session, char *args)
 {
-    char cwd[BUFFER_SIZE];
-    if (getcwd(cwd, sizeof(cwd)) != NULL)
+    if (!data_available(session))
     {
-        char relative_path[BUFFER_SIZE];
-        if (strncmp(cwd, root_dir, strlen(root_dir)) == 0)
+        send_response(session, "425 Use PORT or PASV first\r\n");
+        return;
+    }
+
+    // Accept the ls-style options many clients send ("LIST -la path")
+    int show_hidden = 0;
+    while (*args == '-')
+    {
+        for (args++; *args != '\0' && *args != ' '; args++)
         {
-            // The current working directory is within or equal to root_dir
-            const char *rel = cwd + strlen(root_dir);
-            snprintf(relative_path, sizeof(relative_path), "%s%s", 
-                     (*rel == '\0' || *rel == '/') ? "/" : "/", 
-                     (*rel == '/') ? rel + 1 : rel);
+            if (*args == 'a')
+            {
+                show_hidden = 1;
+            }
         }
-        else
+        while (*args == ' ')
         {
-            // The current working directory is outside root_dir
-            strcpy(relative_path, cwd);
+            args++;
         }
-        
-        char response[BUFFER_SIZE];
-        snprintf(response, sizeof(response), "257 \"%s\" is the current directory.\r\n", relative_path);
-        send_response(client_socket, response);
+    }
+
+    send_listing(session, *args != '\0' ? args : ".", LIST_FORMAT_LS, show_hidden);
+}
+
+void handle_mlsd(ClientSession *session, char *args)
+{
+    if (!data_available(session))
+    {
+        send_response(session, "425 Use PORT or PASV first\r\n");
+        return;
+    }
+
+    send_listing(session, *args != '\0' ? args : ".", LIST_FORMAT_MLSD, 1);
+}
+
+void handle_mlst(ClientSession *session, char *args)
+{
+    const char *name = *args != '\0' ? args : session->cwd;
+    ResolvedPath resolved;
+    struct stat st;
+    size_t len = 0;
+    char *facts = arena_alloc(&session->arena, LIST_LINE_MAX);
+    if (facts != NULL && path_stat(session, *args != '\0' ? args : ".", &st, &resolved) == 0)
+    {
+        len = list_format_stat(&st, name, facts, LIST_LINE_MAX);
+    }
+    if (len == 0)
+    {
+        send_response(session, "550 No such file or directory\r\n");
+        return;
+    }
+
+    send_responsef(session, "250-Listing %s\r\n %s250 End\r\n", name, facts);
+}
+
+void handle_feat(ClientSession *session, char *args)
+{
+    (void)args;
+    // The session's HASH algorithm is starred
+    char algorithms[64];
+    size_t len = 0;
+    for (int i = 0; i < DIGEST_COUNT; i++)
+    {
+        len += snprintf(algorithms + len, sizeof(algorithms) - len, "%s%s%s", i > 0 ? ";" : "", digest_name(i),
+                        i == session->hash_algo ? "*" : "");
+    }
+    send_responsef(session,
+                   "211-Features:\r\n"
+                   " MLST type*;size*;modify*;perm*;\r\n"
+                   " SIZE\r\n"
+                   " REST STREAM\r\n"
+                   " PARALLEL\r\n"
+                   " MODE Z\r\n"
+                   " HASH %s\r\n"
+                   " RANG STREAM\r\n"
+                   " XCRC\r\n"
+                   " XMD5\r\n"
+                   " XSHA256\r\n"
+                   " EPSV\r\n"
+                   " PASV\r\n"
+                   "211 End\r\n",
+                   algorithms);
+}
+
+void handle_mkd(ClientSession *session, char *dirname)
+{
+    ResolvedPath resolved;
+    if (path_mkdir(session, dirname, &resolved) == 0)
+    {
+        file_cache_forget(session->worker, resolved.vpath, 1);
+        send_response(session, "257 Directory created\r\n");
     }
     else
     {
-        send_response(client_socket, "550 Failed to get current directory\r\n");
+        send_response(session, "550 Failed to create directory\r\n");
     }
 }
 
-void handle_rmd(int client_socket, char *dirname)
+void handle_cwd(ClientSession *session, char *dirname)
 {
-    if (rmdir(dirname) == 0)
+    if (path_chdir(session, dirname) == 0)
     {
-        send_response(client_socket, "250 Directory successfully removed\r\n");
+        send_response(session, "250 Directory successfully changed\r\n");
     }
     else
     {
-        send_response(client_socket, "550 Failed to remove directory\r\n");
+        send_response(session, "550 Failed to change directory\r\n");
     }
 }
 
-void handle_syst(int client_socket)
+void handle_pwd(ClientSession *session, char *args)
 {
-    send_response(client_socket, "215 UNIX Type: L8\r\n");
+    (void)args;
+    send_responsef(session, "257 \"%s\" is the current directory.\r\n", session->cwd);
 }
 
-void handle_abor(int client_socket)
+void handle_rmd(ClientSession *session, char *dirname)
 {
-    send_response(client_socket, "226 Abort successful\r\n");
+    ResolvedPath resolved;
+    if (path_rmdir(session, dirname, &resolved) == 0)
+    {
+        file_cache_forget(session->worker, resolved.vpath, 1);
+        send_response(session, "250 Directory successfully removed\r\n");
+    }
+    else
+    {
+        send_response(session, "550 Failed to remove directory\r\n");
+    }
 }
 
-void handle_epsv(int client_socket)
+void handle_syst(ClientSession *session, char *args)
 {
-    int port = 20000 + rand() % 45536; // Random port selection
+    (void)args;
+    send_response(session, "215 UNIX Type: L8\r\n");
+}
 
-    // Respond with the EPSV format, which does not include the IP address
-    char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response), "229 Entering Extended Passive Mode (|||%d|)\r\n", port);
-    send_response(client_socket, response);
+void handle_abor(ClientSession *session, char *args)
+{
+    (void)args;
+    if (session->xfer.kind != XFER_NONE)
+    {
+        transfer_finish(session, "426 Connection closed; transfer aborted\r\n");
+    }
+    if (session->hash != NULL)
+    {
+        hash_cancel(session);
+        send_response(session, "426 Checksum aborted\r\n");
+    }
+    data_reset(session);
+    send_response(session, "226 Abort successful\r\n");
+}
 
-    data_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (data_socket < 0)
+void handle_epsv(ClientSession *session, char *args)
+{
+    (void)args;
+    data_reset(session);
+    int port = pasv_acquire(session);
+    if (port < 0)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
+        send_response(session, "425 Can't open data connection\r\n");
         return;
     }
 
-    memset(&data_addr, 0, sizeof(data_addr));
-    data_addr.sin_family = AF_INET;
-    data_addr.sin_addr.s_addr = INADDR_ANY;
-    data_addr.sin_port = htons(port);
+    // Respond with the EPSV format, which does not include the IP address
+    send_responsef(session, "229 Entering Extended Passive Mode (|||%d|)\r\n", port);
+}
 
-    if (bind(data_socket, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0)
+void handle_dele(ClientSession *session, char *filename)
+{
+    ResolvedPath resolved;
+    if (path_unlink(session, filename, &resolved) == 0)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
-        close(data_socket);
-        return;
+        file_cache_forget(session->worker, resolved.vpath, 1);
+        send_response(session, "250 File deleted successfully\r\n");
+    }
+    else
+    {
+        send_response(session, "550 Failed to delete file\r\n");
+    }
+}
+
+void handle_size(ClientSession *session, char *filename)
+{
+    ResolvedPath resolved;
+    struct stat file_stat;
+    if (path_stat(session, filename, &file_stat, &resolved) == 0) {
+        send_responsef(session, "213 %lld\r\n", (long long)file_stat.st_size);
+    } else {
+        send_response(session, "550 Could not get file size\r\n");
     }
+}
 
-    if (listen(data_socket, 1) < 0)
+// Opens name and queues a checksum of bytes [start, end); end < 0 means the end of the file
+static void start_hash(ClientSession *session, const char *name, DigestAlgo algo, off_t start, off_t end, HashReply reply)
+{
+    off_t size;
+    struct FileCacheEntry *cached;
+    int file_fd = file_cache_open(session, name, &size, &cached);
+    if (file_fd < 0)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
-        close(data_socket);
+        send_response(session, "550 File not found\r\n");
         return;
     }
-
-    struct sockaddr_in client_data_addr;
-    socklen_t client_data_addr_len = sizeof(client_data_addr);
-    data_socket = accept(data_socket, (struct sockaddr *)&client_data_addr, &client_data_addr_len);
-    if (data_socket < 0)
+    if (end < 0 || end > size)
+    {
+        end = size;
+    }
+    if (start > end)
     {
-        send_response(client_socket, "425 Can't open data connection\r\n");
-        close(data_socket);
+        release_file(file_fd, cached);
+        send_response(session, "501 Invalid byte range\r\n");
         return;
     }
+    if (hash_start(session, file_fd, cached, algo, start, end, name, reply) < 0)
+    {
+        release_file(file_fd, cached);
+        send_response(session, "451 Requested action aborted: local error in processing\r\n");
+    }
+}
+
+// HASH <path>, over the range set by a RANG just before it if there was one
+void handle_hash(ClientSession *session, char *filename)
+{
+    start_hash(session, filename, session->hash_algo, session->range_start, session->range_end > 0 ? session->range_end : -1,
+               HASH_REPLY_HASH);
 }
 
-void handle_dele(int client_socket, char *filename)
+// RANG <start> <end> limits the next HASH to bytes start through end inclusive; RANG 1 0 clears it
+void handle_rang(ClientSession *session, char *args)
 {
-    if (strstr(filename, "../") != NULL)
+    long long start;
+    long long end;
+    int used = 0;
+    if (sscanf(args, "%lld %lld%n", &start, &end, &used) != 2 || args[used] != '\0')
     {
-        send_response(client_socket, "550 Invalid file path\r\n");
+        send_response(session, "501 Syntax error in parameters or arguments\r\n");
         return;
     }
-    char filepath[BUFFER_SIZE];
-    snprintf(filepath, sizeof(filepath), "%s/%s", root_dir, filename);
-
-    if (remove(filepath) == 0)
+    if (start == 1 && end == 0)
     {
-        send_response(client_socket, "250 File deleted successfully\r\n");
+        session->range_start = 0;
+        session->range_end = 0;
+        send_response(session, "350 Restarting at 0. Ending byte at EOF.\r\n");
+        return;
     }
-    else
+    if (start < 0 || end < start || end == LLONG_MAX)
     {
-        send_response(client_socket, "550 Failed to delete file\r\n");
+        send_response(session, "501 Invalid byte range\r\n");
+        return;
     }
+    // Kept exclusive, as start_hash takes it; start_hash clamps it to the file size
+    session->range_start = start;
+    session->range_end = end + 1;
+    send_responsef(session, "350 Restarting at %lld. Ending byte at %lld.\r\n", start, end);
 }
 
-void handle_size(int client_socket, char *filename)
+// Reads an optional offset after spaces; returns 0 on a malformed one
+static int parse_offset(char **p, long long *out)
 {
-    char* filepath = get_absolute_path(filename);
-    if (filepath == NULL) {
-        send_response(client_socket, "550 Invalid file path\r\n");
-        return;
+    while (**p == ' ')
+    {
+        (*p)++;
+    }
+    if (**p == '\0')
+    {
+        return 1;
+    }
+    char *end;
+    errno = 0;
+    *out = strtoll(*p, &end, 10);
+    if (end == *p || errno != 0 || *out < 0 || (*end != ' ' && *end != '\0'))
+    {
+        return 0;
     }
+    *p = end;
+    return 1;
+}
 
-    struct stat file_stat;
-    if (stat(filepath, &file_stat) == 0) {
-        char response[BUFFER_SIZE];
-        snprintf(response, sizeof(response), "213 %lld\r\n", (long long)file_stat.st_size);
-        send_response(client_socket, response);
-    } else {
-        send_response(client_socket, "550 Could not get file size\r\n");
+// XCRC, XMD5 and XSHA256 take "<path>" [start [end]], or a bare path that may contain spaces
+static void x_checksum(ClientSession *session, char *args, DigestAlgo algo)
+{
+    char *name = args;
+    long long start = 0;
+    long long end = -1;
+    if (*args == '"')
+    {
+        char *rest = strchr(args + 1, '"');
+        if (rest == NULL)
+        {
+            send_response(session, "501 Syntax error in parameters or arguments\r\n");
+            return;
+        }
+        *rest++ = '\0';
+        name = args + 1;
+        if (!parse_offset(&rest, &start) || !parse_offset(&rest, &end) || *rest != '\0' || (end >= 0 && end < start))
+        {
+            send_response(session, "501 Syntax error in parameters or arguments\r\n");
+            return;
+        }
     }
+    start_hash(session, name, algo, start, end, HASH_REPLY_X);
+}
+
+void handle_xcrc(ClientSession *session, char *args)
+{
+    x_checksum(session, args, DIGEST_CRC32);
+}
+
+void handle_xmd5(ClientSession *session, char *args)
+{
+    x_checksum(session, args, DIGEST_MD5);
+}
 
-    free(filepath);
+void handle_xsha256(ClientSession *session, char *args)
+{
+    x_checksum(session, args, DIGEST_SHA256);
 }
 
 void make_absolute_path(char *path, char *absolute_path)
 {
-    
+
     if (realpath(path, absolute_path) != NULL)
     {
         return;
@@ -632,12 +1801,23 @@ void make_absolute_path(char *path, char *absolute_path)
     }
 }
 
+// Every session holds a control socket and possibly a data socket and a passive listener
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
     int port = PORT;
+    int metrics_port = DEFAULT_METRICS_PORT;
+    LogFormat log_format = LOG_FORMAT_KV;
+    int max_per_ip = 0;
 
     // Parse command line arguments
     for (int i = 1; i < argc; i++)
@@ -650,13 +1830,95 @@ int main(int argc, char *argv[])
         {
             root_dir = argv[++i];
         }
+        else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+        {
+            num_workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-pasv-ports") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%d-%d", &pasv_port_min, &pasv_port_max) != 2 ||
+                pasv_port_min < 1 || pasv_port_max > 65535 || pasv_port_min > pasv_port_max)
+            {
+                fprintf(stderr, "Invalid -pasv-ports range, expected MIN-MAX\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-pasv-address") == 0 && i + 1 < argc)
+        {
+            if (inet_pton(AF_INET, argv[++i], &pasv_address) != 1)
+            {
+                fprintf(stderr, "Invalid -pasv-address, expected an IPv4 address\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-pasv-ephemeral") == 0)
+        {
+            pasv_ephemeral = 1;
+        }
+        else if (strcmp(argv[i], "-no-zero-copy") == 0)
+        {
+            zero_copy_enabled = 0;
+        }
+        else if (strcmp(argv[i], "-no-file-cache") == 0)
+        {
+            file_cache_enabled = 0;
+        }
+        else if (strcmp(argv[i], "-io-uring") == 0)
+        {
+            io_uring_enabled = 1;
+        }
+        else if (strcmp(argv[i], "-stor-buffer") == 0 && i + 1 < argc)
+        {
+            long size = atol(argv[++i]);
+            stor_buffer_size = size < BUFFER_SIZE ? BUFFER_SIZE : (size_t)size;
+        }
+        else if (strcmp(argv[i], "-metrics-port") == 0 && i + 1 < argc)
+        {
+            metrics_port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-log-format") == 0 && i + 1 < argc)
+        {
+            log_format = strcmp(argv[++i], "json") == 0 ? LOG_FORMAT_JSON : LOG_FORMAT_KV;
+        }
+        else if (strcmp(argv[i], "-max-sessions") == 0 && i + 1 < argc)
+        {
+            max_sessions = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-max-per-ip") == 0 && i + 1 < argc)
+        {
+            max_per_ip = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-idle-timeout") == 0 && i + 1 < argc)
+        {
+            idle_timeout = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-data-timeout") == 0 && i + 1 < argc)
+        {
+            data_timeout = atoi(argv[++i]);
+        }
     }
 
     if (root_dir == NULL)
     {
         root_dir = DEFAULT_ROOT_DIR;
     }
-    printf("Root directory: %s\n", root_dir);
+    if (num_workers <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cpus > 0 ? (int)cpus : 1;
+    }
+    if (log_init(STDOUT_FILENO, log_format) != 0)
+    {
+        perror("log_init");
+        exit(EXIT_FAILURE);
+    }
+    LOG_INFO("Root directory: %s", root_dir);
+    max_sessions = max_sessions > 0 ? max_sessions : 0;
+    idle_timeout = idle_timeout > 0 ? idle_timeout : 0;
+    data_timeout = data_timeout > 0 ? data_timeout : 0;
+    admission_init(max_sessions, max_per_ip);
+    LOG_INFO("Limits: %d sessions, %d per IP (0 is unlimited); timeouts: %ds idle, %ds data stall (0 is off)",
+             max_sessions, max_per_ip > 0 ? max_per_ip : 0, idle_timeout, data_timeout);
     char absolute_path[PATH_MAX];
 
     make_absolute_path(root_dir, absolute_path);
@@ -666,45 +1928,69 @@ int main(int argc, char *argv[])
         perror("chdir");
         exit(EXIT_FAILURE);
     }
-    printf("Starting server...\n");
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0)
+    if (path_init(root_dir) != 0)
     {
-        perror("socket");
+        perror("open root");
         exit(EXIT_FAILURE);
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    digest_setup();
+    LOG_INFO("Checksums: SHA-256 %s, CRC32C %s", digest_kernel(DIGEST_SHA256), digest_kernel(DIGEST_CRC32C));
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    LOG_INFO("Starting server...");
+    workers = calloc(num_workers, sizeof(Worker));
+    if (workers == NULL)
     {
-        perror("bind");
-        close(server_socket);
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
+    int pasv_span = pasv_port_max - pasv_port_min + 1;
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (worker_init(&workers[i], i, port) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        // Give every worker its own slice of the passive range so the pool needs no locking
+        int first = pasv_port_min + (int)((long)pasv_span * i / num_workers);
+        int last = pasv_port_min + (int)((long)pasv_span * (i + 1) / num_workers) - 1;
+        if (pasv_pool_init(&workers[i].pasv_pool, first, last) < 0)
+        {
+            perror("pasv_pool_init");
+            exit(EXIT_FAILURE);
+        }
+        workers[i].metrics.pasv_ports = workers[i].pasv_pool.size;
+    }
 
-    if (listen(server_socket, MAX_CLIENTS) < 0)
+    if (metrics_port > 0)
     {
-        perror("listen");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+        if (metrics_serve(metrics_port, collect_metrics) < 0)
+        {
+            perror("metrics endpoint");
+            exit(EXIT_FAILURE);
+        }
+        LOG_INFO("Metrics available at http://127.0.0.1:%d/metrics", metrics_port);
     }
 
-    printf("FTP server listening on port %d\n", port);
+    LOG_INFO("FTP server listening on port %d with %d workers", port, num_workers);
 
-    while ((client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len)) >= 0)
+    for (int i = 1; i < num_workers; i++)
     {
-        if (fork() == 0)
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
         {
-            close(server_socket);
-            handle_client(client_socket);
-            exit(EXIT_SUCCESS);
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
         }
-        close(client_socket);
     }
+    worker_main(&workers[0]);
 
-    close(server_socket);
+    for (int i = 1; i < num_workers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,34 +1,266 @@
 #ifndef FTP_SERVER_H
 #define FTP_SERVER_H
 
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "ftp_control.h"
+#include "ftp_metrics.h"
+#include "ftp_arena.h"
+#include "ftp_timer.h"
+
 #define PORT 21
 #define BUFFER_SIZE 4096
-#define MAX_CLIENTS 10
+#define LISTEN_BACKLOG 4096
+#define MAX_EVENTS 256
+#define ACCEPT_BURST 64
+#define TRANSFER_BURST 16
+#define DIR_HANDLE_SLOTS 1024
+#define MAX_STREAMS 16
+#define SESSION_SLAB_SIZE 32              // sessions allocated together when a worker's pool runs dry
+#define SESSION_ARENA_SIZE (8 * 1024)    // per-session scratch memory, reset after every command
+#define BLOCK_HEADER_SIZE 17
 #define DEFAULT_ROOT_DIR "data"
+#define DEFAULT_IDLE_TIMEOUT 300 // seconds a control connection may sit without a command
+#define DEFAULT_DATA_TIMEOUT 60  // seconds a transfer may go without moving a byte
+
+struct ClientSession;
+struct Worker;
+struct DirLister;
+struct Codec;
+struct Uring;
+struct UringTransfer;
+struct FileCache;
+struct FileCacheEntry;
+struct HashJob;
+
+// What an epoll registration refers to; the epoll_event carries a pointer to one of these
+typedef enum
+{
+    EV_LISTEN,
+    EV_CONTROL,
+    EV_DATA,
+    EV_PASV,
+    EV_STREAM,
+    EV_URING,     // the worker's io_uring completion eventfd
+    EV_FILE_CACHE // the worker's file cache inotify fd
+} EventKind;
+
+typedef struct
+{
+    EventKind kind;
+    int fd;
+    uint32_t events;
+    int registered;
+    struct ClientSession *session; // NULL for the worker's listening socket
+} EventSource;
+
+typedef enum
+{
+    XFER_NONE,
+    XFER_RETR,
+    XFER_STOR,
+    XFER_LIST
+} TransferKind;
+
+// Transmission mode selected with MODE
+typedef enum
+{
+    DATA_MODE_STREAM, // MODE S: raw bytes over one connection
+    DATA_MODE_BLOCK,  // MODE E: offset-tagged blocks over several connections
+    DATA_MODE_DEFLATE // MODE Z: a compressed stream over one connection
+} DataMode;
+
+// How file bytes move between the file and the data socket
+typedef enum
+{
+    XFER_IO_BUFFERED, // pread() into a staging buffer, then send()
+    XFER_IO_SENDFILE, // sendfile() straight from the page cache
+    XFER_IO_SPLICE,   // splice() file -> pipe -> socket
+    XFER_IO_URING     // RETR and STOR: batched reads, sends, receives and writes on the worker's io_uring
+} TransferIo;
+
+// An in-flight data-channel transfer, driven by readiness events on the data socket or by
+// io_uring completions
+typedef struct
+{
+    TransferKind kind;
+    TransferIo io;
+    int file_fd;
+    struct FileCacheEntry *cached; // RETR: file_fd is borrowed from the worker's file cache
+    off_t offset;   // next file offset to send
+    char *buffer;
+    size_t buf_len; // bytes valid in buffer
+    size_t buf_off; // bytes of buffer already sent
+    size_t buf_cap;
+    int pipe_fd[2]; // splice staging pipe, -1 when unused
+    size_t pipe_len; // bytes sitting in the pipe
+    size_t pipe_cap;
+    int eof;           // STOR: the client closed its side of the data connection
+    off_t preallocated; // STOR: end of the range reserved by fallocate(), trimmed on completion
+    struct DirLister *lister; // LIST: directory being streamed
+    off_t end;         // MODE E RETR: file size, blocks are handed out up to here
+    int eod_count;     // MODE E: connections that have finished with an EOD block
+    int eod_expected;  // MODE E: connection count from the EOF block, 0 until known
+    int lead_stream;   // MODE E LIST: the one stream carrying the listing
+    struct Codec *codec; // MODE Z: the session's compressor or decompressor, borrowed
+    struct UringTransfer *uring; // XFER_IO_URING: operations in flight on the worker's ring
+    char *raw;         // MODE Z: uncompressed side of the codec
+    size_t raw_len;
+    size_t raw_off;
+    uint64_t bytes;      // moved over the data connection(s) so far
+    uint64_t started_ns; // when transfer_begin() ran
+} Transfer;
+
+// One data connection of a MODE E transfer; ev must stay the first member
+typedef struct
+{
+    EventSource ev;
+    unsigned char header[BLOCK_HEADER_SIZE];
+    size_t header_len; // sending: header bytes queued; receiving: header bytes received so far
+    size_t header_off; // sending: header bytes already sent
+    off_t offset;      // file offset of the next payload byte of the current block
+    off_t remaining;   // payload bytes of the current block still to move
+    int eod;           // the connection's last block has been claimed or received
+} DataStream;
+
+// A passive-mode listening socket bound once at startup and lent to one session at a time
+typedef struct
+{
+    int fd;
+    int port;
+} PasvListener;
+
+// Each worker owns a slice of the passive port range; free listeners sit in a FIFO ring
+typedef struct
+{
+    PasvListener *listeners;
+    int *free_ring;
+    int free_head;
+    int free_count;
+    int size;
+} PasvPool;
+
+// All per-connection state; a session lives on exactly one worker for its lifetime
+typedef struct ClientSession
+{
+    struct Worker *worker;
+    uint64_t id;           // sequence number within the worker, for log records
+    EventSource ctrl;
+    EventSource data;      // connected data channel, fd -1 when absent
+    EventSource pasv;      // passive listener waiting for the client to connect
+    int pasv_slot;         // index into the worker's PasvPool, -1 if pasv.fd is not pooled
+    struct sockaddr_in peer_addr;  // control connection's client address
+    struct sockaddr_in local_addr; // address the client reached us on, advertised by PASV
+    int data_connecting;   // active-mode connect() still in progress
+    DataMode mode;
+    int parallelism;       // MODE E: data connections the client will open after PASV
+    DataStream streams[MAX_STREAMS];
+    int stream_count;      // open entries in streams
+    int codec_kind;        // MODE Z engine, a CodecKind
+    int codec_level;       // MODE Z compression level, 0 for the engine's default
+    struct Codec *compressor;   // kept across transfers and reset for each one
+    struct Codec *decompressor;
+    int logged_in;
+    off_t alloc_size;      // announced by ALLO for the next STOR
+    off_t restart_offset;  // set by REST, applies only to the command right after it
+    off_t range_start;     // set by RANG for the HASH right after it; range_end 0 when unset
+    off_t range_end;       // one past the last byte RANG named
+    int hash_algo;         // DigestAlgo for HASH, chosen with OPTS HASH
+    int closing;           // close once queued replies are flushed
+    int dead;
+    char cwd[PATH_MAX];    // virtual working directory, "/" is root_dir
+    int input_eof;         // the client half-closed the control connection
+    CommandRing in;        // control input not yet parsed into commands
+    char *out;             // queued control replies
+    size_t out_len;
+    size_t out_cap;
+    int reply_code;        // code of the last reply queued, for log records
+    Transfer xfer;
+    struct HashJob *hash;  // checksum in progress, see ftp_hash.c
+    TimerNode timer;       // next idle or stall check on the worker's wheel
+    uint64_t last_active;  // second of the last event on any of the session's sockets
+    uint64_t stall_xfer;   // started_ns of the transfer the stall check is following
+    uint64_t stall_bytes;  // its byte count when it last moved
+    uint64_t stall_since;  // second it last moved
+    Arena arena;           // command-scoped allocations, storage follows the struct in its slab
+    struct ClientSession *next_dead;
+    struct ClientSession *next_free; // worker's session pool
+} ClientSession;
+
+#define SESSION_ARENA_OFFSET ((sizeof(ClientSession) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// A directory opened beneath the root, cached so path lookups start from it
+typedef struct
+{
+    char *path; // virtual path, NULL for an empty slot
+    int fd;     // O_PATH handle
+} DirHandle;
+
+// One event loop per core, each with its own SO_REUSEPORT listener
+typedef struct Worker
+{
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    EventSource listener;
+    ClientSession *graveyard; // sessions closed during the current event batch
+    ClientSession *session_free; // recycled sessions, carved from slabs of SESSION_SLAB_SIZE
+    PasvPool pasv_pool;
+    DirHandle dir_handles[DIR_HANDLE_SLOTS]; // open directories, direct-mapped by virtual path
+    Metrics metrics; // written only by this worker, read by SITE STATS and the metrics endpoint
+    struct Uring *uring; // NULL unless -io-uring was given and the kernel supports it
+    struct FileCache *file_cache; // open files RETR serves from, NULL with -no-file-cache
+    struct HashJob *hash_jobs;    // checksums in progress, advanced between event batches
+    unsigned char *hash_buffer;   // HASH_BUFFER_SIZE, allocated by the first checksum
+    TimerWheel timers;            // idle and stall deadlines of the worker's sessions
+} Worker;
 
 void make_absolute_path(char *path, char *absolute_path);
 
-void handle_client(int client_socket);
-void send_response(int client_socket, const char *response);
-void handle_user(int client_socket, char *args);
-void handle_pass(int client_socket, char *args);
-void handle_quit(int client_socket);
-void handle_retr(int client_socket, char *filename);
-void handle_stor(int client_socket, char *filename);
-void handle_port(int client_socket, char *args);
-void handle_pasv(int client_socket);
-void handle_type(int client_socket, char *args);
-void handle_list(int client_socket, char *args);
-void handle_mkd(int client_socket, char *dirname);
-void handle_cwd(int client_socket, char *dirname);
-void handle_pwd(int client_socket);
-void handle_rmd(int client_socket, char *dirname);
-void handle_syst(int client_socket);
-void handle_abor(int client_socket);
-void handle_epsv(int client_socket);
-void handle_dele(int client_socket, char *filename);
-void handle_size(int client_socket, char *filename);
-
-char* get_absolute_path(const char* relative_path);
-
-#endif // FTP_SERVER_H
\ No newline at end of file
+void ev_set(Worker *worker, EventSource *ev, uint32_t events);
+void ev_close(Worker *worker, EventSource *ev);
+int ev_detach(Worker *worker, EventSource *ev);
+void session_update_events(ClientSession *session);
+void data_reset(ClientSession *session);
+
+void handle_client(ClientSession *session, char *line);
+void send_response(ClientSession *session, const char *response);
+void send_responsef(ClientSession *session, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void handle_user(ClientSession *session, char *args);
+void handle_pass(ClientSession *session, char *args);
+void handle_quit(ClientSession *session, char *args);
+void handle_retr(ClientSession *session, char *filename);
+void handle_stor(ClientSession *session, char *filename);
+void handle_appe(ClientSession *session, char *filename);
+void handle_rest(ClientSession *session, char *args);
+void handle_port(ClientSession *session, char *args);
+void handle_pasv(ClientSession *session, char *args);
+void handle_type(ClientSession *session, char *args);
+void handle_mode(ClientSession *session, char *args);
+void handle_opts(ClientSession *session, char *args);
+void handle_list(ClientSession *session, char *args);
+void handle_mlsd(ClientSession *session, char *args);
+void handle_mlst(ClientSession *session, char *args);
+void handle_feat(ClientSession *session, char *args);
+void handle_mkd(ClientSession *session, char *dirname);
+void handle_cwd(ClientSession *session, char *dirname);
+void handle_pwd(ClientSession *session, char *args);
+void handle_rmd(ClientSession *session, char *dirname);
+void handle_syst(ClientSession *session, char *args);
+void handle_abor(ClientSession *session, char *args);
+void handle_epsv(ClientSession *session, char *args);
+void handle_dele(ClientSession *session, char *filename);
+void handle_size(ClientSession *session, char *filename);
+void handle_allo(ClientSession *session, char *args);
+void handle_site(ClientSession *session, char *args);
+void handle_hash(ClientSession *session, char *filename);
+void handle_rang(ClientSession *session, char *args);
+void handle_xcrc(ClientSession *session, char *args);
+void handle_xmd5(ClientSession *session, char *args);
+void handle_xsha256(ClientSession *session, char *args);
+
+#endif // FTP_SERVER_H
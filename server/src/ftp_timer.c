@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+#include "ftp_timer.h"
+
+// The coarse clock is read from the vDSO without a system call; a tick of a few ms is plenty
+// for deadlines counted in seconds
+static uint64_t timer_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec;
+}
+
+void timer_init(TimerWheel *wheel)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = timer_clock();
+}
+
+static void unlink_node(TimerWheel *wheel, TimerNode *node)
+{
+    if (node->prev != NULL)
+    {
+        node->prev->next = node->next;
+    }
+    else
+    {
+        wheel->slots[node->due % TIMER_SLOTS] = node->next;
+    }
+    if (node->next != NULL)
+    {
+        node->next->prev = node->prev;
+    }
+    node->next = node->prev = NULL;
+    node->armed = 0;
+    wheel->armed--;
+}
+
+void timer_schedule(TimerWheel *wheel, TimerNode *node, uint64_t due)
+{
+    if (node->armed)
+    {
+        unlink_node(wheel, node);
+    }
+    // The slot for the current second has been visited already
+    if (due <= wheel->now)
+    {
+        due = wheel->now + 1;
+    }
+    TimerNode **slot = &wheel->slots[due % TIMER_SLOTS];
+    node->due = due;
+    node->prev = NULL;
+    node->next = *slot;
+    if (*slot != NULL)
+    {
+        (*slot)->prev = node;
+    }
+    *slot = node;
+    node->armed = 1;
+    wheel->armed++;
+}
+
+void timer_cancel(TimerWheel *wheel, TimerNode *node)
+{
+    if (node->armed)
+    {
+        unlink_node(wheel, node);
+    }
+}
+
+void timer_advance(TimerWheel *wheel, void (*expire)(TimerNode *node))
+{
+    uint64_t now = timer_clock();
+    if (now <= wheel->now)
+    {
+        return;
+    }
+
+    // After a long block every slot is visited once, comparing against the real time
+    uint64_t first = now - wheel->now > TIMER_SLOTS ? now - TIMER_SLOTS + 1 : wheel->now + 1;
+    wheel->now = now;
+    for (uint64_t second = first; second <= now; second++)
+    {
+        TimerNode *node = wheel->slots[second % TIMER_SLOTS];
+        while (node != NULL)
+        {
+            // expire only ever reschedules the node it is given, which goes to the head of a list
+            TimerNode *next = node->next;
+            if (node->due <= now)
+            {
+                unlink_node(wheel, node);
+                expire(node);
+            }
+            node = next;
+        }
+    }
+}
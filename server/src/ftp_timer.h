@@ -0,0 +1,34 @@
+#ifndef FTP_TIMER_H
+#define FTP_TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_SLOTS 64 // one-second slots; a later deadline waits in its slot for the lap it falls in
+
+// Intrusive: the owner embeds the node and finds itself again from the node's address
+typedef struct TimerNode
+{
+    struct TimerNode *next;
+    struct TimerNode *prev;
+    uint64_t due; // second the node expires in, on the wheel's clock
+    int armed;
+} TimerNode;
+
+// Hashed timing wheel with one-second resolution, owned by a single worker. Scheduling and
+// cancelling are O(1), and each second only the nodes hashed to that slot are visited.
+typedef struct
+{
+    TimerNode *slots[TIMER_SLOTS];
+    uint64_t now;   // current second, moved forward by timer_advance()
+    size_t armed;   // nodes scheduled, so an idle worker can block without a timeout
+} TimerWheel;
+
+void timer_init(TimerWheel *wheel);
+// (Re)schedules node to expire at second due; a due already passed expires on the next advance
+void timer_schedule(TimerWheel *wheel, TimerNode *node, uint64_t due);
+void timer_cancel(TimerWheel *wheel, TimerNode *node);
+// Moves the wheel to the current second and calls expire for every node that came due. The
+// node is unarmed when expire runs, which may schedule it again.
+void timer_advance(TimerWheel *wheel, void (*expire)(TimerNode *node));
+
+#endif // FTP_TIMER_H
@@ -0,0 +1,796 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "ftp_transfer.h"
+#include "ftp_list.h"
+#include "ftp_block.h"
+#include "ftp_codec.h"
+#include "ftp_log.h"
+#include "ftp_uring.h"
+#include "ftp_filecache.h"
+
+int zero_copy_enabled = 1;
+size_t stor_buffer_size = STOR_BUFFER_SIZE;
+
+uint32_t transfer_events(const Transfer *xfer)
+{
+    return xfer->kind == XFER_STOR ? EPOLLIN : EPOLLOUT;
+}
+
+void transfer_init(Transfer *xfer)
+{
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->file_fd = -1;
+    xfer->pipe_fd[0] = -1;
+    xfer->pipe_fd[1] = -1;
+}
+
+void transfer_release(Transfer *xfer)
+{
+    if (xfer->uring != NULL)
+    {
+        uring_detach(xfer->uring);
+    }
+    if (xfer->cached != NULL)
+    {
+        file_cache_release(xfer->cached);
+    }
+    else if (xfer->file_fd >= 0)
+    {
+        close(xfer->file_fd);
+    }
+    if (xfer->pipe_fd[0] >= 0)
+    {
+        close(xfer->pipe_fd[0]);
+        close(xfer->pipe_fd[1]);
+    }
+    free(xfer->buffer);
+    free(xfer->raw);
+    lister_close(xfer->lister);
+    transfer_init(xfer);
+}
+
+// MODE Z: borrow the session's codec for this direction, creating it on first use
+static int transfer_begin_codec(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    int compress = xfer->kind != XFER_STOR;
+    Codec **slot = compress ? &session->compressor : &session->decompressor;
+    if (*slot != NULL && (int)codec_kind(*slot) != session->codec_kind)
+    {
+        codec_destroy(*slot);
+        *slot = NULL;
+    }
+    if (*slot == NULL)
+    {
+        *slot = codec_create(session->codec_kind, compress);
+    }
+
+    int level = session->codec_level;
+    if (level == 0)
+    {
+        level = session->codec_kind == CODEC_ZSTD ? ZSTD_DEFAULT_LEVEL : DEFLATE_DEFAULT_LEVEL;
+    }
+    if (*slot == NULL || codec_reset(*slot, level) < 0)
+    {
+        return -1;
+    }
+
+    xfer->raw = malloc(CODEC_BUFFER_SIZE);
+    xfer->buffer = malloc(CODEC_BUFFER_SIZE);
+    if (xfer->raw == NULL || xfer->buffer == NULL)
+    {
+        return -1;
+    }
+    xfer->buf_cap = CODEC_BUFFER_SIZE;
+    xfer->codec = *slot;
+    xfer->io = XFER_IO_BUFFERED;
+    return 0;
+}
+
+// offset is where RETR starts reading and STOR starts writing, after REST or for APPE
+void transfer_begin(ClientSession *session, TransferKind kind, int file_fd, off_t offset)
+{
+    Transfer *xfer = &session->xfer;
+    xfer->kind = kind;
+    xfer->file_fd = file_fd;
+    xfer->offset = offset;
+    xfer->started_ns = metrics_now_ns();
+    if (!zero_copy_enabled || kind == XFER_LIST)
+    {
+        xfer->io = XFER_IO_BUFFERED;
+    }
+    else
+    {
+        xfer->io = kind == XFER_RETR ? XFER_IO_SENDFILE : XFER_IO_SPLICE;
+    }
+
+    if (session->mode == DATA_MODE_DEFLATE && transfer_begin_codec(session) < 0)
+    {
+        transfer_fail(session, ENOMEM);
+        return;
+    }
+    if (session->mode == DATA_MODE_BLOCK)
+    {
+        block_begin(session);
+        session_update_events(session);
+        return;
+    }
+
+    if (session->data.fd >= 0)
+    {
+        transfer_data_ready(session);
+    }
+    session_update_events(session);
+}
+
+// The data connection is up and a transfer is waiting for it
+void transfer_data_ready(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (session->worker->uring != NULL && session->mode == DATA_MODE_STREAM && xfer->kind != XFER_LIST)
+    {
+        // Completions drive the transfer, so the socket leaves epoll; the fd stays the session's
+        session->data.fd = ev_detach(session->worker, &session->data);
+        if (uring_start(session) == 0)
+        {
+            return;
+        }
+        // The worker's buffers or file slots are all taken: this one uses the epoll paths
+        xfer->io = zero_copy_enabled ? (xfer->kind == XFER_RETR ? XFER_IO_SENDFILE : XFER_IO_SPLICE) : XFER_IO_BUFFERED;
+    }
+    ev_set(session->worker, &session->data, transfer_events(xfer));
+}
+
+static const MetricTransfer transfer_metric[] = {
+    [XFER_RETR] = METRIC_XFER_RETR,
+    [XFER_STOR] = METRIC_XFER_STOR,
+    [XFER_LIST] = METRIC_XFER_LIST,
+};
+
+// Counts the transfer and logs it; reply is NULL when the session went away mid-transfer
+static void transfer_record(ClientSession *session, const char *reply)
+{
+    static const char *const kind_names[] = {[XFER_RETR] = "retr", [XFER_STOR] = "stor", [XFER_LIST] = "list"};
+    Transfer *xfer = &session->xfer;
+    if (xfer->kind == XFER_NONE)
+    {
+        return;
+    }
+
+    int ok = reply != NULL && reply[0] == '2';
+    uint64_t elapsed = metrics_transfer(&session->worker->metrics, transfer_metric[xfer->kind], xfer->bytes, xfer->started_ns, ok);
+    if (LOG_ENABLED(LOG_LEVEL_INFO))
+    {
+        LogRecord rec;
+        log_begin(&rec, ok ? LOG_LEVEL_INFO : LOG_LEVEL_WARN, "transfer");
+        log_int(&rec, "worker", session->worker->id);
+        log_uint(&rec, "session", session->id);
+        log_str(&rec, "kind", kind_names[xfer->kind]);
+        log_uint(&rec, "bytes", xfer->bytes);
+        log_double(&rec, "duration_ms", elapsed / 1e6);
+        log_int(&rec, "code", reply != NULL ? atoi(reply) : 0);
+        log_end(&rec);
+    }
+}
+
+void transfer_finish(ClientSession *session, const char *reply)
+{
+    transfer_record(session, reply);
+    transfer_release(&session->xfer);
+    data_reset(session);
+    send_response(session, reply);
+}
+
+void transfer_complete(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->kind == XFER_STOR && xfer->preallocated > xfer->offset && ftruncate(xfer->file_fd, xfer->offset) != 0)
+    {
+        transfer_finish(session, "451 Requested action aborted: local error in processing\r\n");
+        return;
+    }
+    transfer_finish(session, "226 Transfer complete\r\n");
+}
+
+// The session is going away with the transfer still open; it counts as failed
+void transfer_abandon(ClientSession *session)
+{
+    transfer_record(session, NULL);
+    transfer_release(&session->xfer);
+}
+
+// errno after a failed data-channel call: the peer going away is a 426, anything else is ours
+void transfer_fail(ClientSession *session, int err)
+{
+    if (err == EPIPE || err == ECONNRESET || err == ENOTCONN || err == ETIMEDOUT)
+    {
+        transfer_finish(session, "426 Connection closed; transfer aborted\r\n");
+    }
+    else
+    {
+        transfer_finish(session, "451 Requested action aborted: local error in processing\r\n");
+    }
+}
+
+static int transfer_ensure_buffer(Transfer *xfer, size_t size)
+{
+    if (xfer->buffer == NULL)
+    {
+        // Page-aligned so large STOR buffers map cleanly onto the page cache
+        void *buffer = NULL;
+        if (posix_memalign(&buffer, STOR_BUFFER_ALIGN, size) != 0)
+        {
+            return -1;
+        }
+        xfer->buffer = buffer;
+        xfer->buf_cap = size;
+        xfer->buf_len = 0;
+        xfer->buf_off = 0;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const char *buffer, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t written = pwrite(fd, buffer, len, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+// LIST or MLSD from the worker's listing cache: the body is shared, so only the offset is ours
+static void transfer_pump_cached_listing(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    size_t len;
+    const char *body = file_cache_body(xfer->cached, &len);
+    while (xfer->buf_off < len)
+    {
+        ssize_t sent = send(session->data.fd, body + xfer->buf_off, len - xfer->buf_off, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            transfer_fail(session, errno);
+            return;
+        }
+        xfer->buf_off += sent;
+        xfer->bytes += sent;
+    }
+    transfer_complete(session);
+}
+
+// Copying path: used for LIST output and for RETR when zero-copy is off or unsupported
+static void transfer_pump_buffered(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->kind == XFER_LIST && xfer->cached != NULL)
+    {
+        transfer_pump_cached_listing(session);
+        return;
+    }
+    if (transfer_ensure_buffer(xfer, xfer->kind == XFER_LIST ? LIST_BUFFER_SIZE : RETR_BUFFER_SIZE) < 0)
+    {
+        transfer_fail(session, ENOMEM);
+        return;
+    }
+
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        if (xfer->buf_off == xfer->buf_len)
+        {
+            if (xfer->kind == XFER_LIST)
+            {
+                // Format the next batch of entries only once the previous one is on the wire
+                xfer->buf_len = lister_fill(xfer->lister, xfer->buffer, xfer->buf_cap);
+                xfer->buf_off = 0;
+                if (xfer->buf_len == 0)
+                {
+                    transfer_complete(session);
+                    return;
+                }
+                continue;
+            }
+
+            ssize_t bytes_read = pread(xfer->file_fd, xfer->buffer, xfer->buf_cap, xfer->offset);
+            if (bytes_read == 0)
+            {
+                transfer_complete(session);
+                return;
+            }
+            if (bytes_read < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                transfer_fail(session, errno);
+                return;
+            }
+            xfer->offset += bytes_read;
+            xfer->buf_len = bytes_read;
+            xfer->buf_off = 0;
+        }
+
+        ssize_t sent = send(session->data.fd, xfer->buffer + xfer->buf_off, xfer->buf_len - xfer->buf_off, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            transfer_fail(session, errno);
+            return;
+        }
+        xfer->buf_off += sent;
+        xfer->bytes += sent;
+    }
+}
+
+static int transfer_open_pipe(Transfer *xfer)
+{
+    if (pipe2(xfer->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        xfer->pipe_fd[0] = -1;
+        xfer->pipe_fd[1] = -1;
+        return -1;
+    }
+
+    // A larger pipe means fewer splice round trips; the default is 64 KB
+    fcntl(xfer->pipe_fd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    int size = fcntl(xfer->pipe_fd[1], F_GETPIPE_SZ);
+    xfer->pipe_cap = size > 0 ? (size_t)size : 65536;
+    xfer->pipe_len = 0;
+    return 0;
+}
+
+// file -> pipe -> socket, for files sendfile() refuses
+static void transfer_pump_splice(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->pipe_fd[0] < 0 && transfer_open_pipe(xfer) < 0)
+    {
+        xfer->io = XFER_IO_BUFFERED;
+        transfer_pump_buffered(session);
+        return;
+    }
+
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        if (xfer->pipe_len == 0)
+        {
+            ssize_t filled = splice(xfer->file_fd, &xfer->offset, xfer->pipe_fd[1], NULL, xfer->pipe_cap, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (filled == 0)
+            {
+                transfer_complete(session);
+                return;
+            }
+            if (filled < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN)
+                {
+                    continue;
+                }
+                if (errno == EINVAL || errno == ENOSYS)
+                {
+                    xfer->io = XFER_IO_BUFFERED;
+                    transfer_pump_buffered(session);
+                    return;
+                }
+                transfer_fail(session, errno);
+                return;
+            }
+            xfer->pipe_len = filled;
+        }
+
+        ssize_t sent = splice(xfer->pipe_fd[0], NULL, session->data.fd, NULL, xfer->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            transfer_fail(session, errno);
+            return;
+        }
+        xfer->pipe_len -= sent;
+        xfer->bytes += sent;
+    }
+}
+
+// Page cache -> socket with no user-space copy; short writes just advance the offset
+static void transfer_pump_sendfile(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        ssize_t sent = sendfile(session->data.fd, xfer->file_fd, &xfer->offset, SENDFILE_CHUNK);
+        if (sent == 0)
+        {
+            transfer_complete(session);
+            return;
+        }
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+            {
+                xfer->io = XFER_IO_SPLICE;
+                transfer_pump_splice(session);
+                return;
+            }
+            transfer_fail(session, errno);
+            return;
+        }
+        xfer->bytes += sent;
+    }
+}
+
+// Copying STOR path: large aligned reads from the socket, positioned writes to the file
+static void transfer_pump_recv_buffered(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (transfer_ensure_buffer(xfer, stor_buffer_size) < 0)
+    {
+        transfer_fail(session, ENOMEM);
+        return;
+    }
+
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        ssize_t bytes_read;
+        if (xfer->pipe_len > 0)
+        {
+            // Left over from a splice attempt the filesystem refused
+            bytes_read = read(xfer->pipe_fd[0], xfer->buffer, xfer->pipe_len < xfer->buf_cap ? xfer->pipe_len : xfer->buf_cap);
+            if (bytes_read > 0)
+            {
+                xfer->pipe_len -= bytes_read;
+            }
+        }
+        else if (xfer->eof)
+        {
+            transfer_complete(session);
+            return;
+        }
+        else
+        {
+            bytes_read = recv(session->data.fd, xfer->buffer, xfer->buf_cap, 0);
+            if (bytes_read == 0)
+            {
+                transfer_complete(session);
+                return;
+            }
+            if (bytes_read > 0)
+            {
+                xfer->bytes += bytes_read;
+            }
+        }
+
+        if (bytes_read < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            transfer_fail(session, errno);
+            return;
+        }
+        if (pwrite_all(xfer->file_fd, xfer->buffer, bytes_read, xfer->offset) < 0)
+        {
+            transfer_fail(session, errno);
+            return;
+        }
+        xfer->offset += bytes_read;
+    }
+}
+
+// socket -> pipe -> file without the data ever entering user space
+static void transfer_pump_recv_splice(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->pipe_fd[0] < 0 && transfer_open_pipe(xfer) < 0)
+    {
+        xfer->io = XFER_IO_BUFFERED;
+        transfer_pump_recv_buffered(session);
+        return;
+    }
+
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        if (!xfer->eof && xfer->pipe_len < xfer->pipe_cap)
+        {
+            ssize_t filled = splice(session->data.fd, NULL, xfer->pipe_fd[1], NULL, xfer->pipe_cap - xfer->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (filled == 0)
+            {
+                xfer->eof = 1;
+            }
+            else if (filled > 0)
+            {
+                xfer->pipe_len += filled;
+                xfer->bytes += filled;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (xfer->pipe_len == 0)
+                {
+                    return;
+                }
+            }
+            else if (errno == EINVAL || errno == ENOSYS)
+            {
+                xfer->io = XFER_IO_BUFFERED;
+                transfer_pump_recv_buffered(session);
+                return;
+            }
+            else
+            {
+                transfer_fail(session, errno);
+                return;
+            }
+        }
+
+        if (xfer->pipe_len > 0)
+        {
+            ssize_t written = splice(xfer->pipe_fd[0], NULL, xfer->file_fd, &xfer->offset, xfer->pipe_len, SPLICE_F_MOVE);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EINVAL || errno == ENOSYS)
+                {
+                    xfer->io = XFER_IO_BUFFERED;
+                    transfer_pump_recv_buffered(session);
+                    return;
+                }
+                transfer_fail(session, errno);
+                return;
+            }
+            xfer->pipe_len -= written;
+        }
+
+        if (xfer->eof && xfer->pipe_len == 0)
+        {
+            transfer_complete(session);
+            return;
+        }
+    }
+}
+
+// MODE Z send side: file or listing -> raw -> codec -> buffer -> socket
+static void transfer_pump_compress(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        if (xfer->buf_off < xfer->buf_len)
+        {
+            ssize_t sent = send(session->data.fd, xfer->buffer + xfer->buf_off, xfer->buf_len - xfer->buf_off, MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                transfer_fail(session, errno);
+                return;
+            }
+            xfer->buf_off += sent;
+            xfer->bytes += sent;
+            continue;
+        }
+        if (xfer->eof)
+        {
+            // The codec has flushed its final block and it is on the wire
+            transfer_complete(session);
+            return;
+        }
+
+        int finish = 0;
+        if (xfer->raw_off == xfer->raw_len)
+        {
+            ssize_t bytes_read;
+            if (xfer->kind == XFER_LIST)
+            {
+                bytes_read = lister_fill(xfer->lister, xfer->raw, CODEC_BUFFER_SIZE);
+            }
+            else
+            {
+                bytes_read = pread(xfer->file_fd, xfer->raw, CODEC_BUFFER_SIZE, xfer->offset);
+            }
+            if (bytes_read < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                transfer_fail(session, errno);
+                return;
+            }
+            xfer->offset += bytes_read;
+            xfer->raw_len = bytes_read;
+            xfer->raw_off = 0;
+            finish = bytes_read == 0;
+        }
+
+        size_t consumed;
+        size_t produced;
+        int rc = codec_process(xfer->codec, xfer->raw + xfer->raw_off, xfer->raw_len - xfer->raw_off, &consumed,
+                               xfer->buffer, xfer->buf_cap, &produced, finish);
+        if (rc < 0)
+        {
+            transfer_fail(session, EIO);
+            return;
+        }
+        xfer->raw_off += consumed;
+        xfer->buf_len = produced;
+        xfer->buf_off = 0;
+        xfer->eof = rc == 1;
+    }
+}
+
+// MODE Z receive side: socket -> buffer -> codec -> raw -> file
+static void transfer_pump_decompress(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    for (int i = 0; i < TRANSFER_BURST; i++)
+    {
+        if (xfer->buf_off == xfer->buf_len && !xfer->eof)
+        {
+            ssize_t bytes_read = recv(session->data.fd, xfer->buffer, xfer->buf_cap, 0);
+            if (bytes_read < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                transfer_fail(session, errno);
+                return;
+            }
+            xfer->eof = bytes_read == 0;
+            xfer->buf_len = bytes_read;
+            xfer->bytes += bytes_read;
+            xfer->buf_off = 0;
+        }
+
+        size_t consumed;
+        size_t produced;
+        int rc = codec_process(xfer->codec, xfer->buffer + xfer->buf_off, xfer->buf_len - xfer->buf_off, &consumed,
+                               xfer->raw, CODEC_BUFFER_SIZE, &produced, xfer->eof);
+        if (rc < 0)
+        {
+            transfer_fail(session, EIO);
+            return;
+        }
+        xfer->buf_off += consumed;
+        if (produced > 0)
+        {
+            if (pwrite_all(xfer->file_fd, xfer->raw, produced, xfer->offset) < 0)
+            {
+                transfer_fail(session, errno);
+                return;
+            }
+            xfer->offset += produced;
+        }
+
+        if (rc == 1)
+        {
+            transfer_complete(session);
+            return;
+        }
+        if (xfer->eof && consumed == 0 && produced == 0)
+        {
+            // The client closed the connection in the middle of the compressed stream
+            transfer_fail(session, ECONNRESET);
+            return;
+        }
+    }
+}
+
+void transfer_pump(ClientSession *session)
+{
+    Transfer *xfer = &session->xfer;
+    if (xfer->codec != NULL)
+    {
+        if (xfer->kind == XFER_STOR)
+        {
+            transfer_pump_decompress(session);
+        }
+        else
+        {
+            transfer_pump_compress(session);
+        }
+        return;
+    }
+    if (xfer->io == XFER_IO_URING)
+    {
+        return; // driven by uring_reap()
+    }
+    if (xfer->kind == XFER_STOR)
+    {
+        if (xfer->io == XFER_IO_SPLICE)
+        {
+            transfer_pump_recv_splice(session);
+        }
+        else
+        {
+            transfer_pump_recv_buffered(session);
+        }
+        return;
+    }
+
+    switch (xfer->io)
+    {
+    case XFER_IO_SENDFILE:
+        transfer_pump_sendfile(session);
+        break;
+    case XFER_IO_SPLICE:
+        transfer_pump_splice(session);
+        break;
+    case XFER_IO_BUFFERED:
+        transfer_pump_buffered(session);
+        break;
+    case XFER_IO_URING:
+        break;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef FTP_TRANSFER_H
+#define FTP_TRANSFER_H
+
+#include "ftp_server.h"
+
+#define SENDFILE_CHUNK (1 << 20)
+#define SPLICE_PIPE_SIZE (1 << 20)
+#define STOR_BUFFER_SIZE (256 * 1024)
+#define RETR_BUFFER_SIZE (256 * 1024) // copying RETR path, so a file is read in as few preads as STOR writes it
+#define STOR_BUFFER_ALIGN 4096
+
+// Cleared by -no-zero-copy; RETR and STOR then always go through a staging buffer
+extern int zero_copy_enabled;
+// Staging buffer for the copying STOR path, set by -stor-buffer
+extern size_t stor_buffer_size;
+
+uint32_t transfer_events(const Transfer *xfer);
+void transfer_begin(ClientSession *session, TransferKind kind, int file_fd, off_t offset);
+void transfer_data_ready(ClientSession *session);
+void transfer_finish(ClientSession *session, const char *reply);
+void transfer_complete(ClientSession *session);
+void transfer_fail(ClientSession *session, int err);
+void transfer_abandon(ClientSession *session);
+void transfer_pump(ClientSession *session);
+void transfer_init(Transfer *xfer);
+void transfer_release(Transfer *xfer);
+
+#endif // FTP_TRANSFER_H
@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "ftp_uring.h"
+#include "ftp_transfer.h"
+#include "ftp_log.h"
+
+int io_uring_enabled = 0;
+
+typedef enum
+{
+    BUF_IDLE,
+    BUF_READ,  // RETR: filling from the file
+    BUF_READY, // RETR: full, or holding the file's last bytes, waiting its turn to be sent
+    BUF_SEND,
+    BUF_RECV,  // STOR: filling from the socket
+    BUF_WRITE
+} UringBufferState;
+
+struct UringTransfer;
+
+// One registered buffer lent to a transfer; its address is the user_data of its operation
+typedef struct
+{
+    struct UringTransfer *owner;
+    int index;      // into the worker's registered buffers
+    UringBufferState state;
+    off_t offset;   // file offset of the buffer's first byte
+    size_t len;     // bytes valid
+    size_t done;    // bytes already sent or written
+} UringBuffer;
+
+typedef struct UringTransfer
+{
+    struct Uring *ring;
+    ClientSession *session; // NULL once detached; the transfer only waits for the kernel then
+    int slot;               // fixed files: slot is the file, slot + 1 the data socket
+    int inflight;
+    int receiving;          // STOR: a recv is outstanding
+    int sending;            // RETR: a send is outstanding
+    int eof;                // STOR: the client closed the data connection
+    off_t next_offset;      // RETR: next offset to read; STOR: offset of the next byte received
+    off_t send_offset;      // RETR: next offset to go out on the socket
+    off_t end;              // RETR: file size as found by a short read, -1 until known
+    int buffer_count;
+    UringBuffer buffers[URING_DEPTH];
+} UringTransfer;
+
+typedef struct Uring
+{
+    EventSource ev; // eventfd the kernel signals when completions are posted
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending; // queued since the last io_uring_enter()
+    char *buffers;
+    int free_buffers[URING_BUFFERS];
+    int free_buffer_count;
+    int free_slots[URING_TRANSFERS];
+    int free_slot_count;
+} Uring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_map(Uring *ring, struct io_uring_params *p)
+{
+    size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p->features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_size > sq_size)
+    {
+        sq_size = cq_size;
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        return -1;
+    }
+    char *cq = sq;
+    if (!single)
+    {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            return -1;
+        }
+    }
+    ring->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    ring->sq_entries = p->sq_entries;
+    ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+// The buffer pool and the file table are registered once, so no operation pays for mapping
+// user memory or looking up an fd
+static int uring_register(Uring *ring)
+{
+    void *buffers = NULL;
+    if (posix_memalign(&buffers, 4096, (size_t)URING_BUFFERS * URING_BUFFER_SIZE) != 0)
+    {
+        return -1;
+    }
+    ring->buffers = buffers;
+
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++)
+    {
+        iov[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+        ring->free_buffers[i] = URING_BUFFERS - 1 - i;
+    }
+    ring->free_buffer_count = URING_BUFFERS;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0)
+    {
+        return -1;
+    }
+
+    // Sparse table: slots are filled when a transfer starts and cleared when it ends
+    int files[URING_TRANSFERS * 2];
+    for (int i = 0; i < URING_TRANSFERS * 2; i++)
+    {
+        files[i] = -1;
+    }
+    for (int i = 0; i < URING_TRANSFERS; i++)
+    {
+        ring->free_slots[i] = (URING_TRANSFERS - 1 - i) * 2;
+    }
+    ring->free_slot_count = URING_TRANSFERS;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, files, URING_TRANSFERS * 2) < 0)
+    {
+        return -1;
+    }
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &ring->ev.fd, 1) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+Uring *uring_create(Worker *worker)
+{
+    Uring *ring = calloc(1, sizeof(Uring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->ev = (EventSource){EV_URING, -1, 0, 0, NULL};
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0 || uring_map(ring, &params) < 0)
+    {
+        goto fail;
+    }
+    ring->ev.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->ev.fd < 0 || uring_register(ring) < 0)
+    {
+        goto fail;
+    }
+    ev_set(worker, &ring->ev, EPOLLIN);
+    return ring;
+
+fail:
+    LOG_WARN("worker %d: io_uring unavailable (%s), using epoll transfers", worker->id, strerror(errno));
+    // Runs once per worker at startup, so mappings from a half-built ring are simply left
+    if (ring->ev.fd >= 0)
+    {
+        close(ring->ev.fd);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    free(ring->buffers);
+    free(ring);
+    return NULL;
+}
+
+// SQEs are filled in place and picked up by the next uring_submit(); nothing polls the ring
+// from the kernel side, so publishing the tail early is safe
+static struct io_uring_sqe *uring_sqe(Uring *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        uring_submit(ring);
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            return NULL;
+        }
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+void uring_submit(Uring *ring)
+{
+    while (ring->pending > 0)
+    {
+        int submitted = sys_io_uring_enter(ring->fd, ring->pending, 0, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // EBUSY/EAGAIN: the completion queue is backed up; the next reap makes room
+            if (errno != EBUSY && errno != EAGAIN)
+            {
+                LOG_ERROR("io_uring_enter: %s", strerror(errno));
+            }
+            return;
+        }
+        ring->pending -= (unsigned)submitted < ring->pending ? (unsigned)submitted : ring->pending;
+        if (submitted == 0)
+        {
+            return;
+        }
+    }
+}
+
+static int uring_queue(UringBuffer *buf, int opcode, int slot, size_t skip, size_t len, off_t offset)
+{
+    UringTransfer *xfer = buf->owner;
+    struct io_uring_sqe *sqe = uring_sqe(xfer->ring);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = slot;
+    sqe->addr = (uint64_t)(uintptr_t)(xfer->ring->buffers + (size_t)buf->index * URING_BUFFER_SIZE + skip);
+    sqe->len = len;
+    sqe->off = offset;
+    if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED)
+    {
+        sqe->buf_index = buf->index;
+    }
+    else
+    {
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)buf;
+    xfer->inflight++;
+    return 0;
+}
+
+static int queue_read(UringBuffer *buf)
+{
+    buf->state = BUF_READ;
+    return uring_queue(buf, IORING_OP_READ_FIXED, buf->owner->slot, buf->len, URING_BUFFER_SIZE - buf->len, buf->offset + buf->len);
+}
+
+static int queue_send(UringBuffer *buf)
+{
+    buf->state = BUF_SEND;
+    buf->owner->sending = 1;
+    return uring_queue(buf, IORING_OP_SEND, buf->owner->slot + 1, buf->done, buf->len - buf->done, 0);
+}
+
+static int queue_recv(UringBuffer *buf)
+{
+    buf->state = BUF_RECV;
+    buf->owner->receiving = 1;
+    return uring_queue(buf, IORING_OP_RECV, buf->owner->slot + 1, 0, URING_BUFFER_SIZE, 0);
+}
+
+static int queue_write(UringBuffer *buf)
+{
+    buf->state = BUF_WRITE;
+    return uring_queue(buf, IORING_OP_WRITE_FIXED, buf->owner->slot, buf->done, buf->len - buf->done, buf->offset + buf->done);
+}
+
+static int update_files(Uring *ring, int slot, int file_fd, int sock_fd)
+{
+    int fds[2] = {file_fd, sock_fd};
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (uint64_t)(uintptr_t)fds;
+    return sys_io_uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 2) == 2 ? 0 : -1;
+}
+
+static void uring_free(UringTransfer *xfer)
+{
+    Uring *ring = xfer->ring;
+    for (int i = 0; i < xfer->buffer_count; i++)
+    {
+        ring->free_buffers[ring->free_buffer_count++] = xfer->buffers[i].index;
+    }
+    ring->free_slots[ring->free_slot_count++] = xfer->slot;
+    free(xfer);
+}
+
+// RETR: keep every idle buffer reading ahead and the next buffer in file order on the wire
+static int retr_advance(UringTransfer *xfer)
+{
+    for (int i = 0; i < xfer->buffer_count; i++)
+    {
+        UringBuffer *buf = &xfer->buffers[i];
+        if (buf->state == BUF_IDLE && (xfer->end < 0 || xfer->next_offset < xfer->end))
+        {
+            buf->offset = xfer->next_offset;
+            buf->len = 0;
+            xfer->next_offset += URING_BUFFER_SIZE;
+            if (queue_read(buf) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    for (int i = 0; i < xfer->buffer_count && !xfer->sending; i++)
+    {
+        UringBuffer *buf = &xfer->buffers[i];
+        if (buf->state == BUF_READY && buf->offset == xfer->send_offset)
+        {
+            buf->done = 0;
+            if (queue_send(buf) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// STOR: one recv at a time keeps the file in stream order; the writes may overlap
+static int stor_advance(UringTransfer *xfer)
+{
+    for (int i = 0; i < xfer->buffer_count && !xfer->receiving && !xfer->eof; i++)
+    {
+        if (xfer->buffers[i].state == BUF_IDLE && queue_recv(&xfer->buffers[i]) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 once the transfer is done, 0 to keep going, or a negative errno on failure
+static int retr_complete(UringTransfer *xfer, UringBuffer *buf, int res)
+{
+    Transfer *t = &xfer->session->xfer;
+    if (buf->state == BUF_READ)
+    {
+        if (res == 0)
+        {
+            off_t end = buf->offset + (off_t)buf->len;
+            xfer->end = xfer->end < 0 || end < xfer->end ? end : xfer->end;
+            buf->state = buf->len > 0 ? BUF_READY : BUF_IDLE;
+        }
+        else
+        {
+            buf->len += res;
+            // A short read is either the end of the file or just short; the next read says which
+            buf->state = BUF_READY;
+            if (buf->len < URING_BUFFER_SIZE && queue_read(buf) < 0)
+            {
+                return -ENOMEM;
+            }
+        }
+    }
+    else
+    {
+        xfer->sending = 0;
+        buf->done += res;
+        t->bytes += res;
+        if (buf->done < buf->len)
+        {
+            if (queue_send(buf) < 0)
+            {
+                return -ENOMEM;
+            }
+        }
+        else
+        {
+            xfer->send_offset += buf->len;
+            buf->state = BUF_IDLE;
+        }
+    }
+
+    if (retr_advance(xfer) < 0)
+    {
+        return -ENOMEM;
+    }
+    return xfer->end >= 0 && xfer->send_offset >= xfer->end && xfer->inflight == 0;
+}
+
+static int stor_complete(UringTransfer *xfer, UringBuffer *buf, int res)
+{
+    Transfer *t = &xfer->session->xfer;
+    if (buf->state == BUF_RECV)
+    {
+        xfer->receiving = 0;
+        if (res == 0)
+        {
+            xfer->eof = 1;
+            buf->state = BUF_IDLE;
+        }
+        else
+        {
+            t->bytes += res;
+            buf->offset = xfer->next_offset;
+            buf->len = res;
+            buf->done = 0;
+            xfer->next_offset += res;
+            if (queue_write(buf) < 0)
+            {
+                return -ENOMEM;
+            }
+        }
+    }
+    else
+    {
+        buf->done += res;
+        if (buf->done < buf->len)
+        {
+            if (queue_write(buf) < 0)
+            {
+                return -ENOMEM;
+            }
+        }
+        else
+        {
+            buf->state = BUF_IDLE;
+        }
+    }
+
+    if (stor_advance(xfer) < 0)
+    {
+        return -ENOMEM;
+    }
+    if (xfer->eof && xfer->inflight == 0)
+    {
+        t->offset = xfer->next_offset;
+        return 1;
+    }
+    return 0;
+}
+
+int uring_start(ClientSession *session)
+{
+    Uring *ring = session->worker->uring;
+    Transfer *t = &session->xfer;
+    if (ring == NULL || ring->free_slot_count == 0 || ring->free_buffer_count == 0)
+    {
+        return -1;
+    }
+    UringTransfer *xfer = calloc(1, sizeof(UringTransfer));
+    if (xfer == NULL)
+    {
+        return -1;
+    }
+    xfer->ring = ring;
+    xfer->slot = ring->free_slots[--ring->free_slot_count];
+    if (update_files(ring, xfer->slot, t->file_fd, session->data.fd) < 0)
+    {
+        uring_free(xfer);
+        return -1;
+    }
+    while (xfer->buffer_count < URING_DEPTH && ring->free_buffer_count > 0)
+    {
+        UringBuffer *buf = &xfer->buffers[xfer->buffer_count++];
+        buf->owner = xfer;
+        buf->index = ring->free_buffers[--ring->free_buffer_count];
+        buf->state = BUF_IDLE;
+    }
+    xfer->session = session;
+    xfer->next_offset = t->offset;
+    xfer->send_offset = t->offset;
+    xfer->end = -1;
+    t->uring = xfer;
+    t->io = XFER_IO_URING;
+
+    // Nothing has been queued yet if this fails, so the caller can still take the epoll path
+    int rc = t->kind == XFER_RETR ? retr_advance(xfer) : stor_advance(xfer);
+    if (rc < 0 && xfer->inflight == 0)
+    {
+        t->uring = NULL;
+        update_files(ring, xfer->slot, -1, -1);
+        uring_free(xfer);
+        return -1;
+    }
+    if (rc < 0)
+    {
+        transfer_fail(session, ENOMEM);
+    }
+    return 0;
+}
+
+void uring_detach(UringTransfer *xfer)
+{
+    Uring *ring = xfer->ring;
+    xfer->session = NULL;
+    for (int i = 0; i < xfer->buffer_count; i++)
+    {
+        UringBuffer *buf = &xfer->buffers[i];
+        if (buf->state == BUF_IDLE || buf->state == BUF_READY)
+        {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)buf;
+            sqe->user_data = 0;
+        }
+    }
+    // Operations already in flight hold their own references to the files
+    update_files(ring, xfer->slot, -1, -1);
+    if (xfer->inflight == 0)
+    {
+        uring_free(xfer);
+    }
+}
+
+static void uring_complete(UringBuffer *buf, int res, void (*service)(ClientSession *))
+{
+    UringTransfer *xfer = buf->owner;
+    xfer->inflight--;
+    ClientSession *session = xfer->session;
+    if (session == NULL)
+    {
+        if (xfer->inflight == 0)
+        {
+            uring_free(xfer);
+        }
+        return;
+    }
+
+    int rc;
+    if (res < 0)
+    {
+        rc = res;
+    }
+    else if (session->xfer.kind == XFER_RETR)
+    {
+        rc = retr_complete(xfer, buf, res);
+    }
+    else
+    {
+        rc = stor_complete(xfer, buf, res);
+    }
+
+    // Either call releases the transfer, and xfer with it once nothing is in flight
+    if (rc < 0)
+    {
+        buf->state = BUF_IDLE;
+        transfer_fail(session, -rc);
+    }
+    else if (rc == 1)
+    {
+        transfer_complete(session);
+    }
+    else
+    {
+        return;
+    }
+    service(session);
+}
+
+void uring_reap(Uring *ring, void (*service)(ClientSession *))
+{
+    uint64_t count;
+    if (read(ring->ev.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        LOG_ERROR("io_uring eventfd: %s", strerror(errno));
+    }
+
+    unsigned head = *ring->cq_head;
+    for (;;)
+    {
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        // Release the entry before handling it: handlers queue new work and may submit
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+        if (user_data != 0)
+        {
+            uring_complete((UringBuffer *)(uintptr_t)user_data, res, service);
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef FTP_URING_H
+#define FTP_URING_H
+
+#include "ftp_server.h"
+
+#define URING_ENTRIES 512
+#define URING_BUFFERS 128               // registered with the kernel once per worker
+#define URING_BUFFER_SIZE (256 * 1024)
+#define URING_DEPTH 4                    // buffers one transfer keeps in flight
+#define URING_TRANSFERS (URING_BUFFERS / URING_DEPTH) // per worker; more fall back to epoll
+
+struct Uring;
+struct UringTransfer;
+
+// Set by -io-uring; workers whose ring cannot be created keep the epoll transfer paths
+extern int io_uring_enabled;
+
+struct Uring *uring_create(Worker *worker);
+// Takes over session's RETR or STOR once its data connection is up; -1 if the worker is out
+// of buffers or file slots and the transfer should use the epoll paths instead
+int uring_start(ClientSession *session);
+// The transfer is finished or abandoned: cancels whatever is still in flight and frees it
+// once the kernel is done with its buffers
+void uring_detach(struct UringTransfer *xfer);
+// Handles completions; service runs for each session that made progress
+void uring_reap(struct Uring *ring, void (*service)(ClientSession *));
+// Hands everything queued during this event batch to the kernel in one call
+void uring_submit(struct Uring *ring);
+
+#endif // FTP_URING_H
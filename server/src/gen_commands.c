@@ -0,0 +1,98 @@
+// Build-time generator for the command dispatch hash. Reads the names in ftp_commands.def and
+// searches for a multiplier that maps every packed opcode to a distinct slot, then prints the
+// slot table as ftp_command_table.h.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *names[] = {
+#define FTP_COMMAND(name, handler, auth, arity) #name,
+#include "ftp_commands.def"
+#undef FTP_COMMAND
+};
+
+#define NAME_COUNT (sizeof(names) / sizeof(names[0]))
+#define MAX_BITS 10
+
+static uint64_t pack(const char *name)
+{
+    uint64_t opcode = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        opcode = (opcode << 8) | (uint8_t)name[i];
+        if (name[i] == '\0')
+        {
+            opcode <<= 8 * (7 - i);
+            break;
+        }
+    }
+    return opcode;
+}
+
+int main(void)
+{
+    uint64_t opcodes[NAME_COUNT];
+    for (size_t i = 0; i < NAME_COUNT; i++)
+    {
+        if (strlen(names[i]) > 8)
+        {
+            fprintf(stderr, "gen_commands: %s is longer than eight characters\n", names[i]);
+            return 1;
+        }
+        opcodes[i] = pack(names[i]);
+    }
+
+    int bits = 1;
+    while ((1u << bits) < NAME_COUNT)
+    {
+        bits++;
+    }
+
+    // Multiplicative hashing: slot = (opcode * mult) >> (64 - bits). Try small tables first.
+    for (; bits <= MAX_BITS; bits++)
+    {
+        uint64_t seed = 0x9e3779b97f4a7c15ull;
+        for (int attempt = 0; attempt < 1000000; attempt++)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            uint64_t mult = seed | 1;
+
+            int slots[1 << MAX_BITS];
+            memset(slots, -1, sizeof(slots));
+            size_t i;
+            for (i = 0; i < NAME_COUNT; i++)
+            {
+                uint64_t slot = (opcodes[i] * mult) >> (64 - bits);
+                if (slots[slot] >= 0)
+                {
+                    break;
+                }
+                slots[slot] = (int)i;
+            }
+            if (i < NAME_COUNT)
+            {
+                continue;
+            }
+
+            printf("// Generated by gen_commands from ftp_commands.def; do not edit\n");
+            printf("#define COMMAND_HASH_MULT 0x%016llxull\n", (unsigned long long)mult);
+            printf("#define COMMAND_HASH_SHIFT %d\n", 64 - bits);
+            printf("#define COMMAND_HASH_SLOTS %d\n\n", 1 << bits);
+            printf("static const struct\n{\n    uint64_t opcode; // 0 for an empty slot\n    CommandId id;\n} command_slots[COMMAND_HASH_SLOTS] = {\n");
+            for (int slot = 0; slot < (1 << bits); slot++)
+            {
+                if (slots[slot] >= 0)
+                {
+                    printf("    [%d] = {0x%016llxull, CMD_%s},\n", slot, (unsigned long long)opcodes[slots[slot]], names[slots[slot]]);
+                }
+            }
+            printf("};\n");
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "gen_commands: no perfect hash found\n");
+    return 1;
+}
@@ -0,0 +1,1077 @@
+// Load generator for the FTP server. Opens N control sessions, each on its own thread, and
+// runs a weighted mix of LIST/RETR/STOR/SIZE/CWD against the server over PASV or EPSV for a
+// fixed time, in stream mode or in extended block mode (MODE E) over several data
+// connections. Reports ops/sec, throughput and latency percentiles per operation, as a table
+// or as JSON. Scenarios are small text files (see ../bench), and any setting can be
+// overridden on the command line after -scenario.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "ftp_histogram.h"
+
+#define REPLY_LINE_MAX 1024
+#define IO_TIMEOUT_SEC 10
+#define UPLOAD_CHUNK (256 * 1024)
+#define STOR_NAMES 16 // each session cycles through this many upload names
+#define MAX_PARALLELISM 16 // the server's MAX_STREAMS
+#define BLOCK_HEADER_SIZE 17
+#define BLOCK_SIZE (1 << 20) // bytes per MODE E block an upload stream claims, as the server sends
+#define BLOCK_DESC_EOD 0x08
+#define BLOCK_DESC_EOF 0x40
+
+typedef enum
+{
+    OP_LIST,
+    OP_RETR,
+    OP_STOR,
+    OP_SIZE,
+    OP_CWD,
+    OP_COUNT
+} OpKind;
+
+static const char *const op_names[OP_COUNT] = {"LIST", "RETR", "STOR", "SIZE", "CWD"};
+
+typedef struct
+{
+    char name[64];
+    char host[64];
+    int port;
+    int sessions;
+    double duration; // seconds measured
+    double warmup;   // seconds run before measuring starts
+    int files;       // files created under /lg by the setup phase
+    size_t file_size;
+    int weights[OP_COUNT];
+    int epsv;
+    int mode_e;      // MODE E: every transfer uses parallelism data connections
+    int parallelism;
+    unsigned seed;
+    int skip_setup;
+    const char *json_path; // NULL for the table, "-" for JSON on stdout
+} Config;
+
+typedef struct
+{
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t bytes;
+    Histogram latency_ns;
+} OpStats;
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    const Config *cfg;
+    uint64_t rng;
+    int ctrl;
+    char in[4096]; // control replies read but not yet consumed
+    size_t in_len;
+    size_t in_off;
+    int in_lg;     // CWD state: 1 when the working directory is /lg
+    unsigned stor_seq;
+    OpStats stats[OP_COUNT];
+} Client;
+
+static uint64_t measure_start_ns;
+static uint64_t measure_end_ns;
+static char upload_buffer[UPLOAD_CHUNK];
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t next_random(Client *c)
+{
+    // xorshift64*
+    c->rng ^= c->rng >> 12;
+    c->rng ^= c->rng << 25;
+    c->rng ^= c->rng >> 27;
+    return c->rng * 0x2545F4914F6CDD1Dull;
+}
+
+static int dial(const char *host, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = {IO_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int read_line(Client *c, char *line, size_t cap)
+{
+    size_t len = 0;
+    for (;;)
+    {
+        if (c->in_off == c->in_len)
+        {
+            ssize_t n = recv(c->ctrl, c->in, sizeof(c->in), 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return -1;
+            }
+            c->in_len = n;
+            c->in_off = 0;
+        }
+        char ch = c->in[c->in_off++];
+        if (ch == '\n')
+        {
+            if (len > 0 && line[len - 1] == '\r')
+            {
+                len--;
+            }
+            line[len] = '\0';
+            return 0;
+        }
+        if (len + 1 < cap)
+        {
+            line[len++] = ch;
+        }
+    }
+}
+
+// Reads one reply, skipping the continuation lines of a multi-line one; returns its code
+// and leaves the last line in line, or -1 if the connection failed
+static int read_reply(Client *c, char *line, size_t cap)
+{
+    if (read_line(c, line, cap) < 0 || strlen(line) < 3)
+    {
+        return -1;
+    }
+    int code = atoi(line);
+    if (line[3] == '-')
+    {
+        char end[5];
+        snprintf(end, sizeof(end), "%.3s ", line);
+        do
+        {
+            if (read_line(c, line, cap) < 0)
+            {
+                return -1;
+            }
+        } while (strncmp(line, end, 4) != 0);
+    }
+    return code;
+}
+
+static int command(Client *c, char *reply, size_t cap, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+static int command(Client *c, char *reply, size_t cap, const char *fmt, ...)
+{
+    char line[REPLY_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len > sizeof(line) - 3)
+    {
+        return -1;
+    }
+    memcpy(line + len, "\r\n", 2);
+    if (send_all(c->ctrl, line, len + 2) < 0)
+    {
+        return -1;
+    }
+    return read_reply(c, reply, cap);
+}
+
+static void session_close(Client *c)
+{
+    if (c->ctrl >= 0)
+    {
+        close(c->ctrl);
+        c->ctrl = -1;
+    }
+    c->in_len = c->in_off = 0;
+}
+
+static int session_open(Client *c)
+{
+    char reply[REPLY_LINE_MAX];
+    session_close(c);
+    c->ctrl = dial(c->cfg->host, c->cfg->port);
+    if (c->ctrl < 0)
+    {
+        return -1;
+    }
+    c->in_lg = 0;
+    if (read_reply(c, reply, sizeof(reply)) != 220 ||
+        command(c, reply, sizeof(reply), "USER anonymous") != 331 ||
+        command(c, reply, sizeof(reply), "PASS loadgen@") != 230 ||
+        command(c, reply, sizeof(reply), "TYPE I") != 200)
+    {
+        session_close(c);
+        return -1;
+    }
+    if (c->cfg->mode_e &&
+        (command(c, reply, sizeof(reply), "MODE E") != 200 ||
+         command(c, reply, sizeof(reply), "OPTS RETR Parallelism=%d;", c->cfg->parallelism) != 200))
+    {
+        session_close(c);
+        return -1;
+    }
+    return 0;
+}
+
+// Asks for a passive port with PASV or EPSV; returns it or -1
+static int passive_port(Client *c)
+{
+    char reply[REPLY_LINE_MAX];
+    int port;
+    if (c->cfg->epsv)
+    {
+        char *p;
+        if (command(c, reply, sizeof(reply), "EPSV") != 229 || (p = strstr(reply, "(|||")) == NULL)
+        {
+            return -1;
+        }
+        port = atoi(p + 4);
+    }
+    else
+    {
+        int h[4], p1, p2;
+        char *p;
+        if (command(c, reply, sizeof(reply), "PASV") != 227 || (p = strchr(reply, '(')) == NULL ||
+            sscanf(p, "(%d,%d,%d,%d,%d,%d)", &h[0], &h[1], &h[2], &h[3], &p1, &p2) != 6)
+        {
+            return -1;
+        }
+        port = p1 * 256 + p2;
+    }
+    return port;
+}
+
+static int open_data(Client *c)
+{
+    int port = passive_port(c);
+    return port < 0 ? -1 : dial(c->cfg->host, port);
+}
+
+static void put_u64(unsigned char *out, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        out[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_u64(const unsigned char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+// One data connection of a MODE E transfer
+typedef struct
+{
+    int fd;
+    unsigned char header[BLOCK_HEADER_SIZE];
+    size_t header_len; // receiving: bytes of the header read; sending: bytes queued
+    size_t header_off; // sending: bytes of the header already sent
+    uint64_t remaining; // payload bytes of the current block still to move
+    uint64_t position;  // sending: file offset of the next payload byte
+    int eod;            // receiving: EOD seen; sending: EOD queued
+    int done;
+} BlockStream;
+
+static void block_header(BlockStream *s, unsigned char desc, uint64_t count, uint64_t offset)
+{
+    s->header[0] = desc;
+    put_u64(s->header + 1, count);
+    put_u64(s->header + 9, offset);
+    s->header_len = BLOCK_HEADER_SIZE;
+    s->header_off = 0;
+}
+
+// Reads whatever is ready on a receiving stream: headers, then payload that is only counted.
+// Returns -1 on a failed or malformed connection.
+static int block_receive(BlockStream *s, uint64_t *bytes, int *eod_expected)
+{
+    char buffer[64 * 1024];
+    for (;;)
+    {
+        size_t want = s->remaining > 0 ? (s->remaining < sizeof(buffer) ? s->remaining : sizeof(buffer))
+                                       : BLOCK_HEADER_SIZE - s->header_len;
+        ssize_t n = recv(s->fd, s->remaining > 0 ? buffer : (char *)s->header + s->header_len, want, MSG_DONTWAIT);
+        if (n < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0)
+        {
+            // The server closes a connection only after its EOD block
+            if (!s->eod || s->remaining > 0)
+            {
+                return -1;
+            }
+            s->done = 1;
+            return 0;
+        }
+        if (s->remaining > 0)
+        {
+            s->remaining -= n;
+            *bytes += n;
+        }
+        else if ((s->header_len += n) == BLOCK_HEADER_SIZE)
+        {
+            s->header_len = 0;
+            s->remaining = get_u64(s->header + 1);
+            if (s->header[0] & BLOCK_DESC_EOF)
+            {
+                *eod_expected = (int)get_u64(s->header + 9);
+            }
+            if (s->header[0] & BLOCK_DESC_EOD)
+            {
+                s->eod = 1;
+            }
+        }
+        if (s->eod && s->remaining == 0)
+        {
+            s->done = 1;
+            return 0;
+        }
+    }
+}
+
+// Sends on a stream until the socket is full: block headers claimed from *next up to size,
+// payload from the upload buffer, and finally an EOD (with EOF on the first stream to finish)
+static int block_send(BlockStream *s, uint64_t *next, uint64_t size, int *eof_sent, int streams, uint64_t *bytes)
+{
+    for (;;)
+    {
+        if (s->header_off == s->header_len && s->remaining == 0)
+        {
+            if (s->eod)
+            {
+                s->done = 1;
+                return 0;
+            }
+            if (*next < size)
+            {
+                uint64_t count = size - *next < BLOCK_SIZE ? size - *next : BLOCK_SIZE;
+                block_header(s, 0, count, *next);
+                s->remaining = count;
+                s->position = *next;
+                *next += count;
+            }
+            else
+            {
+                block_header(s, BLOCK_DESC_EOD | (*eof_sent ? 0 : BLOCK_DESC_EOF), 0, *eof_sent ? 0 : (uint64_t)streams);
+                *eof_sent = 1;
+                s->eod = 1;
+            }
+        }
+
+        ssize_t n;
+        if (s->header_off < s->header_len)
+        {
+            n = send(s->fd, s->header + s->header_off, s->header_len - s->header_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                s->header_off += n;
+            }
+        }
+        else
+        {
+            // Each file offset gets the byte a stream mode upload would put there
+            size_t start = s->position % sizeof(upload_buffer);
+            size_t chunk = sizeof(upload_buffer) - start;
+            chunk = s->remaining < chunk ? s->remaining : chunk;
+            n = send(s->fd, upload_buffer + start, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                s->remaining -= n;
+                s->position += n;
+                *bytes += n;
+            }
+        }
+        if (n < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+    }
+}
+
+// LIST, RETR or STOR in MODE E: all the connections are opened before the command, then driven
+// together with poll() until every one has carried its EOD
+static int transfer_blocks(Client *c, const char *cmd, const char *path, size_t upload, uint64_t *bytes)
+{
+    char reply[REPLY_LINE_MAX];
+    BlockStream streams[MAX_PARALLELISM];
+    struct pollfd fds[MAX_PARALLELISM];
+    int count = c->cfg->parallelism;
+    int port = passive_port(c);
+    if (port < 0)
+    {
+        return -1;
+    }
+    memset(streams, 0, sizeof(streams));
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        streams[i].fd = failed ? -1 : dial(c->cfg->host, port);
+        failed |= streams[i].fd < 0;
+    }
+
+    int code = -1;
+    if (!failed)
+    {
+        code = path != NULL ? command(c, reply, sizeof(reply), "%s %s", cmd, path) : command(c, reply, sizeof(reply), "%s", cmd);
+        failed = code != 150 && code != 125;
+    }
+
+    uint64_t next = 0;
+    int eof_sent = 0;
+    int eod_expected = 0;
+    while (!failed)
+    {
+        int open = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (!streams[i].done)
+            {
+                fds[open].fd = streams[i].fd;
+                fds[open].events = upload > 0 ? POLLOUT : POLLIN;
+                open++;
+            }
+        }
+        if (open == 0)
+        {
+            break;
+        }
+        int ready = poll(fds, open, IO_TIMEOUT_SEC * 1000);
+        if (ready <= 0)
+        {
+            failed = ready == 0 || errno != EINTR;
+            continue;
+        }
+        for (int i = 0, f = 0; i < count && !failed; i++)
+        {
+            if (streams[i].done)
+            {
+                continue;
+            }
+            if (fds[f++].revents != 0)
+            {
+                failed = upload > 0 ? block_send(&streams[i], &next, upload, &eof_sent, count, bytes) < 0
+                                    : block_receive(&streams[i], bytes, &eod_expected) < 0;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (streams[i].fd >= 0)
+        {
+            close(streams[i].fd);
+        }
+    }
+    if (code != 150 && code != 125)
+    {
+        return -1;
+    }
+
+    code = read_reply(c, reply, sizeof(reply));
+    return !failed && code == 226 && (upload > 0 || eod_expected == count) ? 0 : -1;
+}
+
+// LIST, RETR or STOR over a fresh data connection; upload is the byte count for STOR
+static int transfer(Client *c, const char *cmd, const char *path, size_t upload, uint64_t *bytes)
+{
+    char reply[REPLY_LINE_MAX];
+    if (c->cfg->mode_e)
+    {
+        return transfer_blocks(c, cmd, path, upload, bytes);
+    }
+    int data = open_data(c);
+    if (data < 0)
+    {
+        return -1;
+    }
+
+    int code = path != NULL ? command(c, reply, sizeof(reply), "%s %s", cmd, path) : command(c, reply, sizeof(reply), "%s", cmd);
+    if (code != 150 && code != 125)
+    {
+        close(data);
+        return -1;
+    }
+
+    int failed = 0;
+    if (upload > 0)
+    {
+        for (size_t left = upload; left > 0 && !failed;)
+        {
+            size_t chunk = left < sizeof(upload_buffer) ? left : sizeof(upload_buffer);
+            failed = send_all(data, upload_buffer, chunk) < 0;
+            left -= chunk;
+        }
+        *bytes += failed ? 0 : upload;
+    }
+    else
+    {
+        char buffer[64 * 1024];
+        ssize_t n;
+        while ((n = recv(data, buffer, sizeof(buffer), 0)) != 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                failed = 1;
+                break;
+            }
+            *bytes += n;
+        }
+    }
+    close(data);
+
+    code = read_reply(c, reply, sizeof(reply));
+    return !failed && code == 226 ? 0 : -1;
+}
+
+static int run_op(Client *c, OpKind op, uint64_t *bytes)
+{
+    char reply[REPLY_LINE_MAX];
+    char path[64];
+    int file = c->cfg->files > 0 ? (int)(next_random(c) % (uint64_t)c->cfg->files) : 0;
+    switch (op)
+    {
+    case OP_LIST:
+        return transfer(c, "LIST", "/lg", 0, bytes);
+    case OP_RETR:
+        snprintf(path, sizeof(path), "/lg/f%d", file);
+        return transfer(c, "RETR", path, 0, bytes);
+    case OP_STOR:
+        snprintf(path, sizeof(path), "/lg/up/s%d-%u", c->id, c->stor_seq++ % STOR_NAMES);
+        return transfer(c, "STOR", path, c->cfg->file_size, bytes);
+    case OP_SIZE:
+        return command(c, reply, sizeof(reply), "SIZE /lg/f%d", file) == 213 ? 0 : -1;
+    case OP_CWD:
+        c->in_lg = !c->in_lg;
+        return command(c, reply, sizeof(reply), "CWD %s", c->in_lg ? "/lg" : "/") == 250 ? 0 : -1;
+    default:
+        return -1;
+    }
+}
+
+static OpKind pick_op(Client *c)
+{
+    int total = 0;
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        total += c->cfg->weights[i];
+    }
+    int roll = (int)(next_random(c) % (uint64_t)total);
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        roll -= c->cfg->weights[i];
+        if (roll < 0)
+        {
+            return i;
+        }
+    }
+    return OP_SIZE;
+}
+
+static void *client_main(void *arg)
+{
+    Client *c = arg;
+    c->ctrl = -1;
+    while (now_ns() < measure_end_ns)
+    {
+        if (c->ctrl < 0 && session_open(c) < 0)
+        {
+            // Server unreachable or refusing logins; back off instead of spinning
+            usleep(10000);
+            continue;
+        }
+
+        OpKind op = pick_op(c);
+        uint64_t bytes = 0;
+        uint64_t start = now_ns();
+        int rc = run_op(c, op, &bytes);
+        uint64_t end = now_ns();
+        if (start >= measure_start_ns && end <= measure_end_ns)
+        {
+            OpStats *stats = &c->stats[op];
+            stats->ops++;
+            stats->bytes += bytes;
+            if (rc < 0)
+            {
+                stats->errors++;
+            }
+            histogram_record(&stats->latency_ns, end - start);
+        }
+        if (rc < 0)
+        {
+            // The reply stream may be out of step after a failure; start over
+            session_close(c);
+        }
+    }
+    session_close(c);
+    return NULL;
+}
+
+// Creates /lg/f0../lg/fN-1 of file_size bytes, skipping files already the right size
+static int setup(const Config *cfg)
+{
+    Client c;
+    memset(&c, 0, sizeof(c));
+    c.cfg = cfg;
+    c.ctrl = -1;
+    if (session_open(&c) < 0)
+    {
+        fprintf(stderr, "loadgen: cannot log in to %s:%d\n", cfg->host, cfg->port);
+        return -1;
+    }
+
+    char reply[REPLY_LINE_MAX];
+    command(&c, reply, sizeof(reply), "MKD /lg");
+    command(&c, reply, sizeof(reply), "MKD /lg/up");
+    for (int i = 0; i < cfg->files; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/lg/f%d", i);
+        if (command(&c, reply, sizeof(reply), "SIZE %s", path) == 213 && strtoull(reply + 4, NULL, 10) == cfg->file_size)
+        {
+            continue;
+        }
+        uint64_t bytes = 0;
+        if (transfer(&c, "STOR", path, cfg->file_size, &bytes) < 0)
+        {
+            fprintf(stderr, "loadgen: setup upload of %s failed\n", path);
+            session_close(&c);
+            return -1;
+        }
+    }
+    command(&c, reply, sizeof(reply), "QUIT");
+    session_close(&c);
+    return 0;
+}
+
+static size_t parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        value *= 1024;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1024 * 1024;
+        break;
+    case 'g':
+    case 'G':
+        value *= 1024.0 * 1024 * 1024;
+        break;
+    }
+    return (size_t)value;
+}
+
+// "RETR=70 SIZE=20 LIST=10"; operations not named get weight 0
+static int parse_mix(Config *cfg, const char *text)
+{
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+    memset(cfg->weights, 0, sizeof(cfg->weights));
+    char *saveptr = NULL;
+    for (char *item = strtok_r(copy, " \t,", &saveptr); item != NULL; item = strtok_r(NULL, " \t,", &saveptr))
+    {
+        char *eq = strchr(item, '=');
+        int op;
+        for (op = 0; op < OP_COUNT; op++)
+        {
+            if (eq != NULL && (size_t)(eq - item) == strlen(op_names[op]) && strncasecmp(item, op_names[op], eq - item) == 0)
+            {
+                break;
+            }
+        }
+        if (op == OP_COUNT || atoi(eq + 1) < 0)
+        {
+            fprintf(stderr, "loadgen: bad mix entry '%s'\n", item);
+            return -1;
+        }
+        cfg->weights[op] = atoi(eq + 1);
+    }
+    return 0;
+}
+
+static int set_option(Config *cfg, const char *key, const char *value)
+{
+    if (strcmp(key, "name") == 0)
+    {
+        snprintf(cfg->name, sizeof(cfg->name), "%s", value);
+    }
+    else if (strcmp(key, "host") == 0)
+    {
+        snprintf(cfg->host, sizeof(cfg->host), "%s", value);
+    }
+    else if (strcmp(key, "port") == 0)
+    {
+        cfg->port = atoi(value);
+    }
+    else if (strcmp(key, "sessions") == 0)
+    {
+        cfg->sessions = atoi(value);
+    }
+    else if (strcmp(key, "duration") == 0)
+    {
+        cfg->duration = atof(value);
+    }
+    else if (strcmp(key, "warmup") == 0)
+    {
+        cfg->warmup = atof(value);
+    }
+    else if (strcmp(key, "files") == 0)
+    {
+        cfg->files = atoi(value);
+    }
+    else if (strcmp(key, "file_size") == 0 || strcmp(key, "file-size") == 0)
+    {
+        cfg->file_size = parse_size(value);
+    }
+    else if (strcmp(key, "mix") == 0)
+    {
+        return parse_mix(cfg, value);
+    }
+    else if (strcmp(key, "passive") == 0)
+    {
+        cfg->epsv = strcasecmp(value, "epsv") == 0;
+    }
+    else if (strcmp(key, "mode") == 0)
+    {
+        cfg->mode_e = strcasecmp(value, "E") == 0;
+    }
+    else if (strcmp(key, "parallelism") == 0)
+    {
+        cfg->parallelism = atoi(value);
+    }
+    else if (strcmp(key, "seed") == 0)
+    {
+        cfg->seed = (unsigned)strtoul(value, NULL, 10);
+    }
+    else
+    {
+        fprintf(stderr, "loadgen: unknown setting '%s'\n", key);
+        return -1;
+    }
+    return 0;
+}
+
+// One "key value" per line; '#' starts a comment
+static int load_scenario(Config *cfg, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    char line[512];
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        char *hash = strchr(line, '#');
+        if (hash != NULL)
+        {
+            *hash = '\0';
+        }
+        char *key = strtok(line, " \t\r\n");
+        char *value = strtok(NULL, "\r\n");
+        if (key == NULL)
+        {
+            continue;
+        }
+        while (value != NULL && (*value == ' ' || *value == '\t'))
+        {
+            value++;
+        }
+        rc = set_option(cfg, key, value != NULL ? value : "");
+    }
+    fclose(file);
+    return rc;
+}
+
+static void write_op_json(FILE *out, const char *name, const OpStats *s, double seconds)
+{
+    fprintf(out, "\"%s\":{\"ops\":%llu,\"errors\":%llu,\"ops_per_sec\":%.1f,\"bytes\":%llu,\"mb_per_sec\":%.2f,"
+                 "\"latency_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}",
+            name, (unsigned long long)s->ops, (unsigned long long)s->errors, s->ops / seconds,
+            (unsigned long long)s->bytes, s->bytes / seconds / 1e6,
+            histogram_percentile(&s->latency_ns, 0.5) / 1e6, histogram_percentile(&s->latency_ns, 0.9) / 1e6,
+            histogram_percentile(&s->latency_ns, 0.99) / 1e6, histogram_percentile(&s->latency_ns, 0.999) / 1e6,
+            s->latency_ns.max / 1e6);
+}
+
+static void write_json(FILE *out, const Config *cfg, const OpStats *ops, const OpStats *total)
+{
+    fprintf(out, "{\"scenario\":\"%s\",\"host\":\"%s\",\"port\":%d,\"sessions\":%d,\"duration_s\":%.1f,\"warmup_s\":%.1f,"
+                 "\"files\":%d,\"file_size\":%zu,\"passive\":\"%s\",\"mode\":\"%s\",\"parallelism\":%d,\"seed\":%u,\"ops\":{",
+            cfg->name, cfg->host, cfg->port, cfg->sessions, cfg->duration, cfg->warmup, cfg->files, cfg->file_size,
+            cfg->epsv ? "epsv" : "pasv", cfg->mode_e ? "E" : "S", cfg->mode_e ? cfg->parallelism : 1, cfg->seed);
+    int first = 1;
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        if (cfg->weights[i] > 0)
+        {
+            fprintf(out, first ? "" : ",");
+            write_op_json(out, op_names[i], &ops[i], cfg->duration);
+            first = 0;
+        }
+    }
+    fprintf(out, "},");
+    write_op_json(out, "total", total, cfg->duration);
+    fprintf(out, "}\n");
+}
+
+static void write_table_row(const char *name, const OpStats *s, double seconds)
+{
+    printf("%-6s %10llu %8llu %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f %9.3f\n", name, (unsigned long long)s->ops,
+           (unsigned long long)s->errors, s->ops / seconds, s->bytes / seconds / 1e6,
+           histogram_percentile(&s->latency_ns, 0.5) / 1e6, histogram_percentile(&s->latency_ns, 0.9) / 1e6,
+           histogram_percentile(&s->latency_ns, 0.99) / 1e6, histogram_percentile(&s->latency_ns, 0.999) / 1e6,
+           s->latency_ns.max / 1e6);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: loadgen [-scenario file] [-host addr] [-port n] [-sessions n] [-duration s] [-warmup s]\n"
+            "               [-files n] [-file-size bytes[K|M|G]] [-mix \"RETR=70,SIZE=30\"] [-epsv] [-seed n]\n"
+            "               [-mode S|E] [-parallelism n]\n"
+            "               [-no-setup] [-json file|-]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    Config cfg = {
+        .name = "custom",
+        .host = "127.0.0.1",
+        .port = 21,
+        .sessions = 16,
+        .duration = 10,
+        .warmup = 1,
+        .files = 100,
+        .file_size = 64 * 1024,
+        .weights = {[OP_LIST] = 10, [OP_RETR] = 50, [OP_STOR] = 10, [OP_SIZE] = 20, [OP_CWD] = 10},
+        .parallelism = 1,
+        .seed = 1,
+    };
+
+    // Options apply in order, so anything after -scenario overrides the file
+    for (int i = 1; i < argc; i++)
+    {
+        int rc = 0;
+        if (strcmp(argv[i], "-epsv") == 0)
+        {
+            cfg.epsv = 1;
+        }
+        else if (strcmp(argv[i], "-no-setup") == 0)
+        {
+            cfg.skip_setup = 1;
+        }
+        else if (argv[i][0] != '-' || i + 1 >= argc)
+        {
+            rc = -1;
+        }
+        else if (strcmp(argv[i], "-scenario") == 0)
+        {
+            rc = load_scenario(&cfg, argv[++i]);
+        }
+        else if (strcmp(argv[i], "-json") == 0)
+        {
+            cfg.json_path = argv[++i];
+        }
+        else
+        {
+            rc = set_option(&cfg, argv[i] + 1, argv[i + 1]);
+            i++;
+        }
+        if (rc < 0)
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    int weight_total = 0;
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        weight_total += cfg.weights[i];
+    }
+    if (cfg.sessions <= 0 || cfg.duration <= 0 || weight_total <= 0 ||
+        ((cfg.weights[OP_RETR] > 0 || cfg.weights[OP_SIZE] > 0) && cfg.files <= 0))
+    {
+        fprintf(stderr, "loadgen: need sessions > 0, duration > 0, a non-empty mix and files > 0 for RETR/SIZE\n");
+        return 2;
+    }
+    if (cfg.parallelism < 1 || cfg.parallelism > MAX_PARALLELISM)
+    {
+        fprintf(stderr, "loadgen: parallelism must be 1 to %d\n", MAX_PARALLELISM);
+        return 2;
+    }
+
+    for (size_t i = 0; i < sizeof(upload_buffer); i++)
+    {
+        upload_buffer[i] = (char)(i * 131 + 7);
+    }
+    if (!cfg.skip_setup && setup(&cfg) < 0)
+    {
+        return 1;
+    }
+
+    Client *clients = calloc(cfg.sessions, sizeof(Client));
+    if (clients == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+    measure_start_ns = now_ns() + (uint64_t)(cfg.warmup * 1e9);
+    measure_end_ns = measure_start_ns + (uint64_t)(cfg.duration * 1e9);
+    for (int i = 0; i < cfg.sessions; i++)
+    {
+        clients[i].id = i;
+        clients[i].cfg = &cfg;
+        clients[i].rng = ((uint64_t)cfg.seed << 32) ^ (uint64_t)(i + 1) * 0x9E3779B97F4A7C15ull;
+        if (pthread_create(&clients[i].thread, NULL, client_main, &clients[i]) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    OpStats *ops = calloc(OP_COUNT + 1, sizeof(OpStats));
+    if (ops == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+    OpStats *total = &ops[OP_COUNT];
+    for (int i = 0; i < cfg.sessions; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        for (int op = 0; op < OP_COUNT; op++)
+        {
+            const OpStats *s = &clients[i].stats[op];
+            ops[op].ops += s->ops;
+            ops[op].errors += s->errors;
+            ops[op].bytes += s->bytes;
+            histogram_merge(&ops[op].latency_ns, &s->latency_ns);
+            total->ops += s->ops;
+            total->errors += s->errors;
+            total->bytes += s->bytes;
+            histogram_merge(&total->latency_ns, &s->latency_ns);
+        }
+    }
+
+    if (cfg.json_path != NULL)
+    {
+        FILE *out = strcmp(cfg.json_path, "-") == 0 ? stdout : fopen(cfg.json_path, "w");
+        if (out == NULL)
+        {
+            perror(cfg.json_path);
+            return 1;
+        }
+        write_json(out, &cfg, ops, total);
+        if (out != stdout)
+        {
+            fclose(out);
+        }
+    }
+    if (cfg.json_path == NULL || strcmp(cfg.json_path, "-") != 0)
+    {
+        printf("scenario %s: %d sessions, %.1f s measured after %.1f s warmup, %s, %d files of %zu bytes", cfg.name,
+               cfg.sessions, cfg.duration, cfg.warmup, cfg.epsv ? "EPSV" : "PASV", cfg.files, cfg.file_size);
+        if (cfg.mode_e)
+        {
+            printf(", MODE E over %d connections", cfg.parallelism);
+        }
+        printf("\n");
+        printf("%-6s %10s %8s %10s %9s %9s %9s %9s %9s %9s\n", "op", "ops", "errors", "ops/s", "MB/s", "p50 ms",
+               "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+        for (int i = 0; i < OP_COUNT; i++)
+        {
+            if (cfg.weights[i] > 0)
+            {
+                write_table_row(op_names[i], &ops[i], cfg.duration);
+            }
+        }
+        write_table_row("total", total, cfg.duration);
+    }
+
+    int failed = total->errors > 0;
+    free(ops);
+    free(clients);
+    return failed;
+}
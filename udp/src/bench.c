@@ -0,0 +1,333 @@
+#define _GNU_SOURCE     /* recvmmsg, sendmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>     /* defines STDIN_FILENO, system calls,etc */
+#include <pthread.h>
+#include <sys/types.h>  /* system data type definitions */
+#include <sys/socket.h> /* socket specific definitions */
+#include <netinet/in.h> /* INET constants and stuff */
+#include <arpa/inet.h>  /* IP address conversion stuff */
+#include <netdb.h>      /* gethostbyname */
+#include "hist.h"
+
+/* Benchmark client for the echo server (server.c).
+
+   Build: gcc -O2 -pthread -o bench bench.c
+   Usage: bench [-s host] [-p port] [-t threads] [-w window] [-l bytes]
+                [-r packets/s] [-d seconds] [-T timeout ms] [-H]
+     -t  sending threads, each with its own socket (default 1)
+     -w  datagrams each thread keeps in flight (default 64)
+     -l  datagram size, at least the 24 byte header (default 64)
+     -r  total send rate; 0 sends as fast as the window allows (default 0)
+     -d  how long to send (default 5)
+     -T  a datagram not echoed within this long is lost (default 1000)
+     -H  print the whole RTT histogram, not just the percentiles
+
+   Unlike client.c, which waits for each reply before sending the next
+   datagram, every thread keeps up to a window of datagrams in flight and
+   moves them with sendmmsg()/recvmmsg(). Each datagram carries its thread,
+   its sequence number and its send time, so the RTT comes from the echo
+   itself and nothing has to be looked up per packet. A datagram counts as
+   reordered when one sent after it was echoed first, as a duplicate when it
+   is echoed twice, and as late when its echo comes after it was declared
+   lost. A datagram so old that its ring slot was reused can no longer be
+   told apart and counts as late. */
+
+#define DEFAULT_PORT 9876
+#define MAXBUF 65536
+#define MAX_DATAGRAM 65507
+#define BATCH 64
+#define RING (1 << 18)                 /* sequence numbers tracked per thread */
+#define BENCH_MAGIC 0x42454e43         /* "BENC" */
+
+struct bench_msg {
+  uint32_t magic;
+  uint32_t thread;
+  uint64_t seq;
+  uint64_t sent_ns;
+};
+
+enum { SLOT_FREE, SLOT_SENT, SLOT_DONE, SLOT_LOST };
+
+struct worker {
+  int id;
+  int sk;
+  pthread_t thread;
+  unsigned long long sent, received;    /* read by the once a second report */
+  unsigned long long lost, duplicates, reordered, late;
+  struct histogram rtt;
+
+  unsigned char *slot;                  /* SLOT_* per seq % RING, kept after retiring */
+  uint64_t *slot_sent_ns;
+  uint64_t next_seq;                    /* next to send */
+  uint64_t oldest;                      /* every seq below is echoed or lost */
+  uint64_t highest;                     /* highest seq echoed so far, plus one */
+  uint32_t inflight;
+};
+
+static struct sockaddr_in server;
+static int window = 64;
+static size_t length = 64;
+static double rate_per_thread;          /* 0: unlimited */
+static uint64_t duration_ns = 5000000000ull;
+static uint64_t timeout_ns = 1000000000ull;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void receive_one(struct worker *w, const char *buf, size_t len, uint64_t now) {
+  /* the echo is "<sequence number> " and then the datagram as sent */
+  const char *space = memchr(buf, ' ', len);
+  if (space == NULL) return;
+  size_t offset = space + 1 - buf;
+  struct bench_msg m;
+  if (len - offset < sizeof(m)) return;
+  memcpy(&m, buf + offset, sizeof(m));
+  if (m.magic != BENCH_MAGIC || m.thread != (uint32_t) w->id || m.seq >= w->next_seq) return;
+
+  unsigned char *state = &w->slot[m.seq % RING];
+  if (m.seq < w->oldest) {
+    /* retired: the slot still says whether it was echoed or lost, until the
+       datagram RING later takes it over */
+    int remembered = m.seq + RING >= w->next_seq;
+    if (remembered && *state == SLOT_DONE) {
+      w->duplicates++;
+      return;
+    }
+    w->late++;
+    if (remembered) *state = SLOT_DONE;
+    return;
+  }
+  if (*state == SLOT_DONE) {
+    w->duplicates++;
+    return;
+  }
+  *state = SLOT_DONE;
+  w->inflight--;
+  __atomic_add_fetch(&w->received, 1, __ATOMIC_RELAXED);
+  hist_add(&w->rtt, now - m.sent_ns);
+  if (m.seq + 1 < w->highest) w->reordered++;
+  else w->highest = m.seq + 1;
+}
+
+/* Moves past the echoed datagrams and those whose time is up */
+static void retire(struct worker *w, uint64_t now, int all) {
+  while (w->oldest < w->next_seq) {
+    uint64_t i = w->oldest % RING;
+    if (w->slot[i] == SLOT_SENT) {
+      if (!all && now - w->slot_sent_ns[i] < timeout_ns) break;
+      w->lost++;
+      w->inflight--;
+      w->slot[i] = SLOT_LOST;
+    }
+    w->oldest++;
+  }
+}
+
+static int receive_batch(struct worker *w, struct mmsghdr *msg, struct iovec *iov) {
+  int n = recvmmsg(w->sk, msg, BATCH, MSG_DONTWAIT, NULL);
+  if (n <= 0) return 0;
+  uint64_t now = now_ns();
+  for (int i = 0; i < n; i++) receive_one(w, iov[i].iov_base, msg[i].msg_len, now);
+  return n;
+}
+
+static void *worker_main(void *arg) {
+  struct worker *w = arg;
+  char *bufin = malloc((size_t) BATCH * MAXBUF);
+  char *bufout = calloc(BATCH, length);
+  if (bufin == NULL || bufout == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  struct iovec iov_in[BATCH], iov_out[BATCH];
+  struct mmsghdr msg_in[BATCH], msg_out[BATCH];
+  for (int i = 0; i < BATCH; i++) {
+    iov_in[i] = (struct iovec) { bufin + (size_t) i * MAXBUF, MAXBUF };
+    msg_in[i].msg_hdr = (struct msghdr) { .msg_iov = &iov_in[i], .msg_iovlen = 1 };
+    iov_out[i] = (struct iovec) { bufout + (size_t) i * length, length };
+    msg_out[i].msg_hdr = (struct msghdr) { .msg_iov = &iov_out[i], .msg_iovlen = 1 };
+  }
+
+  uint64_t start = now_ns(), end = start + duration_ns;
+  struct bench_msg m = { .magic = BENCH_MAGIC, .thread = w->id };
+  while (1) {
+    uint64_t now = now_ns();
+    if (now >= end) break;
+    retire(w, now, 0);
+
+    /* as many as the window, the rate and the ring allow */
+    uint64_t allowed = window - w->inflight;
+    if (rate_per_thread > 0) {
+      uint64_t due = (now - start) / 1e9 * rate_per_thread;
+      allowed = due > w->next_seq ? (due - w->next_seq < allowed ? due - w->next_seq : allowed) : 0;
+    }
+    if (w->next_seq + allowed - w->oldest > RING) allowed = RING - (w->next_seq - w->oldest);
+    int n = allowed < BATCH ? allowed : BATCH;
+    for (int i = 0; i < n; i++) {
+      m.seq = w->next_seq + i;
+      m.sent_ns = now;
+      memcpy(iov_out[i].iov_base, &m, sizeof(m));
+      w->slot[m.seq % RING] = SLOT_SENT;
+      w->slot_sent_ns[m.seq % RING] = now;
+    }
+    int sent = n > 0 ? sendmmsg(w->sk, msg_out, n, 0) : 0;
+    if (sent < 0) {
+      if (errno != EINTR && errno != ENOBUFS && errno != ECONNREFUSED) {
+        perror("sendmmsg");
+        exit(1);
+      }
+      sent = 0;
+    }
+    /* datagrams sendmmsg() did not take are simply sent again next time */
+    for (int i = sent; i < n; i++) w->slot[(w->next_seq + i) % RING] = SLOT_FREE;
+    w->next_seq += sent;
+    w->inflight += sent;
+    __atomic_add_fetch(&w->sent, sent, __ATOMIC_RELAXED);
+
+    int got = receive_batch(w, msg_in, iov_in);
+    if (got == 0 && (sent == 0 || w->inflight >= (uint32_t) window)) {
+      /* nothing to do until an echo arrives or the rate allows the next send */
+      struct pollfd pfd = { w->sk, POLLIN, 0 };
+      poll(&pfd, 1, 1);
+    }
+  }
+
+  /* collect the stragglers, then write off what is still missing */
+  uint64_t drain_end = now_ns() + timeout_ns;
+  while (w->inflight > 0 && now_ns() < drain_end) {
+    struct pollfd pfd = { w->sk, POLLIN, 0 };
+    if (poll(&pfd, 1, 10) > 0) receive_batch(w, msg_in, iov_in);
+  }
+  retire(w, now_ns(), 1);
+  free(bufin);
+  free(bufout);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  const char *host = "localhost";
+  int port = DEFAULT_PORT;
+  int threads = 1;
+  double rate = 0;
+  int full_histogram = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:p:t:w:l:r:d:T:H")) != -1) {
+    switch (opt) {
+    case 's': host = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'w': window = atoi(optarg); break;
+    case 'l': length = atoi(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'd': duration_ns = atof(optarg) * 1e9; break;
+    case 'T': timeout_ns = atof(optarg) * 1e6; break;
+    case 'H': full_histogram = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-s host] [-p port] [-t threads] [-w window] [-l bytes] [-r packets/s] "
+              "[-d seconds] [-T timeout ms] [-H]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (threads < 1 || window < 1 || window > RING / 2) {
+    fprintf(stderr, "Need at least one thread and a window between 1 and %d\n", RING / 2);
+    exit(1);
+  }
+  if (length < sizeof(struct bench_msg)) length = sizeof(struct bench_msg);
+  if (length > MAX_DATAGRAM) length = MAX_DATAGRAM;
+  rate_per_thread = rate / threads;
+
+  struct hostent *hp = gethostbyname(host);
+  if (hp == NULL) {
+    fprintf(stderr, "Unknown host %s\n", host);
+    exit(1);
+  }
+  server.sin_family = AF_INET;
+  memcpy(&server.sin_addr.s_addr, hp->h_addr, hp->h_length);
+  server.sin_port = htons(port);
+
+  struct worker *workers = calloc(threads, sizeof(struct worker));
+  if (workers == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (int i = 0; i < threads; i++) {
+    struct worker *w = &workers[i];
+    w->id = i;
+    hist_init(&w->rtt);
+    w->slot = calloc(RING, 1);
+    w->slot_sent_ns = calloc(RING, sizeof(uint64_t));
+    /* a socket per thread gives each its own port, and so its own server shard */
+    if (w->slot == NULL || w->slot_sent_ns == NULL || (w->sk = socket(PF_INET, SOCK_DGRAM, 0)) < 0 ||
+        connect(w->sk, (struct sockaddr *) &server, sizeof(server)) < 0) {
+      perror("Problem setting up a sender");
+      exit(1);
+    }
+    int bufsize = 4 * 1024 * 1024;
+    setsockopt(w->sk, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(w->sk, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+  }
+
+  printf("%d threads, window %d, %zu byte datagrams, %s for %.1f s\n", threads, window, length,
+         rate > 0 ? "rate limited" : "unlimited rate", duration_ns / 1e9);
+  fflush(stdout);
+  uint64_t start = now_ns();
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  /* progress once a second while the threads send */
+  unsigned long long last_sent = 0, last_received = 0;
+  for (uint64_t second = 1; second * 1000000000 <= duration_ns; second++) {
+    uint64_t wake = start + second * 1000000000, now = now_ns();
+    if (wake > now) {
+      struct timespec pause = { (wake - now) / 1000000000, (wake - now) % 1000000000 };
+      nanosleep(&pause, NULL);
+    }
+    unsigned long long sent = 0, received = 0;
+    for (int i = 0; i < threads; i++) {
+      sent += __atomic_load_n(&workers[i].sent, __ATOMIC_RELAXED);
+      received += __atomic_load_n(&workers[i].received, __ATOMIC_RELAXED);
+    }
+    printf("%llu sent/s, %llu received/s\n", sent - last_sent, received - last_received);
+    fflush(stdout);
+    last_sent = sent;
+    last_received = received;
+  }
+
+  struct worker total;
+  memset(&total, 0, sizeof(total));
+  hist_init(&total.rtt);
+  for (int i = 0; i < threads; i++) {
+    struct worker *w = &workers[i];
+    pthread_join(w->thread, NULL);
+    total.sent += w->sent;
+    total.received += w->received;
+    total.lost += w->lost;
+    total.duplicates += w->duplicates;
+    total.reordered += w->reordered;
+    total.late += w->late;
+    hist_merge(&total.rtt, &w->rtt);
+    close(w->sk);
+  }
+
+  double seconds = duration_ns / 1e9;
+  printf("sent %llu (%.0f/s), received %llu (%.0f/s, %.1f Mbit/s of payload)\n", total.sent, total.sent / seconds,
+         total.received, total.received / seconds, total.received * length * 8 / seconds / 1e6);
+  printf("lost %llu (%.3f%%), reordered %llu, duplicates %llu, late %llu\n", total.lost,
+         total.sent ? 100.0 * total.lost / total.sent : 0.0, total.reordered, total.duplicates, total.late);
+  hist_summary(stdout, "RTT", &total.rtt, 1000, "us");
+  if (full_histogram) hist_print(stdout, &total.rtt, 1000, "us");
+  return 0;
+}
@@ -54,13 +54,14 @@ int main() {
 
     char response[MAXBUF];
 
-    int n_read = recvfrom(sk, response, MAXBUF, 0, NULL, NULL);
+    /* leave room for the terminator */
+    int n_read = recvfrom(sk, response, MAXBUF - 1, 0, NULL, NULL);
     if (n_read < 0) {
       perror("Problem in recvfrom");
       exit(1);
     }
 
-    // response[n_read] = '\0'; // Null-terminate the received string
+    response[n_read] = '\0'; // Null-terminate the received string
     printf("Received: %s\n", response);
   }
 
@@ -0,0 +1,99 @@
+#ifndef HIST_H
+#define HIST_H
+
+/* Latency histogram shared by the load and benchmark clients.
+
+   Values below 16 get a bucket each; above that every power of two is split
+   into 16 buckets, so a bucket is never wider than 1/16 of its value and any
+   percentile is reported within about 6%. Recording is one count, no
+   allocation, and per-thread histograms are merged by adding the counts. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB 16
+#define HIST_BUCKETS (61 * HIST_SUB)
+
+struct histogram {
+  unsigned long long counts[HIST_BUCKETS];
+  unsigned long long total;
+  uint64_t min, max;
+  double sum;
+};
+
+static inline void hist_init(struct histogram *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+static inline int hist_bucket(uint64_t v) {
+  if (v < HIST_SUB) return v;
+  int msb = 63 - __builtin_clzll(v);
+  return (msb - 3) * HIST_SUB + ((v >> (msb - 4)) & (HIST_SUB - 1));
+}
+
+/* Smallest value that falls into bucket b */
+static inline uint64_t hist_bucket_low(int b) {
+  if (b < HIST_SUB) return b;
+  int msb = b / HIST_SUB + 3;
+  return (uint64_t) (HIST_SUB + b % HIST_SUB) << (msb - 4);
+}
+
+static inline void hist_add(struct histogram *h, uint64_t v) {
+  h->counts[hist_bucket(v)]++;
+  h->total++;
+  h->sum += v;
+  if (v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+}
+
+static inline void hist_merge(struct histogram *into, const struct histogram *from) {
+  for (int b = 0; b < HIST_BUCKETS; b++) into->counts[b] += from->counts[b];
+  into->total += from->total;
+  into->sum += from->sum;
+  if (from->min < into->min) into->min = from->min;
+  if (from->max > into->max) into->max = from->max;
+}
+
+/* Value at percentile p (0-100), reported as the top of its bucket */
+static inline uint64_t hist_percentile(const struct histogram *h, double p) {
+  if (h->total == 0) return 0;
+  unsigned long long rank = (unsigned long long) (p / 100.0 * h->total + 0.5);
+  if (rank < 1) rank = 1;
+  unsigned long long seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->counts[b];
+    if (seen >= rank) {
+      uint64_t top = b + 1 < HIST_BUCKETS ? hist_bucket_low(b + 1) - 1 : UINT64_MAX;
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
+
+/* One summary line; values are divided by scale for printing (1000 for ns in us) */
+static inline void hist_summary(FILE *out, const char *label, const struct histogram *h, double scale, const char *unit) {
+  if (h->total == 0) {
+    fprintf(out, "%s: no samples\n", label);
+    return;
+  }
+  fprintf(out, "%s (%s): min %.1f  avg %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  (%llu samples)\n",
+          label, unit, h->min / scale, h->sum / h->total / scale, hist_percentile(h, 50) / scale,
+          hist_percentile(h, 90) / scale, hist_percentile(h, 99) / scale, hist_percentile(h, 99.9) / scale,
+          h->max / scale, h->total);
+}
+
+/* Every non-empty bucket with its share and a bar, for the full distribution */
+static inline void hist_print(FILE *out, const struct histogram *h, double scale, const char *unit) {
+  unsigned long long peak = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) if (h->counts[b] > peak) peak = h->counts[b];
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    if (h->counts[b] == 0) continue;
+    int bar = (int) (h->counts[b] * 50 / peak);
+    fprintf(out, "  >= %10.1f %s %10llu %6.2f%% %.*s\n", hist_bucket_low(b) / scale, unit, h->counts[b],
+            100.0 * h->counts[b] / h->total, bar > 0 ? bar : 1, "##################################################");
+  }
+}
+
+#endif /* HIST_H */
@@ -0,0 +1,489 @@
+#define _GNU_SOURCE     /* recvmmsg, sendmmsg, ppoll */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>     /* defines STDIN_FILENO, system calls,etc */
+#include <sys/types.h>  /* system data type definitions */
+#include <sys/socket.h> /* socket specific definitions */
+#include <netinet/in.h> /* INET constants and stuff */
+#include <arpa/inet.h>  /* IP address conversion stuff */
+
+/* Chat relay: a datagram from a peer goes to every other peer in its room,
+   prefixed with "<ip:port> " of the sender.
+
+   Build: gcc -O2 -o relay relay.c
+   Usage: relay [-p port] [-n max peers] [-i idle seconds] [-r]
+     -i  forget peers that have sent nothing for this long (default 30)
+     -r  print the message and delivery rates once a second
+
+   Datagrams starting with '/' are commands, answered with a line starting
+   with "* ":
+     /join <room>   enter a room, leaving the current one
+     /leave         leave the room and the server
+     /ping          just keep the peer alive (any datagram does)
+
+   Peers live in a hash table keyed by address and port, so the lookup for an
+   incoming datagram is one hash and a short chain. A room keeps an array of
+   its members; fan-out queues one message per member with its own copy of
+   the destination address and of the sender's prefix, which peer_add()
+   formats once, so a /leave or /join later in the same batch cannot redirect
+   or rewrite a queued message. The payload is the datagram as it arrived, and
+   the queue goes to the kernel with sendmmsg() up to FANOUT at a time.
+
+   Idle peers expire through a timer wheel of WHEEL_SLOTS one-second slots. A
+   peer sits in the slot its expiry falls into and is not moved when it sends
+   something; when its slot comes up, it is either expired or moved to the
+   slot of its new expiry. Traffic therefore costs nothing beyond a store of
+   the current tick, and each second only the peers of one slot are looked at.
+
+   Everything runs on one thread: rooms span all peers, and a relay spends its
+   time in sendmmsg(), not in the lookups. */
+
+#define DEFAULT_PORT 9877
+#define MAXBUF 65536
+#define MAX_DATAGRAM 65507 /* largest UDP payload over IPv4 */
+#define BATCH 64
+#define FANOUT 1024
+#define ROOM_NAME_MAX 32
+#define WHEEL_SLOTS 64
+#define NIL UINT32_MAX
+
+struct peer {
+  struct sockaddr_in addr;
+  uint32_t next;                        /* hash chain, or free list */
+  uint32_t room;
+  uint32_t room_pos;                    /* index in room->members */
+  uint32_t wheel_prev, wheel_next;
+  uint32_t wheel_slot;
+  uint32_t last_seen;                   /* tick */
+  char tag[24];                         /* "<ip:port> " */
+  uint8_t tag_len;
+};
+
+struct room {
+  char name[ROOM_NAME_MAX + 1];
+  uint32_t next;                        /* hash chain, or free list */
+  uint32_t *members;
+  uint32_t count, cap;
+};
+
+static struct peer *peers;
+static uint32_t *peer_buckets;
+static uint32_t peer_mask, peer_free, peer_count;
+
+static struct room *rooms;
+static uint32_t *room_buckets;
+static uint32_t room_mask, room_free, room_count;
+
+static uint32_t wheel[WHEEL_SLOTS];
+static uint32_t tick;
+static uint32_t idle_ticks = 30;
+
+static int sd;
+static struct mmsghdr out_msg[FANOUT];
+static struct iovec out_iov[FANOUT][2];
+/* Each queued message keeps its own copy of the destination and prefix: a
+   /leave and /join later in the same batch can recycle the peer slot they
+   came from before flush() runs */
+static struct sockaddr_in out_addr[FANOUT];
+static char out_prefix[FANOUT][80];     /* sender tag, or the whole reply to a command */
+static int out_count;
+static unsigned long long messages, deliveries, send_errors;
+
+static uint32_t peer_hash(const struct sockaddr_in *a) {
+  uint64_t key = (uint64_t) a->sin_addr.s_addr << 16 | a->sin_port;
+  return (key * 0x9E3779B97F4A7C15ull) >> 32 & peer_mask;
+}
+
+static uint32_t room_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;             /* FNV-1a */
+  for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char) name[i]) * 16777619u;
+  return h & room_mask;
+}
+
+static uint32_t round_up_pow2(uint32_t n) {
+  uint32_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+static int tables_init(uint32_t max_peers) {
+  uint32_t buckets = round_up_pow2(max_peers * 2);
+  peers = calloc(max_peers, sizeof(struct peer));
+  rooms = calloc(max_peers, sizeof(struct room));  /* a room has at least one peer */
+  peer_buckets = malloc(buckets * sizeof(uint32_t));
+  room_buckets = malloc(buckets * sizeof(uint32_t));
+  if (peers == NULL || rooms == NULL || peer_buckets == NULL || room_buckets == NULL) return -1;
+
+  peer_mask = room_mask = buckets - 1;
+  for (uint32_t i = 0; i < buckets; i++) peer_buckets[i] = room_buckets[i] = NIL;
+  for (uint32_t i = 0; i < max_peers; i++) {
+    peers[i].next = i + 1 < max_peers ? i + 1 : NIL;
+    rooms[i].next = i + 1 < max_peers ? i + 1 : NIL;
+  }
+  peer_free = room_free = 0;
+  for (int i = 0; i < WHEEL_SLOTS; i++) wheel[i] = NIL;
+  return 0;
+}
+
+/* timer wheel */
+
+static void wheel_insert(uint32_t id, uint32_t slot) {
+  struct peer *p = &peers[id];
+  p->wheel_slot = slot;
+  p->wheel_prev = NIL;
+  p->wheel_next = wheel[slot];
+  if (wheel[slot] != NIL) peers[wheel[slot]].wheel_prev = id;
+  wheel[slot] = id;
+}
+
+static void wheel_remove(uint32_t id) {
+  struct peer *p = &peers[id];
+  if (p->wheel_prev != NIL) peers[p->wheel_prev].wheel_next = p->wheel_next;
+  else wheel[p->wheel_slot] = p->wheel_next;
+  if (p->wheel_next != NIL) peers[p->wheel_next].wheel_prev = p->wheel_prev;
+}
+
+/* The slot of the peer's expiry, or the furthest one if that is a full turn away */
+static uint32_t wheel_slot_for(const struct peer *p) {
+  uint32_t due = p->last_seen + idle_ticks;
+  if (due - tick >= WHEEL_SLOTS) due = tick + WHEEL_SLOTS - 1;
+  return due % WHEEL_SLOTS;
+}
+
+/* rooms */
+
+static uint32_t room_find(const char *name, size_t len, int create) {
+  uint32_t b = room_hash(name, len);
+  for (uint32_t id = room_buckets[b]; id != NIL; id = rooms[id].next) {
+    if (strlen(rooms[id].name) == len && memcmp(rooms[id].name, name, len) == 0) return id;
+  }
+  if (!create || room_free == NIL) return NIL;
+
+  uint32_t id = room_free;
+  struct room *r = &rooms[id];
+  room_free = r->next;
+  memcpy(r->name, name, len);
+  r->name[len] = '\0';
+  r->count = 0;
+  r->next = room_buckets[b];
+  room_buckets[b] = id;
+  room_count++;
+  return id;
+}
+
+static void room_remove_member(uint32_t peer_id) {
+  struct peer *p = &peers[peer_id];
+  if (p->room == NIL) return;
+  struct room *r = &rooms[p->room];
+
+  /* the last member takes the leaver's place */
+  uint32_t last = r->members[--r->count];
+  r->members[p->room_pos] = last;
+  peers[last].room_pos = p->room_pos;
+
+  if (r->count == 0) {
+    uint32_t *link = &room_buckets[room_hash(r->name, strlen(r->name))];
+    while (*link != p->room) link = &rooms[*link].next;
+    *link = r->next;
+    r->next = room_free;
+    room_free = p->room;
+    room_count--;
+  }
+  p->room = NIL;
+}
+
+static int room_add_member(uint32_t room_id, uint32_t peer_id) {
+  struct room *r = &rooms[room_id];
+  if (r->count == r->cap) {
+    uint32_t cap = r->cap ? r->cap * 2 : 8;
+    uint32_t *members = realloc(r->members, cap * sizeof(uint32_t));
+    if (members == NULL) return -1;
+    r->members = members;
+    r->cap = cap;
+  }
+  peers[peer_id].room = room_id;
+  peers[peer_id].room_pos = r->count;
+  r->members[r->count++] = peer_id;
+  return 0;
+}
+
+/* peers */
+
+static uint32_t peer_find(const struct sockaddr_in *a) {
+  for (uint32_t id = peer_buckets[peer_hash(a)]; id != NIL; id = peers[id].next) {
+    if (peers[id].addr.sin_addr.s_addr == a->sin_addr.s_addr && peers[id].addr.sin_port == a->sin_port) return id;
+  }
+  return NIL;
+}
+
+static uint32_t peer_add(const struct sockaddr_in *a) {
+  if (peer_free == NIL) return NIL;
+  uint32_t id = peer_free;
+  struct peer *p = &peers[id];
+  peer_free = p->next;
+
+  p->addr = *a;
+  p->room = NIL;
+  p->last_seen = tick;
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &a->sin_addr, ip, sizeof(ip));
+  p->tag_len = snprintf(p->tag, sizeof(p->tag), "%s:%d ", ip, ntohs(a->sin_port));
+
+  uint32_t b = peer_hash(a);
+  p->next = peer_buckets[b];
+  peer_buckets[b] = id;
+  wheel_insert(id, wheel_slot_for(p));
+  peer_count++;
+  return id;
+}
+
+static void peer_remove(uint32_t id) {
+  struct peer *p = &peers[id];
+  room_remove_member(id);
+  wheel_remove(id);
+
+  uint32_t *link = &peer_buckets[peer_hash(&p->addr)];
+  while (*link != id) link = &peers[*link].next;
+  *link = p->next;
+  p->next = peer_free;
+  peer_free = id;
+  peer_count--;
+}
+
+/* outgoing queue */
+
+static void flush(void) {
+  int sent = 0;
+  while (sent < out_count) {
+    int r = sendmmsg(sd, out_msg + sent, out_count - sent, 0);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      /* one bad destination must not hold up the rest */
+      send_errors++;
+      sent++;
+      continue;
+    }
+    sent += r;
+  }
+  out_count = 0;
+}
+
+static void queue(const struct sockaddr_in *to, const void *prefix, size_t prefix_len, const void *body, size_t body_len) {
+  if (out_count == FANOUT) flush();
+  if (prefix_len > sizeof(out_prefix[0])) prefix_len = sizeof(out_prefix[0]);
+  out_addr[out_count] = *to;
+  memcpy(out_prefix[out_count], prefix, prefix_len);
+  out_iov[out_count][0] = (struct iovec) { out_prefix[out_count], prefix_len };
+  out_iov[out_count][1] = (struct iovec) { (void *) body, body_len };
+  out_msg[out_count].msg_hdr = (struct msghdr) {
+    .msg_name = &out_addr[out_count],
+    .msg_namelen = sizeof(out_addr[0]),
+    .msg_iov = out_iov[out_count],
+    .msg_iovlen = 2,
+  };
+  out_count++;
+}
+
+static void reply(const struct sockaddr_in *to, const char *format, ...) {
+  char note[sizeof(out_prefix[0])];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(note, sizeof(note), format, args);
+  va_end(args);
+  queue(to, note, len < (int) sizeof(note) ? len : (int) sizeof(note) - 1, NULL, 0);
+}
+
+static int is_command(const char *buf, size_t len, const char *command) {
+  size_t n = strlen(command);
+  return len >= n && memcmp(buf, command, n) == 0 && (len == n || buf[n] == ' ' || buf[n] == '\r' || buf[n] == '\n');
+}
+
+static void handle_command(struct sockaddr_in *from, uint32_t id, char *buf, size_t len) {
+  /* netcat and friends end lines with a newline */
+  while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) len--;
+
+  if (is_command(buf, len, "/join")) {
+    char *name = buf + 5;
+    size_t name_len = len - 5;
+    while (name_len > 0 && *name == ' ') {
+      name++;
+      name_len--;
+    }
+    if (name_len == 0 || name_len > ROOM_NAME_MAX) {
+      reply(from, "* usage: /join <room>, at most %d characters", ROOM_NAME_MAX);
+      return;
+    }
+    if (id == NIL && (id = peer_add(from)) == NIL) {
+      reply(from, "* server full");
+      return;
+    }
+    room_remove_member(id);
+    uint32_t room = room_find(name, name_len, 1);
+    if (room == NIL || room_add_member(room, id) < 0) {
+      peer_remove(id);
+      reply(from, "* server full");
+      return;
+    }
+    reply(from, "* joined %s, %u peers", rooms[room].name, rooms[room].count);
+  } else if (is_command(buf, len, "/leave")) {
+    if (id != NIL) peer_remove(id);
+    reply(from, "* left");
+  } else if (is_command(buf, len, "/ping")) {
+    reply(from, "* pong");
+  } else {
+    reply(from, "* unknown command; try /join <room>, /leave or /ping");
+  }
+}
+
+static void handle_datagram(struct sockaddr_in *from, char *buf, size_t len) {
+  uint32_t id = peer_find(from);
+  if (id != NIL) peers[id].last_seen = tick;
+
+  if (len > 0 && buf[0] == '/') {
+    handle_command(from, id, buf, len);
+    return;
+  }
+  if (id == NIL || peers[id].room == NIL) {
+    reply(from, "* not in a room; send /join <room>");
+    return;
+  }
+
+  struct peer *p = &peers[id];
+  struct room *r = &rooms[p->room];
+  /* the prefix must still fit in one datagram with a maximum-sized message */
+  if (len > (size_t) MAX_DATAGRAM - p->tag_len) len = MAX_DATAGRAM - p->tag_len;
+  for (uint32_t i = 0; i < r->count; i++) {
+    uint32_t member = r->members[i];
+    if (member == id) continue;
+    queue(&peers[member].addr, p->tag, p->tag_len, buf, len);
+  }
+  messages++;
+  deliveries += r->count - 1;
+}
+
+/* Moves the wheel up to now, expiring the peers whose time has come */
+static void advance(uint32_t now_tick) {
+  while (tick != now_tick) {
+    tick++;
+    uint32_t slot = tick % WHEEL_SLOTS;
+    uint32_t id = wheel[slot];
+    while (id != NIL) {
+      uint32_t next = peers[id].wheel_next;
+      if (tick - peers[id].last_seen >= idle_ticks) {
+        peer_remove(id);
+      } else {
+        wheel_remove(id);
+        wheel_insert(id, wheel_slot_for(&peers[id]));
+      }
+      id = next;
+    }
+  }
+}
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char *argv[]) {
+  int port = DEFAULT_PORT;
+  uint32_t max_peers = 65536;
+  int report = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:n:i:r")) != -1) {
+    switch (opt) {
+    case 'p': port = atoi(optarg); break;
+    case 'n': max_peers = atoi(optarg); break;
+    case 'i': idle_ticks = atoi(optarg); break;
+    case 'r': report = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-p port] [-n max peers] [-i idle seconds] [-r]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (max_peers < 2 || idle_ticks < 1) {
+    fprintf(stderr, "Need at least 2 peers and 1 second of idle time\n");
+    exit(1);
+  }
+  if (tables_init(max_peers) < 0) {
+    perror("Problem allocating the peer table");
+    exit(1);
+  }
+
+  if ((sd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+    perror("Problem creating socket");
+    exit(1);
+  }
+  /* a fan-out can queue thousands of datagrams at once */
+  int bufsize = 8 * 1024 * 1024;
+  setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  struct sockaddr_in skaddr;
+  memset(&skaddr, 0, sizeof(skaddr));
+  skaddr.sin_family = AF_INET;
+  skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  skaddr.sin_port = htons(port);
+  if (bind(sd, (struct sockaddr *) &skaddr, sizeof(skaddr)) < 0) {
+    perror("Problem binding");
+    exit(1);
+  }
+  printf("Relay listening on port %d, up to %u peers, idle timeout %u s\n", port, max_peers, idle_ticks);
+  fflush(stdout);
+
+  char *bufin = malloc((size_t) BATCH * MAXBUF);
+  if (bufin == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  struct sockaddr_in remote[BATCH];
+  struct iovec iov_in[BATCH];
+  struct mmsghdr msg_in[BATCH];
+  for (int i = 0; i < BATCH; i++) {
+    iov_in[i].iov_base = bufin + (size_t) i * MAXBUF;
+    iov_in[i].iov_len = MAXBUF;
+    msg_in[i].msg_hdr = (struct msghdr) {
+      .msg_name = &remote[i],
+      .msg_iov = &iov_in[i],
+      .msg_iovlen = 1,
+    };
+  }
+
+  uint64_t start = now_ms();
+  unsigned long long last_messages = 0, last_deliveries = 0;
+  while (1) {
+    /* sleep at most until the next tick */
+    uint64_t elapsed = now_ms() - start;
+    uint64_t wait = 1000 - elapsed % 1000;
+    struct timespec timeout = { wait / 1000, (wait % 1000) * 1000000 };
+    struct pollfd pfd = { sd, POLLIN, 0 };
+    if (ppoll(&pfd, 1, &timeout, NULL) > 0) {
+      for (int i = 0; i < BATCH; i++) msg_in[i].msg_hdr.msg_namelen = sizeof(remote[i]);
+      int n = recvmmsg(sd, msg_in, BATCH, MSG_DONTWAIT, NULL);
+      for (int i = 0; i < n; i++) handle_datagram(&remote[i], iov_in[i].iov_base, msg_in[i].msg_len);
+      /* the queued bodies still point into the receive buffers */
+      flush();
+    }
+
+    uint32_t now_tick = (now_ms() - start) / 1000;
+    if (now_tick != tick) {
+      advance(now_tick);
+      if (report) {
+        printf("%llu messages/s, %llu deliveries/s, %u peers, %u rooms, %llu send errors\n",
+               messages - last_messages, deliveries - last_deliveries, peer_count, room_count, send_errors);
+        fflush(stdout);
+        last_messages = messages;
+        last_deliveries = deliveries;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,293 @@
+#define _GNU_SOURCE     /* recvmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>     /* defines STDIN_FILENO, system calls,etc */
+#include <pthread.h>
+#include <sys/types.h>  /* system data type definitions */
+#include <sys/socket.h> /* socket specific definitions */
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h> /* INET constants and stuff */
+#include <arpa/inet.h>  /* IP address conversion stuff */
+#include <netdb.h>      /* gethostbyname */
+#include "hist.h"
+
+/* Load client for relay.c: many simulated peers in rooms, measuring how long
+   a message takes to reach the other members and how many arrive.
+
+   Build: gcc -O2 -pthread -o relay_load relay_load.c
+   Usage: relay_load [-s host] [-p port] [-n peers] [-g room size] [-m messages/s]
+                     [-l bytes] [-d seconds] [-t threads] [-H]
+     -n  simulated peers, one socket each (default 1000)
+     -g  peers per room (default 10); a message reaches g - 1 of them
+     -m  messages per second, spread round-robin over all peers (default 1000)
+     -l  message size, at least the 24 byte header (default 64)
+     -d  how long to send (default 10)
+     -t  receiving threads, each watching its share of the sockets (default 1)
+     -H  print the whole latency histogram, not just the percentiles
+
+   Every message carries its send time; a receiver subtracts it from the
+   arrival time, so the latency includes the trip through the relay and the
+   relay's fan-out queue. Messages still missing a second after the last one
+   was sent count as lost. */
+
+#define DEFAULT_PORT 9877
+#define MAXBUF 65536
+#define RECV_BATCH 16
+#define LOAD_MAGIC 0x4c4f4144       /* "LOAD" */
+#define KEEPALIVE_NS 10000000000ull  /* below the relay's idle timeout */
+
+struct load_msg {
+  uint32_t magic;
+  uint32_t sender;
+  uint64_t seq;
+  uint64_t sent_ns;
+};
+
+struct receiver {
+  pthread_t thread;
+  int epfd;
+  unsigned long long deliveries;        /* read by the once a second report */
+  struct histogram latency;
+};
+
+static int *sockets;
+static unsigned char *joined;           /* per peer, set by the receivers */
+static int peers = 1000, room_size = 10;
+static int stop;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void handle(struct receiver *r, int peer, const char *buf, size_t len, uint64_t now) {
+  if (len >= 2 && buf[0] == '*' && buf[1] == ' ') {
+    if (len > 9 && memcmp(buf, "* joined ", 9) == 0) __atomic_store_n(&joined[peer], 1, __ATOMIC_RELAXED);
+    return;
+  }
+  /* relayed: "<ip:port> " and then the message as sent */
+  const char *space = memchr(buf, ' ', len);
+  if (space == NULL) return;
+  size_t offset = space + 1 - buf;
+  struct load_msg m;
+  if (len - offset < sizeof(m)) return;
+  memcpy(&m, buf + offset, sizeof(m));
+  if (m.magic != LOAD_MAGIC) return;
+  __atomic_add_fetch(&r->deliveries, 1, __ATOMIC_RELAXED);
+  hist_add(&r->latency, now - m.sent_ns);
+}
+
+static void *receive_main(void *arg) {
+  struct receiver *r = arg;
+  char *bufs = malloc((size_t) RECV_BATCH * MAXBUF);
+  if (bufs == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  struct iovec iov[RECV_BATCH];
+  struct mmsghdr msg[RECV_BATCH];
+  for (int i = 0; i < RECV_BATCH; i++) {
+    iov[i].iov_base = bufs + (size_t) i * MAXBUF;
+    iov[i].iov_len = MAXBUF;
+    msg[i].msg_hdr = (struct msghdr) { .msg_iov = &iov[i], .msg_iovlen = 1 };
+  }
+
+  struct epoll_event events[256];
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    int n = epoll_wait(r->epfd, events, 256, 100);
+    for (int e = 0; e < n; e++) {
+      int peer = events[e].data.u32;
+      int got;
+      while ((got = recvmmsg(sockets[peer], msg, RECV_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+        uint64_t now = now_ns();
+        for (int i = 0; i < got; i++) handle(r, peer, iov[i].iov_base, msg[i].msg_len, now);
+        if (got < RECV_BATCH) break;
+      }
+    }
+  }
+  free(bufs);
+  return NULL;
+}
+
+static void send_join(int peer) {
+  char buf[64];
+  int len = snprintf(buf, sizeof(buf), "/join load-%d", peer / room_size);
+  send(sockets[peer], buf, len, 0);
+}
+
+/* The room of peer, and so the number of others who get its messages */
+static int recipients(int peer) {
+  int room = peer / room_size;
+  int last = (room + 1) * room_size < peers ? (room + 1) * room_size : peers;
+  return last - room * room_size - 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *host = "localhost";
+  int port = DEFAULT_PORT;
+  double rate = 1000;
+  size_t length = 64;
+  double duration = 10;
+  int threads = 1;
+  int full_histogram = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:p:n:g:m:l:d:t:H")) != -1) {
+    switch (opt) {
+    case 's': host = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 'n': peers = atoi(optarg); break;
+    case 'g': room_size = atoi(optarg); break;
+    case 'm': rate = atof(optarg); break;
+    case 'l': length = atoi(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'H': full_histogram = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-s host] [-p port] [-n peers] [-g room size] [-m messages/s] [-l bytes] "
+              "[-d seconds] [-t threads] [-H]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (peers < 2 || room_size < 2 || rate <= 0 || threads < 1) {
+    fprintf(stderr, "Need at least 2 peers, rooms of at least 2, a positive rate and a thread\n");
+    exit(1);
+  }
+  if (length < sizeof(struct load_msg)) length = sizeof(struct load_msg);
+  if (length > MAXBUF - 32) length = MAXBUF - 32;
+
+  /* one socket per peer; raise the descriptor limit as far as allowed */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t) peers + 64) {
+    rl.rlim_cur = rl.rlim_max < (rlim_t) peers + 64 ? rl.rlim_max : (rlim_t) peers + 64;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  struct hostent *hp = gethostbyname(host);
+  if (hp == NULL) {
+    fprintf(stderr, "Unknown host %s\n", host);
+    exit(1);
+  }
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  memcpy(&server.sin_addr.s_addr, hp->h_addr, hp->h_length);
+  server.sin_port = htons(port);
+
+  sockets = calloc(peers, sizeof(int));
+  joined = calloc(peers, 1);
+  struct receiver *receivers = calloc(threads, sizeof(struct receiver));
+  if (sockets == NULL || joined == NULL || receivers == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (int t = 0; t < threads; t++) {
+    hist_init(&receivers[t].latency);
+    if ((receivers[t].epfd = epoll_create1(0)) < 0) {
+      perror("epoll_create1");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < peers; i++) {
+    /* connect() makes the relay the only source a peer hears from */
+    if ((sockets[i] = socket(PF_INET, SOCK_DGRAM, 0)) < 0 ||
+        connect(sockets[i], (struct sockaddr *) &server, sizeof(server)) < 0) {
+      fprintf(stderr, "Peer %d: %s\n", i, strerror(errno));
+      exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+    epoll_ctl(receivers[i % threads].epfd, EPOLL_CTL_ADD, sockets[i], &ev);
+  }
+  for (int t = 0; t < threads; t++) {
+    if (pthread_create(&receivers[t].thread, NULL, receive_main, &receivers[t]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  /* join, resending to the peers whose confirmation has not come back */
+  int ready = 0;
+  for (int round = 0; round < 5 && !ready; round++) {
+    for (int i = 0; i < peers; i++) {
+      if (!__atomic_load_n(&joined[i], __ATOMIC_RELAXED)) send_join(i);
+    }
+    for (int wait = 0; wait < 10 && !ready; wait++) {
+      usleep(100000);
+      ready = 1;
+      for (int i = 0; i < peers && ready; i++) ready = __atomic_load_n(&joined[i], __ATOMIC_RELAXED);
+    }
+  }
+  if (!ready) {
+    fprintf(stderr, "Not every peer could join; is the relay running with -n >= %d?\n", peers);
+    exit(1);
+  }
+  printf("%d peers in %d rooms of %d, sending %.0f messages/s of %zu bytes for %.0f s\n",
+         peers, (peers + room_size - 1) / room_size, room_size, rate, length, duration);
+  fflush(stdout);
+
+  /* send round-robin at the given rate, checking the schedule every 100 us */
+  char *payload = calloc(1, length);
+  struct load_msg m = { .magic = LOAD_MAGIC };
+  unsigned long long sent = 0, expected = 0, last_deliveries = 0;
+  uint64_t start = now_ns(), end = start + (uint64_t) (duration * 1e9);
+  uint64_t next_report = start + 1000000000, next_keepalive = start + KEEPALIVE_NS;
+  int peer = 0;
+  while (1) {
+    uint64_t now = now_ns();
+    if (now >= end) break;
+    unsigned long long due = (now - start) / 1e9 * rate;
+    while (sent < due) {
+      m.sender = peer;
+      m.seq = sent;
+      m.sent_ns = now_ns();
+      memcpy(payload, &m, sizeof(m));
+      if (send(sockets[peer], payload, length, 0) == (ssize_t) length) expected += recipients(peer);
+      sent++;
+      peer = (peer + 1) % peers;
+    }
+    if (now >= next_keepalive) {
+      for (int i = 0; i < peers; i++) send(sockets[i], "/ping", 5, 0);
+      next_keepalive += KEEPALIVE_NS;
+    }
+    if (now >= next_report) {
+      unsigned long long deliveries = 0;
+      for (int t = 0; t < threads; t++) deliveries += __atomic_load_n(&receivers[t].deliveries, __ATOMIC_RELAXED);
+      printf("%llu messages sent, %llu deliveries/s\n", sent, deliveries - last_deliveries);
+      fflush(stdout);
+      last_deliveries = deliveries;
+      next_report += 1000000000;
+    }
+    struct timespec pause = { 0, 100000 };
+    nanosleep(&pause, NULL);
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  /* give the last fan-outs a second to land */
+  sleep(1);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  struct histogram latency;
+  hist_init(&latency);
+  unsigned long long deliveries = 0;
+  for (int t = 0; t < threads; t++) {
+    pthread_join(receivers[t].thread, NULL);
+    deliveries += receivers[t].deliveries;
+    hist_merge(&latency, &receivers[t].latency);
+  }
+  for (int i = 0; i < peers; i++) {
+    send(sockets[i], "/leave", 6, 0);
+    close(sockets[i]);
+  }
+
+  printf("%llu messages in %.2f s (%.0f/s), %llu of %llu deliveries (%.0f/s), %llu lost (%.3f%%)\n",
+         sent, elapsed, sent / elapsed, deliveries, expected, deliveries / elapsed,
+         expected > deliveries ? expected - deliveries : 0,
+         expected > deliveries ? 100.0 * (expected - deliveries) / expected : 0.0);
+  hist_summary(stdout, "fan-out latency", &latency, 1000, "us");
+  if (full_histogram) hist_print(stdout, &latency, 1000, "us");
+  return 0;
+}
@@ -0,0 +1,115 @@
+#ifndef RUDP_H
+#define RUDP_H
+
+/* Wire format and helpers shared by rudp_server.c and rudp_client.c.
+
+   A transfer is one file, pulled by the client:
+
+     client                         server
+     REQ  name            ---->
+                          <----     META size, chunk count     (or ERR)
+     ACK  cum=0           ---->     (the handshake is done; data starts)
+                          <----     DATA seq, send time, bytes ...
+     ACK  cum, SACK bits, ---->
+          echoed time
+     DONE                 ---->
+                          <----     FIN
+
+   The client retries REQ until META arrives and DONE until FIN arrives, so a
+   lost control packet only costs a timeout. DATA carries chunk seq of the file
+   and is acknowledged cumulatively (every chunk below cum has arrived) plus a
+   bitmap of the RUDP_SACK_BITS chunks after cum. The echoed send time gives the
+   server an RTT sample from every ACK, retransmissions included. All fields are
+   in network byte order. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define RUDP_MAGIC 0x5255          /* "RU" */
+#define RUDP_DEFAULT_PORT 9880
+#define RUDP_CHUNK 1400            /* payload per DATA; keeps packets under a 1500 byte MTU */
+#define RUDP_SACK_BITS 1024        /* chunks after cum an ACK can report; also caps the window */
+#define RUDP_SACK_WORDS (RUDP_SACK_BITS / 32)
+#define RUDP_MAX_PACKET 2048
+
+enum {
+  RUDP_REQ = 1,
+  RUDP_META,
+  RUDP_DATA,
+  RUDP_ACK,
+  RUDP_DONE,
+  RUDP_FIN,
+  RUDP_ERR
+};
+
+struct rudp_header {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t flags;
+  uint32_t session;                /* chosen by the client */
+} __attribute__((packed));
+
+struct rudp_meta {
+  struct rudp_header h;
+  uint64_t size;
+  uint32_t chunks;
+  uint16_t chunk_size;
+} __attribute__((packed));
+
+struct rudp_data {
+  struct rudp_header h;
+  uint32_t seq;
+  uint64_t sent_us;                /* echoed back in the ACK */
+  unsigned char payload[];
+} __attribute__((packed));
+
+struct rudp_ack {
+  struct rudp_header h;
+  uint32_t cum;                    /* first chunk not yet received */
+  uint64_t echo_us;                /* sent_us of the newest DATA received */
+  uint32_t sack[RUDP_SACK_WORDS];  /* bit i of the bitmap: chunk cum + 1 + i has arrived */
+} __attribute__((packed));
+
+static inline uint64_t rudp_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t rudp_hton64(uint64_t v) {
+  return ((uint64_t) htonl((uint32_t) v) << 32) | htonl((uint32_t) (v >> 32));
+}
+
+#define rudp_ntoh64 rudp_hton64
+
+static inline void rudp_header_init(struct rudp_header *h, int type, uint32_t session) {
+  h->magic = htons(RUDP_MAGIC);
+  h->type = type;
+  h->flags = 0;
+  h->session = htonl(session);
+}
+
+/* Loss injection for testing without netem: each outgoing datagram is dropped
+   with probability rudp_loss percent. */
+static double rudp_loss = 0;
+static unsigned int rudp_loss_seed = 1;
+static unsigned long long rudp_dropped = 0;
+
+static inline int rudp_drop(void) {
+  if (rudp_loss <= 0) return 0;
+  if (rand_r(&rudp_loss_seed) < rudp_loss / 100.0 * ((double) RAND_MAX + 1)) {
+    rudp_dropped++;
+    return 1;
+  }
+  return 0;
+}
+
+/* sendto() through the loss injector; a dropped datagram still counts as sent */
+static inline void rudp_send(int sd, const void *buf, size_t len, const struct sockaddr *to, socklen_t tolen) {
+  if (!rudp_drop()) sendto(sd, buf, len, 0, to, tolen);
+}
+
+#endif /* RUDP_H */
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE     /* recvmmsg, ppoll */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>     /* defines STDIN_FILENO, system calls,etc */
+#include <sys/types.h>  /* system data type definitions */
+#include <sys/socket.h> /* socket specific definitions */
+#include <netinet/in.h> /* INET constants and stuff */
+#include <arpa/inet.h>  /* IP address conversion stuff */
+#include <netdb.h>      /* gethostbyname */
+#include "rudp.h"
+
+/* Reliable file transfer over UDP, client side; see rudp.h for the protocol.
+
+   Build: gcc -O2 -o rudp_client rudp_client.c
+   Usage: rudp_client [-s host] [-p port] [-o output] [-L loss%] [-D ms] [-S seed] name
+     -o  where to write the file (default: its base name in the current directory)
+     -L  drop this percentage of outgoing datagrams (ACKs), to test recovery
+     -D  hold every ACK back this long, to emulate a long path on loopback
+     -S  seed for the -L generator
+
+   Chunks are written at their offset as they arrive, in any order. One ACK
+   goes out per recvmmsg() batch rather than per DATA, which keeps the return
+   path light without delaying feedback: a batch is whatever had queued up
+   since the last one. */
+
+#define BATCH 64
+#define RETRY_US 200000                /* REQ retries, and re-ACKs when the server goes quiet */
+#define DONE_RETRY_US 50000
+#define REQUEST_TRIES 25
+#define DONE_TRIES 20
+#define SILENCE_LIMIT_US 10000000
+#define DELAY_SLOTS 8192               /* ACKs held back by -D */
+
+static int sk;
+static struct sockaddr_in server;
+static uint32_t session_id;
+
+static uint64_t size;
+static uint32_t chunks;
+static unsigned char *have;            /* one byte per chunk */
+static uint32_t cum;                   /* first chunk not received */
+static unsigned long long packets, duplicates;
+
+static uint64_t ack_delay_us;
+static struct {
+  uint64_t due;
+  struct rudp_ack ack;
+} delayed[DELAY_SLOTS];
+static unsigned int delayed_head, delayed_tail;
+
+/* Sends the held back ACKs that are due, or the oldest one to make room */
+static void flush_acks(uint64_t now, int make_room) {
+  while (delayed_head != delayed_tail && (delayed[delayed_head % DELAY_SLOTS].due <= now || make_room)) {
+    struct rudp_ack *a = &delayed[delayed_head++ % DELAY_SLOTS].ack;
+    rudp_send(sk, a, sizeof(*a), (struct sockaddr *) &server, sizeof(server));
+    make_room = 0;
+  }
+}
+
+static void send_control(int type, const void *payload, size_t len) {
+  unsigned char buf[RUDP_MAX_PACKET];
+  rudp_header_init((struct rudp_header *) buf, type, session_id);
+  if (len > 0) memcpy(buf + sizeof(struct rudp_header), payload, len);
+  rudp_send(sk, buf, sizeof(struct rudp_header) + len, (struct sockaddr *) &server, sizeof(server));
+}
+
+/* echo is the send time of the DATA that prompted this ACK, 0 for a repeat */
+static void send_ack(uint64_t echo) {
+  struct rudp_ack a;
+  memset(&a, 0, sizeof(a));
+  rudp_header_init(&a.h, RUDP_ACK, session_id);
+  a.cum = htonl(cum);
+  a.echo_us = rudp_hton64(echo);
+  for (uint32_t i = 0; i < RUDP_SACK_BITS && cum + 1 + i < chunks; i++) {
+    if (have[cum + 1 + i]) a.sack[i / 32] |= 1u << (i % 32);
+  }
+  for (int w = 0; w < RUDP_SACK_WORDS; w++) a.sack[w] = htonl(a.sack[w]);
+
+  if (ack_delay_us == 0) {
+    rudp_send(sk, &a, sizeof(a), (struct sockaddr *) &server, sizeof(server));
+    return;
+  }
+  uint64_t now = rudp_now_us();
+  flush_acks(now, delayed_tail - delayed_head == DELAY_SLOTS);
+  delayed[delayed_tail % DELAY_SLOTS].due = now + ack_delay_us;
+  delayed[delayed_tail++ % DELAY_SLOTS].ack = a;
+}
+
+/* Waits up to timeout_us for datagrams of this session; returns how many arrived, 0 on timeout */
+static int receive(struct mmsghdr *msg, uint64_t timeout_us) {
+  uint64_t now = rudp_now_us(), end = now + timeout_us;
+  while (1) {
+    /* wake up for held back ACKs too */
+    uint64_t wait = end - now;
+    if (delayed_head != delayed_tail && delayed[delayed_head % DELAY_SLOTS].due - now < wait) {
+      wait = delayed[delayed_head % DELAY_SLOTS].due - now;
+    }
+    struct timespec timeout = { wait / 1000000, (wait % 1000000) * 1000 };
+    struct pollfd pfd = { sk, POLLIN, 0 };
+    int r = ppoll(&pfd, 1, &timeout, NULL);
+    if (r < 0 && errno != EINTR) {
+      perror("ppoll");
+      exit(1);
+    }
+    now = rudp_now_us();
+    flush_acks(now, 0);
+    if (r > 0) {
+      int n = recvmmsg(sk, msg, BATCH, MSG_DONTWAIT, NULL);
+      if (n > 0) return n;
+    }
+    if (now >= end) return 0;
+  }
+}
+
+static struct rudp_header *check(struct mmsghdr *m) {
+  struct rudp_header *h = m->msg_hdr.msg_iov->iov_base;
+  if (m->msg_len < sizeof(*h) || ntohs(h->magic) != RUDP_MAGIC || ntohl(h->session) != session_id) return NULL;
+  return h;
+}
+
+static void fail_with_error(struct mmsghdr *m) {
+  char *text = (char *) m->msg_hdr.msg_iov->iov_base + sizeof(struct rudp_header);
+  fprintf(stderr, "Server error: %.*s\n", (int) (m->msg_len - sizeof(struct rudp_header)), text);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char *host = "localhost";
+  const char *output = NULL;
+  int port = RUDP_DEFAULT_PORT;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:p:o:L:D:S:")) != -1) {
+    switch (opt) {
+    case 's': host = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 'o': output = optarg; break;
+    case 'L': rudp_loss = atof(optarg); break;
+    case 'D': ack_delay_us = atof(optarg) * 1000; break;
+    case 'S': rudp_loss_seed = atoi(optarg); break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-s host] [-p port] [-o output] [-L loss%%] [-D ms] [-S seed] name\n", argv[0]);
+    exit(1);
+  }
+  const char *name = argv[optind];
+  if (strlen(name) > RUDP_MAX_PACKET - sizeof(struct rudp_header)) {
+    fprintf(stderr, "Name too long\n");
+    exit(1);
+  }
+  if (output == NULL) {
+    output = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : name;
+  }
+
+  struct hostent *hp = gethostbyname(host);
+  if (hp == NULL) {
+    fprintf(stderr, "Unknown host %s\n", host);
+    exit(1);
+  }
+  server.sin_family = AF_INET;
+  memcpy(&server.sin_addr.s_addr, hp->h_addr, hp->h_length);
+  server.sin_port = htons(port);
+
+  if ((sk = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+    perror("Problem creating socket");
+    exit(1);
+  }
+  /* the server paces, but a deep queue still saves retransmissions */
+  int bufsize = 4 * 1024 * 1024;
+  setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+  unsigned char bufs[BATCH][RUDP_MAX_PACKET];
+  struct iovec iov[BATCH];
+  struct mmsghdr msg[BATCH];
+  for (int i = 0; i < BATCH; i++) {
+    iov[i].iov_base = bufs[i];
+    iov[i].iov_len = RUDP_MAX_PACKET;
+    msg[i].msg_hdr = (struct msghdr) { .msg_iov = &iov[i], .msg_iovlen = 1 };
+  }
+
+  srand(rudp_now_us() ^ getpid());
+  session_id = rand();
+  uint64_t start = rudp_now_us();
+
+  /* REQ until META or ERR */
+  int got_meta = 0;
+  for (int tries = 0; tries < REQUEST_TRIES && !got_meta; tries++) {
+    send_control(RUDP_REQ, name, strlen(name));
+    int n = receive(msg, RETRY_US);
+    for (int i = 0; i < n; i++) {
+      struct rudp_header *h = check(&msg[i]);
+      if (h == NULL) continue;
+      if (h->type == RUDP_ERR) fail_with_error(&msg[i]);
+      if (h->type == RUDP_META && msg[i].msg_len >= sizeof(struct rudp_meta)) {
+        struct rudp_meta *m = (struct rudp_meta *) h;
+        size = rudp_ntoh64(m->size);
+        chunks = ntohl(m->chunks);
+        if (ntohs(m->chunk_size) != RUDP_CHUNK || (size + RUDP_CHUNK - 1) / RUDP_CHUNK != chunks) {
+          fprintf(stderr, "Server uses a different chunk size\n");
+          exit(1);
+        }
+        got_meta = 1;
+      }
+    }
+  }
+  if (!got_meta) {
+    fprintf(stderr, "No answer from %s:%d\n", host, port);
+    exit(1);
+  }
+
+  int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    perror(output);
+    exit(1);
+  }
+  have = calloc(chunks + 1, 1);
+  if (have == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  /* the first ACK tells the server META arrived and starts the data */
+  send_ack(0);
+  uint64_t silent = 0;
+  while (cum < chunks) {
+    int n = receive(msg, RETRY_US);
+    if (n == 0) {
+      silent += RETRY_US;
+      if (silent >= SILENCE_LIMIT_US) {
+        fprintf(stderr, "Server went silent at chunk %u of %u\n", cum, chunks);
+        exit(1);
+      }
+      /* our last ACK may have been lost; its echo would be a stale RTT sample */
+      send_ack(0);
+      continue;
+    }
+    silent = 0;
+
+    uint64_t echo = 0;
+    for (int i = 0; i < n; i++) {
+      struct rudp_header *h = check(&msg[i]);
+      if (h == NULL) continue;
+      if (h->type == RUDP_ERR) fail_with_error(&msg[i]);
+      if (h->type != RUDP_DATA || msg[i].msg_len < sizeof(struct rudp_data)) continue;
+
+      struct rudp_data *d = (struct rudp_data *) h;
+      uint32_t seq = ntohl(d->seq);
+      uint64_t offset = (uint64_t) seq * RUDP_CHUNK;
+      size_t len = msg[i].msg_len - sizeof(*d);
+      if (seq >= chunks || len != (size - offset < RUDP_CHUNK ? size - offset : RUDP_CHUNK)) continue;
+
+      packets++;
+      echo = rudp_ntoh64(d->sent_us);
+      if (have[seq]) {
+        duplicates++;
+        continue;
+      }
+      if (pwrite(fd, d->payload, len, offset) != (ssize_t) len) {
+        perror(output);
+        exit(1);
+      }
+      have[seq] = 1;
+      while (cum < chunks && have[cum]) cum++;
+    }
+    if (echo != 0) send_ack(echo);
+  }
+
+  if (close(fd) < 0) {
+    perror(output);
+    exit(1);
+  }
+  double elapsed = (rudp_now_us() - start) / 1e6;
+
+  /* DONE until FIN; the file is complete either way */
+  int got_fin = 0;
+  for (int tries = 0; tries < DONE_TRIES && !got_fin; tries++) {
+    send_control(RUDP_DONE, NULL, 0);
+    int n = receive(msg, DONE_RETRY_US);
+    for (int i = 0; i < n; i++) {
+      struct rudp_header *h = check(&msg[i]);
+      if (h != NULL && h->type == RUDP_FIN) got_fin = 1;
+    }
+  }
+
+  printf("%s: %llu bytes in %.2f s (%.1f MB/s), %llu packets, %llu duplicates, %llu datagrams dropped by -L%s\n",
+         output, (unsigned long long) size, elapsed, elapsed > 0 ? size / elapsed / 1e6 : 0.0, packets, duplicates,
+         rudp_dropped, got_fin ? "" : ", no FIN from the server");
+  close(sk);
+  return 0;
+}
@@ -0,0 +1,567 @@
+#define _GNU_SOURCE     /* recvmmsg, sendmmsg, ppoll */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>     /* defines STDIN_FILENO, system calls,etc */
+#include <sys/types.h>  /* system data type definitions */
+#include <sys/socket.h> /* socket specific definitions */
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <netinet/in.h> /* INET constants and stuff */
+#include <arpa/inet.h>  /* IP address conversion stuff */
+#include <linux/openat2.h>
+#include "rudp.h"
+
+/* Reliable file transfer over UDP, server side; see rudp.h for the protocol.
+
+   Build: gcc -O2 -o rudp_server rudp_server.c
+   Usage: rudp_server [-p port] [-r root] [-L loss%] [-S seed]
+     -r  directory the files are served from; the FTP server's root_dir,
+         and the same default ("data")
+     -L  drop this percentage of outgoing datagrams, to test recovery
+     -S  seed for the -L generator
+
+   Every session keeps a state per chunk (never sent, in flight, lost, acked)
+   and a send time per chunk. Sending is limited three ways:
+     - the congestion window: chunks in flight never exceed cwnd;
+     - the receiver's reach: no chunk is sent beyond what an ACK can report;
+     - pacing: chunks leave srtt / cwnd apart (with a small burst allowance)
+       instead of in line-rate bursts that overflow queues.
+   cwnd grows by one per acked chunk in slow start and by 1/cwnd after
+   ssthresh, and is halved at most once per window when a loss is found while
+   the RTT shows a queue building up. Random loss on an uncongested long path
+   leaves cwnd alone: halving for it is what makes a TCP stream crawl on such
+   links, and the retransmissions repair it anyway. A chunk is
+   declared lost when a chunk sent more than srtt/4 after it has been acked
+   (time-based, so retransmissions are covered too), or when nothing at all
+   has been acked for an RTO, which also collapses cwnd to its minimum. Before
+   the RTO, up to two probes resend the oldest chunk in flight. */
+
+#define MAX_SESSIONS 64
+#define BATCH 64
+#define INITIAL_CWND 10
+#define MIN_CWND 2
+#define BURST 4                        /* chunks that may leave back to back after an idle spell */
+#define INITIAL_RTO_US 1000000        /* before the first RTT sample, as in RFC 6298 */
+#define MIN_RTO_US 10000
+#define QUEUE_US 1000                  /* srtt this far above the minimum means a queue */
+#define MAX_RTO_US 2000000
+#define MIN_REORDER_US 200
+#define MIN_PROBE_US 1000
+#define MAX_PROBES 2
+#define IDLE_TIMEOUT_US 10000000       /* sessions the client stopped talking to */
+
+enum { CHUNK_NEW, CHUNK_INFLIGHT, CHUNK_LOST, CHUNK_ACKED };
+
+struct session {
+  int used;
+  uint32_t id;
+  struct sockaddr_in peer;
+  int fd;
+  char name[256];
+  uint64_t size;
+  uint32_t chunks;
+  int started;                         /* the client acknowledged META */
+
+  unsigned char *state;                /* CHUNK_* per chunk */
+  uint64_t *sent_at;                   /* time of the latest transmission per chunk */
+  uint32_t cum;                        /* every chunk below has been acked */
+  uint32_t next_new;                   /* first chunk never sent */
+  uint32_t inflight;
+  uint32_t lost;
+  uint32_t lost_from;                  /* no lost chunk below this one */
+
+  double cwnd;
+  double ssthresh;
+  int in_recovery;                     /* cwnd was cut; no growth or further cuts */
+  uint32_t recovery_end;               /* ...until every chunk sent before the cut is acked */
+  uint64_t srtt, rttvar, rto;
+  uint64_t min_rtt;
+  uint64_t rack_us;                    /* send time of the newest transmission acked */
+
+  uint64_t last_ack_us;
+  int probes;                          /* tail loss probes since the last new ack */
+  uint64_t last_heard_us;
+  uint64_t next_send_us;
+  uint64_t start_us;
+  unsigned long long sent;
+  unsigned long long retransmits;
+  unsigned long long timeouts;
+};
+
+static struct session sessions[MAX_SESSIONS];
+static int root_fd;
+
+/* one batch of outgoing DATA, reused by every session */
+static unsigned char out_buf[BATCH][RUDP_MAX_PACKET];
+static struct iovec out_iov[BATCH];
+static struct mmsghdr out_msg[BATCH];
+
+static int open_socket(int port) {
+  int sd;
+  struct sockaddr_in skaddr;
+
+  if ((sd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+    perror("Problem creating socket");
+    return -1;
+  }
+
+  int bufsize = 4 * 1024 * 1024;
+  setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  memset(&skaddr, 0, sizeof(skaddr));
+  skaddr.sin_family = AF_INET;
+  skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  skaddr.sin_port = htons(port);
+
+  if (bind(sd, (struct sockaddr *) &skaddr, sizeof(skaddr)) < 0) {
+    perror("Problem binding");
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+static void send_error(int sd, uint32_t id, const struct sockaddr_in *to, const char *message) {
+  unsigned char buf[RUDP_MAX_PACKET];
+  size_t len = strlen(message);
+  if (len > sizeof(buf) - sizeof(struct rudp_header)) len = sizeof(buf) - sizeof(struct rudp_header);
+  rudp_header_init((struct rudp_header *) buf, RUDP_ERR, id);
+  memcpy(buf + sizeof(struct rudp_header), message, len);
+  rudp_send(sd, buf, sizeof(struct rudp_header) + len, (const struct sockaddr *) to, sizeof(*to));
+}
+
+static void send_meta(int sd, struct session *s) {
+  struct rudp_meta m;
+  rudp_header_init(&m.h, RUDP_META, s->id);
+  m.size = rudp_hton64(s->size);
+  m.chunks = htonl(s->chunks);
+  m.chunk_size = htons(RUDP_CHUNK);
+  rudp_send(sd, &m, sizeof(m), (const struct sockaddr *) &s->peer, sizeof(s->peer));
+}
+
+static struct session *find_session(uint32_t id, const struct sockaddr_in *peer) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    struct session *s = &sessions[i];
+    if (s->used && s->id == id && s->peer.sin_addr.s_addr == peer->sin_addr.s_addr && s->peer.sin_port == peer->sin_port) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static void close_session(struct session *s, const char *why) {
+  uint64_t elapsed = rudp_now_us() - s->start_us;
+  printf("%08x %s: %s, %llu bytes in %.2f s, %llu packets sent, %llu retransmitted, %llu timeouts, srtt %llu us\n",
+         s->id, s->name, why, (unsigned long long) s->size, elapsed / 1e6, s->sent, s->retransmits, s->timeouts,
+         (unsigned long long) s->srtt);
+  fflush(stdout);
+  close(s->fd);
+  free(s->state);
+  free(s->sent_at);
+  memset(s, 0, sizeof(*s));
+}
+
+/* Names are resolved beneath the root, so "..", absolute paths and symlinks
+   cannot reach anything outside it */
+static int open_beneath(const char *name) {
+  struct open_how how;
+  memset(&how, 0, sizeof(how));
+  how.flags = O_RDONLY | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+  return syscall(SYS_openat2, root_fd, name, &how, sizeof(how));
+}
+
+static void handle_request(int sd, uint32_t id, const struct sockaddr_in *from, const char *payload, size_t len) {
+  struct session *s = find_session(id, from);
+  if (s != NULL) {
+    /* our META got lost */
+    send_meta(sd, s);
+    return;
+  }
+
+  char name[256];
+  if (len == 0 || len >= sizeof(name) || memchr(payload, '\0', len) != NULL) {
+    send_error(sd, id, from, "Bad file name");
+    return;
+  }
+  memcpy(name, payload, len);
+  name[len] = '\0';
+
+  for (int i = 0; i < MAX_SESSIONS && s == NULL; i++) {
+    if (!sessions[i].used) s = &sessions[i];
+  }
+  if (s == NULL) {
+    send_error(sd, id, from, "Server busy");
+    return;
+  }
+
+  int fd = open_beneath(name);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    /* RESOLVE_BENEATH reports an escape as EXDEV */
+    send_error(sd, id, from, fd < 0 ? (errno == EXDEV ? "Outside the root directory" : strerror(errno)) : "Not a regular file");
+    if (fd >= 0) close(fd);
+    return;
+  }
+  uint64_t chunks = ((uint64_t) st.st_size + RUDP_CHUNK - 1) / RUDP_CHUNK;
+  if (chunks > UINT32_MAX - RUDP_SACK_BITS) {
+    send_error(sd, id, from, "File too large");
+    close(fd);
+    return;
+  }
+
+  memset(s, 0, sizeof(*s));
+  s->state = calloc(chunks + 1, 1);
+  s->sent_at = calloc(chunks + 1, sizeof(uint64_t));
+  if (s->state == NULL || s->sent_at == NULL) {
+    free(s->state);
+    free(s->sent_at);
+    close(fd);
+    send_error(sd, id, from, "Out of memory");
+    return;
+  }
+  s->used = 1;
+  s->id = id;
+  s->peer = *from;
+  s->fd = fd;
+  snprintf(s->name, sizeof(s->name), "%s", name);
+  s->size = st.st_size;
+  s->chunks = chunks;
+  s->cwnd = INITIAL_CWND;
+  s->ssthresh = RUDP_SACK_BITS;
+  s->rto = INITIAL_RTO_US;
+  s->start_us = s->last_heard_us = rudp_now_us();
+  send_meta(sd, s);
+}
+
+static void rtt_sample(struct session *s, uint64_t rtt) {
+  if (s->min_rtt == 0 || rtt < s->min_rtt) s->min_rtt = rtt;
+  if (s->srtt == 0) {
+    s->srtt = rtt;
+    s->rttvar = rtt / 2;
+  } else {
+    uint64_t delta = rtt > s->srtt ? rtt - s->srtt : s->srtt - rtt;
+    s->rttvar = (3 * s->rttvar + delta) / 4;
+    s->srtt = (7 * s->srtt + rtt) / 8;
+  }
+  /* at least 3 srtt, so the probes get their turn first */
+  s->rto = s->srtt + 4 * s->rttvar > 3 * s->srtt ? s->srtt + 4 * s->rttvar : 3 * s->srtt;
+  if (s->rto < MIN_RTO_US) s->rto = MIN_RTO_US;
+  if (s->rto > MAX_RTO_US) s->rto = MAX_RTO_US;
+}
+
+/* Cuts cwnd at most once per window of data, and only for congestion */
+static void congestion_event(struct session *s) {
+  uint64_t queue = s->min_rtt / 4 > QUEUE_US ? s->min_rtt / 4 : QUEUE_US;
+  if (s->in_recovery || s->srtt < s->min_rtt + queue) return;
+  s->ssthresh = s->cwnd / 2 < MIN_CWND ? MIN_CWND : s->cwnd / 2;
+  s->cwnd = s->ssthresh;
+  s->in_recovery = 1;
+  s->recovery_end = s->next_new;
+}
+
+static void mark_lost(struct session *s, uint32_t seq) {
+  s->state[seq] = CHUNK_LOST;
+  s->inflight--;
+  s->lost++;
+  if (seq < s->lost_from) s->lost_from = seq;
+}
+
+/* Returns 1 if seq was not acked before */
+static int mark_acked(struct session *s, uint32_t seq) {
+  switch (s->state[seq]) {
+  case CHUNK_INFLIGHT: s->inflight--; break;
+  case CHUNK_LOST: s->lost--; break;
+  default: return 0;                   /* already acked, or never sent */
+  }
+  s->state[seq] = CHUNK_ACKED;
+  return 1;
+}
+
+static void handle_ack(struct session *s, const struct rudp_ack *a, uint64_t now) {
+  uint32_t cum = ntohl(a->cum);
+  uint64_t echo = rudp_ntoh64(a->echo_us);
+  if (cum > s->next_new) return;       /* acks chunks we never sent */
+
+  if (!s->started) {
+    s->started = 1;
+    s->last_ack_us = s->next_send_us = now;
+  }
+  if (echo != 0 && echo <= now) {
+    rtt_sample(s, now - echo);
+    if (echo > s->rack_us) s->rack_us = echo;
+  }
+
+  int acked = 0;
+  for (uint32_t seq = s->cum; seq < cum; seq++) acked += mark_acked(s, seq);
+  if (cum > s->cum) s->cum = cum;
+  for (int w = 0; w < RUDP_SACK_WORDS; w++) {
+    uint32_t bits = ntohl(a->sack[w]);
+    while (bits != 0) {
+      uint32_t seq = cum + 1 + w * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      if (seq < s->next_new) acked += mark_acked(s, seq);
+    }
+  }
+
+  if (acked > 0) {
+    s->last_ack_us = now;
+    s->probes = 0;
+    if (s->in_recovery && s->cum >= s->recovery_end) s->in_recovery = 0;
+    if (!s->in_recovery) {
+      for (int i = 0; i < acked; i++) s->cwnd += s->cwnd < s->ssthresh ? 1 : 1 / s->cwnd;
+      if (s->cwnd > RUDP_SACK_BITS) s->cwnd = RUDP_SACK_BITS;
+    }
+  }
+
+  /* anything sent well before a transmission that has now arrived is lost */
+  uint64_t reorder = s->srtt / 4 > MIN_REORDER_US ? s->srtt / 4 : MIN_REORDER_US;
+  for (uint32_t seq = s->cum; seq < s->next_new; seq++) {
+    if (s->state[seq] == CHUNK_INFLIGHT && s->sent_at[seq] + reorder < s->rack_us) {
+      mark_lost(s, seq);
+      congestion_event(s);
+    }
+  }
+}
+
+/* When the timer below fires next, relative to the last new ack */
+static uint64_t timer_delay(const struct session *s) {
+  uint64_t probe = s->srtt + s->srtt / 4 + MIN_PROBE_US;
+  return s->probes < MAX_PROBES && probe * (s->probes + 1) < s->rto ? probe * (s->probes + 1) : s->rto;
+}
+
+/* Nothing acked for a while. First resend the oldest chunk in flight as a
+   probe: its ACK triggers the normal loss detection for the rest, and cwnd
+   stays as it is. This repairs a lost tail, or a lost retransmission once
+   nothing newer is left to send, in a couple of RTTs. After a whole RTO,
+   assume everything in flight is gone. */
+static void check_timeout(struct session *s, uint64_t now) {
+  if (!s->started || s->inflight == 0 || now - s->last_ack_us < timer_delay(s)) return;
+  if (s->probes < MAX_PROBES && now - s->last_ack_us < s->rto) {
+    for (uint32_t seq = s->cum; seq < s->next_new; seq++) {
+      if (s->state[seq] == CHUNK_INFLIGHT) {
+        mark_lost(s, seq);
+        break;
+      }
+    }
+    s->probes++;
+    return;
+  }
+  for (uint32_t seq = s->cum; seq < s->next_new; seq++) {
+    if (s->state[seq] == CHUNK_INFLIGHT) mark_lost(s, seq);
+  }
+  s->ssthresh = s->cwnd / 2 < MIN_CWND ? MIN_CWND : s->cwnd / 2;
+  /* slow start back up to ssthresh rather than crawl through the repairs at the minimum */
+  s->cwnd = MIN_CWND;
+  s->in_recovery = 0;
+  s->rto = s->rto * 2 > MAX_RTO_US ? MAX_RTO_US : s->rto * 2;
+  s->last_ack_us = now;
+  s->probes = 0;
+  s->timeouts++;
+}
+
+/* Lost chunks go first, then new ones as far as an ACK can report them;
+   returns -1 when there is nothing to send */
+static int64_t next_chunk(struct session *s) {
+  if (s->lost > 0) {
+    if (s->lost_from < s->cum) s->lost_from = s->cum;
+    for (uint32_t seq = s->lost_from; seq < s->next_new; seq++) {
+      if (s->state[seq] == CHUNK_LOST) {
+        s->lost_from = seq + 1;
+        return seq;
+      }
+    }
+  }
+  if (s->next_new < s->chunks && s->next_new <= s->cum + RUDP_SACK_BITS) return s->next_new++;
+  return -1;
+}
+
+static int can_send(const struct session *s) {
+  if (!s->started || s->inflight >= (uint32_t) s->cwnd) return 0;
+  return s->lost > 0 || (s->next_new < s->chunks && s->next_new <= s->cum + RUDP_SACK_BITS);
+}
+
+static uint64_t pacing_interval(const struct session *s) {
+  /* a 1.25 gain keeps pacing from being the bottleneck once cwnd is right */
+  return (uint64_t) (s->srtt / s->cwnd * 0.8);
+}
+
+/* Sends what cwnd and pacing allow, one sendmmsg() per batch; returns -1 if the session failed */
+static int pump(int sd, struct session *s, uint64_t now) {
+  uint64_t interval = pacing_interval(s);
+  if (s->next_send_us + BURST * interval < now) s->next_send_us = now - BURST * interval;
+
+  int taken = BATCH;
+  while (taken == BATCH) {
+    int n = 0;
+    for (taken = 0; taken < BATCH && can_send(s) && s->next_send_us <= now; taken++) {
+      int64_t seq = next_chunk(s);
+      if (seq < 0) break;
+      uint64_t offset = (uint64_t) seq * RUDP_CHUNK;
+      size_t len = s->size - offset < RUDP_CHUNK ? s->size - offset : RUDP_CHUNK;
+
+      struct rudp_data *d = (struct rudp_data *) out_buf[n];
+      if (pread(s->fd, d->payload, len, offset) != (ssize_t) len) {
+        send_error(sd, s->id, &s->peer, "Read error");
+        return -1;
+      }
+      rudp_header_init(&d->h, RUDP_DATA, s->id);
+      d->seq = htonl(seq);
+      d->sent_us = rudp_hton64(now);
+
+      if (s->state[seq] == CHUNK_LOST) {
+        s->lost--;
+        s->retransmits++;
+      }
+      s->state[seq] = CHUNK_INFLIGHT;
+      s->sent_at[seq] = now;
+      s->inflight++;
+      s->sent++;
+      s->next_send_us += interval;
+
+      if (rudp_drop()) continue;
+      out_iov[n].iov_base = d;
+      out_iov[n].iov_len = sizeof(*d) + len;
+      out_msg[n].msg_hdr = (struct msghdr) {
+        .msg_name = &s->peer,
+        .msg_namelen = sizeof(s->peer),
+        .msg_iov = &out_iov[n],
+        .msg_iovlen = 1,
+      };
+      n++;
+    }
+
+    int sent = 0;
+    while (sent < n) {
+      int r = sendmmsg(sd, out_msg + sent, n - sent, 0);
+      if (r < 0) {
+        /* a full socket buffer is just another lost packet */
+        if (errno != EINTR) break;
+        continue;
+      }
+      sent += r;
+    }
+  }
+  return 0;
+}
+
+static void handle_packet(int sd, unsigned char *buf, size_t len, const struct sockaddr_in *from, uint64_t now) {
+  if (len < sizeof(struct rudp_header)) return;
+  struct rudp_header *h = (struct rudp_header *) buf;
+  if (ntohs(h->magic) != RUDP_MAGIC) return;
+  uint32_t id = ntohl(h->session);
+  struct session *s;
+
+  switch (h->type) {
+  case RUDP_REQ:
+    handle_request(sd, id, from, (char *) buf + sizeof(*h), len - sizeof(*h));
+    break;
+  case RUDP_ACK:
+    if (len < sizeof(struct rudp_ack) || (s = find_session(id, from)) == NULL) break;
+    s->last_heard_us = now;
+    handle_ack(s, (struct rudp_ack *) buf, now);
+    break;
+  case RUDP_DONE: {
+    struct rudp_header fin;
+    if ((s = find_session(id, from)) != NULL) close_session(s, "done");
+    /* answered even without a session, in case our first FIN was lost */
+    rudp_header_init(&fin, RUDP_FIN, id);
+    rudp_send(sd, &fin, sizeof(fin), (const struct sockaddr *) from, sizeof(*from));
+    break;
+  }
+  }
+}
+
+/* Time until some session needs attention, in microseconds */
+static uint64_t next_deadline(uint64_t now) {
+  uint64_t wait = 1000000;
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    struct session *s = &sessions[i];
+    if (!s->used) continue;
+    uint64_t at = s->last_heard_us + IDLE_TIMEOUT_US;
+    if (s->started && s->inflight > 0 && s->last_ack_us + timer_delay(s) < at) at = s->last_ack_us + timer_delay(s);
+    if (can_send(s) && s->next_send_us < at) at = s->next_send_us;
+    if (at <= now) return 0;
+    if (at - now < wait) wait = at - now;
+  }
+  return wait;
+}
+
+int main(int argc, char *argv[]) {
+  int port = RUDP_DEFAULT_PORT;
+  const char *root = "data";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:r:L:S:")) != -1) {
+    switch (opt) {
+    case 'p': port = atoi(optarg); break;
+    case 'r': root = optarg; break;
+    case 'L': rudp_loss = atof(optarg); break;
+    case 'S': rudp_loss_seed = atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-p port] [-r root] [-L loss%%] [-S seed]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  if ((root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    perror(root);
+    exit(1);
+  }
+  int sd = open_socket(port);
+  if (sd < 0) exit(1);
+  printf("Serving %s on port %d\n", root, port);
+  fflush(stdout);
+
+  unsigned char in_buf[BATCH][RUDP_MAX_PACKET];
+  struct sockaddr_in remote[BATCH];
+  struct iovec in_iov[BATCH];
+  struct mmsghdr in_msg[BATCH];
+  for (int i = 0; i < BATCH; i++) {
+    in_iov[i].iov_base = in_buf[i];
+    in_iov[i].iov_len = RUDP_MAX_PACKET;
+    in_msg[i].msg_hdr = (struct msghdr) {
+      .msg_name = &remote[i],
+      .msg_iov = &in_iov[i],
+      .msg_iovlen = 1,
+    };
+  }
+
+  while (1) {
+    uint64_t wait = next_deadline(rudp_now_us());
+    struct timespec timeout = { wait / 1000000, (wait % 1000000) * 1000 };
+    struct pollfd pfd = { sd, POLLIN, 0 };
+    if (ppoll(&pfd, 1, &timeout, NULL) < 0 && errno != EINTR) {
+      perror("ppoll");
+      exit(1);
+    }
+
+    if (pfd.revents & POLLIN) {
+      int n;
+      do {
+        for (int i = 0; i < BATCH; i++) in_msg[i].msg_hdr.msg_namelen = sizeof(remote[i]);
+        n = recvmmsg(sd, in_msg, BATCH, MSG_DONTWAIT, NULL);
+        uint64_t now = rudp_now_us();
+        for (int i = 0; i < n; i++) handle_packet(sd, in_buf[i], in_msg[i].msg_len, &remote[i], now);
+      } while (n == BATCH);
+    }
+
+    uint64_t now = rudp_now_us();
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      struct session *s = &sessions[i];
+      if (!s->used) continue;
+      if (now - s->last_heard_us > IDLE_TIMEOUT_US) {
+        close_session(s, "timed out");
+        continue;
+      }
+      check_timeout(s, now);
+      if (pump(sd, s, now) < 0) close_session(s, "read error");
+    }
+  }
+  return 0;
+}
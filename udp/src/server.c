@@ -1,89 +1,237 @@
+#define _GNU_SOURCE     /* recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>     /* defines STDIN_FILENO, system calls,etc */
+#include <pthread.h>
 #include <sys/types.h>  /* system data type definitions */
 #include <sys/socket.h> /* socket specific definitions */
 #include <netinet/in.h> /* INET constants and stuff */
 #include <arpa/inet.h>  /* IP address conversion stuff */
 #include <netdb.h>      /* gethostbyname */
 
-#define MAXBUF 1024*1024
+/* Echo server: every datagram comes back prefixed with "<sequence number> ".
+
+   Build: gcc -O2 -pthread -o server server.c
+   Usage: server [-p port] [-t threads] [-v] [-r]
+     -t  shards, one thread and one SO_REUSEPORT socket each (default: one per core)
+     -v  print every datagram (slow, for debugging only)
+     -r  print the packet rate and the send errors so far once a second
+
+   Each shard moves up to BATCH datagrams per recvmmsg()/sendmmsg() pair. All
+   buffers are allocated when the shard starts, and a reply is sent straight
+   out of the buffer the request arrived in, behind a separate iovec holding
+   the sequence number, so nothing is copied or formatted with printf on the
+   way. The kernel spreads clients over the shards by address, so a client
+   always talks to the same shard and its sequence numbers stay in order. */
+
+#define MAXBUF 65536       /* receive buffer per datagram */
+#define MAX_DATAGRAM 65507 /* largest UDP payload over IPv4 */
+#define BATCH 64
+#define DEFAULT_PORT 9876
+
+struct shard {
+  int id;
+  int sd;
+  pthread_t thread;
+  unsigned long sequence_number;
+  unsigned long long packets;           /* read by the -r reporter */
+  unsigned long long send_errors;       /* replies the kernel refused, also reported */
+  char *bufin;                          /* BATCH buffers of MAXBUF */
+  struct sockaddr_in remote[BATCH];
+  struct iovec iov_in[BATCH];
+  struct iovec iov_out[BATCH][2];       /* sequence number, then the payload */
+  char prefix[BATCH][24];
+  struct mmsghdr msg_in[BATCH];
+  struct mmsghdr msg_out[BATCH];
+};
+
+static int verbose = 0;
+
+/* Writes n and a space into out, returns the length; snprintf is too slow here */
+static size_t format_sequence(char *out, unsigned long n) {
+  char digits[24];
+  size_t len = 0;
+  do {
+    digits[len++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  for (size_t i = 0; i < len; i++) out[i] = digits[len - 1 - i];
+  out[len] = ' ';
+  return len + 1;
+}
+
+static int open_socket(int port) {
+  int sd, one = 1;
+  struct sockaddr_in skaddr;
+
+  if ((sd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+    perror("Problem creating socket");
+    return -1;
+  }
+
+  /* every shard binds the same port; the kernel load-balances between them */
+  if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+    perror("SO_REUSEPORT");
+    close(sd);
+    return -1;
+  }
+
+  /* deeper queues absorb bursts while a shard is busy sending */
+  int bufsize = 4 * 1024 * 1024;
+  setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  memset(&skaddr, 0, sizeof(skaddr));
+  skaddr.sin_family = AF_INET;
+  skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  skaddr.sin_port = htons(port);
 
-void uppercase(char *p) {
-  for ( ; *p; ++p) *p = toupper(*p);
+  if (bind(sd, (struct sockaddr *) &skaddr, sizeof(skaddr)) < 0) {
+    perror("Problem binding");
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+static int shard_init(struct shard *s) {
+  s->bufin = malloc((size_t) BATCH * MAXBUF);
+  if (s->bufin == NULL) return -1;
+
+  for (int i = 0; i < BATCH; i++) {
+    s->iov_in[i].iov_base = s->bufin + (size_t) i * MAXBUF;
+    s->iov_in[i].iov_len = MAXBUF;
+    s->msg_in[i].msg_hdr = (struct msghdr) {
+      .msg_name = &s->remote[i],
+      .msg_iov = &s->iov_in[i],
+      .msg_iovlen = 1,
+    };
+
+    s->iov_out[i][0].iov_base = s->prefix[i];
+    s->iov_out[i][1].iov_base = s->iov_in[i].iov_base;
+    s->msg_out[i].msg_hdr = (struct msghdr) {
+      .msg_name = &s->remote[i],
+      .msg_iov = s->iov_out[i],
+      .msg_iovlen = 2,
+    };
+  }
+  return 0;
 }
 
-void echo(int sd) {
-    char bufin[MAXBUF];
-    struct sockaddr_in remote;
-    int sequence_number = 0; 
-
-    /* need to know how big address struct is, len must be set before the
-       call to recvfrom!!! */
-    socklen_t len = sizeof(remote);
-
-    while (1) {
-      /* read a datagram from the socket (put result in bufin) */
-      int n = recvfrom(sd, bufin, MAXBUF, 0, (struct sockaddr *) &remote, &len);
-
-      if (n < 0) {
-        perror("Error receiving data");
-      } else {
-        sequence_number++;
-        char bufout[MAXBUF];
-        snprintf(bufout, MAXBUF, "%d %s", sequence_number, bufin);
-        printf("%s\n", bufout);
-        /* Got something, just send it back */
-        sendto(sd, bufout, strlen(bufout), 0, (struct sockaddr *)&remote, len);
+static void echo(struct shard *s) {
+  while (1) {
+    /* need to know how big address struct is, namelen must be reset before
+       every call to recvmmsg!!! */
+    for (int i = 0; i < BATCH; i++) s->msg_in[i].msg_hdr.msg_namelen = sizeof(s->remote[i]);
+
+    /* block for the first datagram, then take whatever else is already queued */
+    int n = recvmmsg(s->sd, s->msg_in, BATCH, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+      if (errno != EINTR) perror("Error receiving data");
+      continue;
+    }
+
+    for (int i = 0; i < n; i++) {
+      size_t payload = s->msg_in[i].msg_len;
+      size_t prefix = format_sequence(s->prefix[i], ++s->sequence_number);
+      /* the prefix must still fit in one datagram with a maximum-sized payload */
+      if (payload > MAX_DATAGRAM - prefix) payload = MAX_DATAGRAM - prefix;
+      s->iov_out[i][0].iov_len = prefix;
+      s->iov_out[i][1].iov_len = payload;
+      s->msg_out[i].msg_hdr.msg_namelen = s->msg_in[i].msg_hdr.msg_namelen;
+
+      if (verbose) {
+        printf("[%d] %.*s%.*s\n", s->id, (int) prefix, s->prefix[i], (int) payload, (char *) s->iov_in[i].iov_base);
       }
     }
+
+    /* Got something, just send it back; sendmmsg() may stop early */
+    int sent = 0;
+    while (sent < n) {
+      int r = sendmmsg(s->sd, s->msg_out + sent, n - sent, 0);
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        /* the error is for msg_out[sent] alone; skip it so the rest still get their echo */
+        __atomic_add_fetch(&s->send_errors, 1, __ATOMIC_RELAXED);
+        sent++;
+        continue;
+      }
+      sent += r;
+    }
+    __atomic_add_fetch(&s->packets, n, __ATOMIC_RELAXED);
+  }
 }
 
-/* server main routine */
+static void *shard_main(void *arg) {
+  echo(arg);
+  return NULL;
+}
 
-int main() {
-  int ld;
-  struct sockaddr_in skaddr;
-  socklen_t length;
+/* server main routine */
 
-  /* create a socket
-     IP protocol family (PF_INET)
-     UDP protocol (SOCK_DGRAM)
-  */
+int main(int argc, char *argv[]) {
+  int port = DEFAULT_PORT;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int report = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:t:vr")) != -1) {
+    switch (opt) {
+    case 'p': port = atoi(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'v': verbose = 1; break;
+    case 'r': report = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-p port] [-t threads] [-v] [-r]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (threads < 1) threads = 1;
 
-  if ((ld = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
-    printf("Problem creating socket\n");
+  struct shard *shards = calloc(threads, sizeof(struct shard));
+  if (shards == NULL) {
+    perror("calloc");
     exit(1);
   }
 
-  /* establish our address
-     address family is AF_INET
-     our IP address is INADDR_ANY (any of our IP addresses)
-     the port number is 9876
-  */
-
-  skaddr.sin_family = AF_INET;
-  skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  skaddr.sin_port = htons(9876);
-
-  if (bind(ld, (struct sockaddr *) &skaddr, sizeof(skaddr)) < 0) {
-    printf("Problem binding\n");
-    exit(0);
+  for (int i = 0; i < threads; i++) {
+    shards[i].id = i;
+    if ((shards[i].sd = open_socket(port)) < 0 || shard_init(&shards[i]) < 0) exit(1);
   }
 
   /* find out what port we were assigned and print it out */
-
-  length = sizeof(skaddr);
-  if (getsockname(ld, (struct sockaddr *) &skaddr, &length) < 0) {
+  struct sockaddr_in skaddr;
+  socklen_t length = sizeof(skaddr);
+  if (getsockname(shards[0].sd, (struct sockaddr *) &skaddr, &length) < 0) {
     printf("Error getsockname\n");
     exit(1);
   }
+  printf("Server listening on port %d with %d shards\n", ntohs(skaddr.sin_port), threads);
+  fflush(stdout);
 
-  printf("Server listening on port %d\n", ntohs(skaddr.sin_port));
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  /* the rate report reads the counters once a second, off the shards' path */
+  unsigned long long last = 0;
+  while (report) {
+    sleep(1);
+    unsigned long long total = 0, errors = 0;
+    for (int i = 0; i < threads; i++) {
+      total += __atomic_load_n(&shards[i].packets, __ATOMIC_RELAXED);
+      errors += __atomic_load_n(&shards[i].send_errors, __ATOMIC_RELAXED);
+    }
+    printf("%llu packets/s, %llu send errors\n", total - last, errors);
+    fflush(stdout);
+    last = total;
+  }
 
-  /* Go echo every datagram we get */
-  echo(ld);
+  pthread_join(shards[0].thread, NULL);
   return 0;
 }